@@ -36,8 +36,8 @@ main(int argc, char *argv[])
   src  = (char *)malloc(len);
   fread(src, 1, len, ifile);
 
-  /* Allocate "uncompressed size" + 400 for the destination buffer */
-  dst = (char *)malloc(len + 400);
+  /* Allocate qlz_compress_bound("uncompressed size") for the destination */
+  dst = (char *)malloc(qlz_compress_bound(len));
 
   /* Compress and write result */
   len2 = qlz_compress(src, dst, len, state_compress);
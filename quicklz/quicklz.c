@@ -16,9 +16,38 @@
 /* QuickLZ 1.5.1 BETA 7 */
 
 #include "quicklz.h"
+
+/*
+ * With QLZ_COMPRESSION_LEVEL 0, GCC builds for x86-64 compile the
+ * compressors again for AVX2 and AVX-512 and pick one on the processor
+ * at runtime, unless the build already assumes AVX2 or defines
+ * QLZ_NO_DISPATCH.
+ */
+
+#if QLZ_COMPRESSION_LEVEL == 0 && defined __GNUC__ && defined __x86_64__ \
+  && !defined __clang__ && !defined __INTEL_COMPILER                   \
+  && !defined __AVX2__ && !defined QLZ_NO_DISPATCH
+# define QLZ_DISPATCH
+#endif
+
 #if defined _MSC_VER
 # include <intrin.h>
 #endif /* if defined _MSC_VER */
+#if defined __AVX2__ || defined QLZ_DISPATCH
+# include <immintrin.h>
+#elif defined __SSE2__ || defined _M_X64
+# include <emmintrin.h>
+#endif /* if defined __AVX2__ || defined QLZ_DISPATCH */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+/* The segments qlz_compressv() gathers, named even where it is not built */
+#ifdef QLZ_IOVEC
+# include <sys/uio.h>
+#else  /* ifdef QLZ_IOVEC */
+struct iovec;
+#endif /* ifdef QLZ_IOVEC */
 
 #if QLZ_VERSION_MAJOR     != 1 \
   || QLZ_VERSION_MINOR    != 5 \
@@ -26,126 +55,55 @@
 # error quicklz.c and quicklz.h version mismatch
 #endif
 
+/*
+ * Level independent definitions. These are skipped when the file
+ * is included again to build a level for QLZ_COMPRESSION_LEVEL 0.
+ */
+
+#ifndef QLZ_COMMON
+# define QLZ_COMMON
+
 #if ( defined( __X86__ ) || defined( __i386__ ) || defined( i386 )       \
   || defined( _M_IX86 )  || defined( __386__ )  || defined( __x86_64__ ) \
   || defined( _M_X64 ))
 # define X86X64
 #endif
 
+/* SSE2 is part of x86-64; wider extensions are checked per engine */
+#if defined X86X64 && ( defined __SSE2__ || defined _M_X64 )
+# define X86_SSE2
+#endif
+
 #define MINOFFSET                           2
 #define UNCONDITIONAL_MATCHLEN_COMPRESSOR   12
 #define UNCONDITIONAL_MATCHLEN_DECOMPRESSOR 6
 #define UNCOMPRESSED_END                    4
 #define CWORD_LEN                           4
+#define SMALL_HASH_BITS                     12
+#define BATCH_MAX                           4096
 
-#if QLZ_COMPRESSION_LEVEL == 1 \
-  && defined QLZ_PTR_64        \
-  && QLZ_STREAMING_BUFFER == 0
-# define OFFSET_BASE   source
-# define CAST          (ui32)(size_t)
-#else
-# define OFFSET_BASE   0
-# define CAST
-#endif
+/*
+ * Bytes that the decompressor may write past the point where it is
+ * stopped, which it checks once per control word: 31 matches of up to
+ * 258 bytes, and the last one copied in chunks.
+ */
+#define HEAD_SLACK                          ( 31 * 258 + 32 )
 
 #if defined( X86X64 ) && ( defined( __GNUC__ ) \
  || defined( __INTEL_COMPILER ))
 # define qlz_likely(x)     __builtin_expect(x, 1)
 # define qlz_unlikely(x)   __builtin_expect(x, 0)
+# define qlz_prefetch(p)   __builtin_prefetch(p)
 #else
 # define qlz_likely(x)     ( x )
 # define qlz_unlikely(x)   ( x )
+# define qlz_prefetch(p)   ( (void)( p ))
 #endif
 
-int
-qlz_get_setting(int setting)
-{
-  switch (setting)
-    {
-    case 0:
-      return QLZ_COMPRESSION_LEVEL;  //-V1037
-
-    case 1:
-      return sizeof ( qlz_state_compress );
-
-    case 2:
-      return sizeof ( qlz_state_decompress );
-
-    case 3:
-      return QLZ_STREAMING_BUFFER;
-
-#ifdef QLZ_MEMORY_SAFE
-        case 6:
-          return 1;
-
-#else  /* ifdef QLZ_MEMORY_SAFE */
-        case 6:
-          return 0;
-
-#endif /* ifdef QLZ_MEMORY_SAFE */
-        case 7:
-          return QLZ_VERSION_MAJOR; //-V1037
-
-        case 8:
-          return QLZ_VERSION_MINOR;
-
-        case 9:
-          return QLZ_VERSION_REVISION;
-    }
-  return -1;
-}
-
-#if QLZ_COMPRESSION_LEVEL == 1
-  static int
-  same(const unsigned char *src, size_t n)
-  {
-    while (n > 0 && *( src + n ) == *src)
-      {
-        n--;
-      }
-    return n == 0 ? 1 : 0;
-  }
-#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
-
-static void
-reset_table_compress(qlz_state_compress *state)
-{
-  int i;
-
-  for (i = 0; i < QLZ_HASH_VALUES; i++)
-    {
-#if QLZ_COMPRESSION_LEVEL == 1
-        state->hash[i].offset   = 0;
-#else  /* if QLZ_COMPRESSION_LEVEL == 1 */
-        state->hash_counter[i]  = 0;
-#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
-    }
-}
-
-static void
-reset_table_decompress(qlz_state_decompress *state)
-{
-  int i;
-
-  (void)state;
-  (void)i;
-#if QLZ_COMPRESSION_LEVEL == 2
-    for (i = 0; i < QLZ_HASH_VALUES; i++)
-      {
-        state->hash_counter[i] = 0;
-      }
-#endif /* if QLZ_COMPRESSION_LEVEL == 2 */
-}
-
-static __inline ui32
-hash_func(ui32 i)
-{
-#if QLZ_COMPRESSION_LEVEL == 2
-    return (( i >> 9 ) ^ ( i >> 13 ) ^ i ) & ( QLZ_HASH_VALUES - 1 );
-#else  /* if QLZ_COMPRESSION_LEVEL == 2 */
-    return (( i >> 12 ) ^ i ) & ( QLZ_HASH_VALUES - 1 );
-#endif /* if QLZ_COMPRESSION_LEVEL == 2 */
-}
+/* Linkage of the public functions, overridden by quicklz.hpp */
+#ifndef QLZ_API
+# define QLZ_API
+#endif
 
 static __inline ui32
 fast_read(void const *src, ui32 bytes)
@@ -179,16 +137,6 @@ fast_read(void const *src, ui32 bytes)
 #endif /* ifndef X86X64 */
 }
 
-static __inline ui32
-hashat(const unsigned char *src)
-{
-  ui32 fetch, hash;
-
-  fetch  = fast_read(src, 3);
-  hash   = hash_func(fetch);
-  return hash;
-}
-
 static __inline void
 fast_write(ui32 f, void *dst, size_t bytes)
 {
@@ -241,7 +189,7 @@ fast_write(ui32 f, void *dst, size_t bytes)
 #endif /* ifndef X86X64 */
 }
 
-size_t
+QLZ_API size_t
 qlz_size_decompressed(const char *source)
 {
   ui32 n, r;
@@ -252,7 +200,7 @@ qlz_size_decompressed(const char *source)
   return r;
 }
 
-size_t
+QLZ_API size_t
 qlz_size_compressed(const char *source)
 {
   ui32 n, r;
@@ -263,7 +211,7 @@ qlz_size_compressed(const char *source)
   return r;
 }
 
-size_t
+QLZ_API size_t
 qlz_size_header(const char *source)
 {
   size_t n = 2 * (((( *source ) & 2 ) == 2 ) ? 4 : 1 ) + 1;
@@ -271,6 +219,56 @@ qlz_size_header(const char *source)
   return n;
 }
 
+/*
+ * SS bits of the header for a streaming buffer size: 0 without
+ * streaming, 1 and 2 for the sizes suggested in quicklz.h and 3
+ * for any other size.
+ */
+
+static __inline int
+stream_bits(size_t streaming_buffer)
+{
+  return streaming_buffer == 0
+           ? 0
+           : ( streaming_buffer == 100000
+                  ? 1
+                  : ( streaming_buffer == 1000000 ? 2 : 3 ));
+}
+
+/*
+ * Copy size bytes to dst from source or, if source is NULL, from the
+ * segments of iov one after the other. Nothing is copied if source is
+ * dst already, as it is for the region of qlz_compress_reserve().
+ */
+
+static __inline void
+qlz_gather(unsigned char *dst, const void *source, const struct iovec *iov,
+           size_t size)
+{
+  if (source != NULL)
+    {
+      if (source != dst)
+        {
+          memcpy(dst, source, size);
+        }
+
+      return;
+    }
+
+#ifdef QLZ_IOVEC
+    for (; size > 0; iov++)
+      {
+        size_t n = iov->iov_len < size ? iov->iov_len : size;
+
+        memcpy(dst, iov->iov_base, n);
+        dst   += n;
+        size  -= n;
+      }
+#else  /* ifdef QLZ_IOVEC */
+    (void)iov;
+#endif /* ifdef QLZ_IOVEC */
+}
+
 static __inline void
 memcpy_up(unsigned char *dst, const unsigned char *src, ui32 n)
 {
@@ -299,794 +297,4581 @@ memcpy_up(unsigned char *dst, const unsigned char *src, ui32 n)
 #endif /* ifndef X86X64 */
 }
 
+/*
+ * Copy a match of n bytes from o to dst, which is at least
+ * MINOFFSET + 1 bytes after o, in chunks of 8 or 16 bytes. Up to
+ * WILD_COPY_MARGIN bytes after dst + n may be written.
+ *
+ * A short offset repeats a pattern that is shorter than a chunk, so
+ * the first 8 bytes are copied in two halves and o is moved back to
+ * a multiple of the offset that is at least 8 bytes behind dst.
+ */
+
+#define WILD_COPY_MARGIN 16
+
 static __inline void
-update_hash(qlz_state_decompress *state, const unsigned char *s)
+wild_copy_match(unsigned char *dst, const unsigned char *o, ui32 n)
 {
-#if QLZ_COMPRESSION_LEVEL == 1
-    ui32 hash;
-    hash                       = hashat(s);
-    state->hash[hash].offset   = s;
-    state->hash_counter[hash]  = 1;
-#elif QLZ_COMPRESSION_LEVEL == 2
-    ui32           hash;
-    unsigned char  c;
-    hash = hashat(s);
-    c = state->hash_counter[hash];
-    state->hash[hash].offset[c & ( QLZ_POINTERS - 1 )] = s;
-    c++;
-    state->hash_counter[hash] = c;
-#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
-  (void)state;
-  (void)s;
+  static const unsigned char inc[8]  = { 0, 1, 2, 1, 4, 4, 4, 4 };
+  static const unsigned char dec[8]  = { 8, 8, 8, 7, 8, 9, 10, 11 };
+  unsigned char * const      end     = dst + n;
+  size_t                     offset  = dst - o;
+
+  if (offset < 8)
+    {
+      dst[0]  = o[0];
+      dst[1]  = o[1];
+      dst[2]  = o[2];
+      dst[3]  = o[3];
+      o      += inc[offset];
+      memcpy(dst + 4, o, 4);
+      o      -= dec[offset];
+      o      += 8;
+      dst    += 8;
+      offset  = dst - o;
+    }
+
+#ifdef X86_SSE2
+    if (offset >= 16)
+      {
+        do
+          {
+            _mm_storeu_si128((__m128i *)dst,
+                             _mm_loadu_si128((const __m128i *)o));
+            dst  += 16;
+            o    += 16;
+          }
+        while (dst < end);
+        return;
+      }
+#endif /* ifdef X86_SSE2 */
+  while (dst < end)
+    {
+      memcpy(dst, o, 8);
+      dst  += 8;
+      o    += 8;
+    }
 }
 
-#if QLZ_COMPRESSION_LEVEL <= 2
-  static void
-  update_hash_upto(qlz_state_decompress *state, unsigned char **lh,
-                   const unsigned char *max)
-  {
-    while (*lh < max)
+/* Index of the lowest set bit of x, which must not be 0 */
+static __inline ui32
+lowest_bit(ui32 x)
+{
+#if defined _MSC_VER || defined __INTEL_COMPILER
+    unsigned long index = 0;
+    _BitScanForward(&index, x);
+    return (ui32)index;
+#elif defined __GNUC__
+    return (ui32)__builtin_ctz(x);
+#else  /* if defined _MSC_VER || defined __INTEL_COMPILER */
+    ui32 index = 0;
+    while (( x & 1 ) == 0)
       {
-        ( *lh )++;
-        update_hash(state, *lh);
+        x >>= 1;
+        index++;
       }
+    return index;
+#endif /* if defined _MSC_VER || defined __INTEL_COMPILER */
+}
+
+#endif /* ifndef QLZ_COMMON */
+
+#if QLZ_COMPRESSION_LEVEL == 0
+
+/*
+ * Runtime selectable levels. The engine in the #else branch below is
+ * compiled six times, once for each level with and without streaming,
+ * and the public functions dispatch to it on the level of the state or
+ * on the header of the packet.
+ */
+
+# undef  QLZ_STREAMING_BUFFER
+# define QLZ_STREAMING_BUFFER     0
+
+# undef  QLZ_API
+# define QLZ_API                  static
+# define QLZ_RUNTIME_ENGINES
+
+# ifdef QLZ_DISPATCH
+
+/*
+ * The engines built for a target share the states of the plain one,
+ * and only their compressors are called. Targets nest, so that the
+ * AVX-512 one is built with AVX2 as well.
+ */
+
+#  define QLZ_TARGET_STATES(suffix)                                          \
+  typedef qlz_hash_compress ## suffix                                     \
+          qlz_hash_compress ## suffix ## _avx2;                           \
+  typedef qlz_hash_decompress ## suffix                                   \
+          qlz_hash_decompress ## suffix ## _avx2;                         \
+  typedef qlz_state_compress ## suffix                                    \
+          qlz_state_compress ## suffix ## _avx2;                          \
+  typedef qlz_state_decompress ## suffix                                  \
+          qlz_state_decompress ## suffix ## _avx2;                        \
+  typedef qlz_hash_compress ## suffix                                     \
+          qlz_hash_compress ## suffix ## _avx512;                         \
+  typedef qlz_hash_decompress ## suffix                                   \
+          qlz_hash_decompress ## suffix ## _avx512;                       \
+  typedef qlz_state_compress ## suffix                                    \
+          qlz_state_compress ## suffix ## _avx512;                        \
+  typedef qlz_state_decompress ## suffix                                  \
+          qlz_state_decompress ## suffix ## _avx512;
+#  define QLZ_PRAGMA(x)            _Pragma(#x)
+#  define QLZ_TARGET_BEGIN(isa)    QLZ_PRAGMA(GCC push_options)              \
+                                   QLZ_PRAGMA(GCC target(isa))
+#  define QLZ_TARGET_END           QLZ_PRAGMA(GCC pop_options)
+#  undef  QLZ_API
+#  define QLZ_API                  static __attribute__((unused))
+
+/* Call the engine built for the best target this processor has */
+#  define QLZ_TARGET_CALL(name, args)  ( qlz_target_select()->name args )
+# else  /* ifdef QLZ_DISPATCH */
+#  define QLZ_TARGET_CALL(name, args)  name args
+# endif /* ifdef QLZ_DISPATCH */
+
+# undef  QLZ_COMPRESSION_LEVEL
+# define QLZ_COMPRESSION_LEVEL    1
+# define QLZ_INSTANCE(name)       name ## _1
+# include "quicklz.c"
+# ifdef QLZ_DISPATCH
+QLZ_TARGET_STATES(_1)
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _1_avx2
+QLZ_TARGET_BEGIN("avx2")
+#  include "quicklz.c"
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _1_avx512
+QLZ_TARGET_BEGIN("avx512f,avx512bw")
+#  include "quicklz.c"
+QLZ_TARGET_END
+QLZ_TARGET_END
+# endif /* ifdef QLZ_DISPATCH */
+# undef  QLZ_HEADER_STATE
+# undef  QLZ_INSTANCE
+# define QLZ_STREAMING_DYNAMIC
+# define QLZ_INSTANCE(name)       name ## _1s
+# include "quicklz.c"
+# ifdef QLZ_DISPATCH
+QLZ_TARGET_STATES(_1s)
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _1s_avx2
+QLZ_TARGET_BEGIN("avx2")
+#  include "quicklz.c"
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _1s_avx512
+QLZ_TARGET_BEGIN("avx512f,avx512bw")
+#  include "quicklz.c"
+QLZ_TARGET_END
+QLZ_TARGET_END
+# endif /* ifdef QLZ_DISPATCH */
+# undef  QLZ_HEADER_STATE
+# undef  QLZ_INSTANCE
+# undef  QLZ_STREAMING_DYNAMIC
+
+# undef  QLZ_COMPRESSION_LEVEL
+# define QLZ_COMPRESSION_LEVEL    2
+# define QLZ_INSTANCE(name)       name ## _2
+# include "quicklz.c"
+# ifdef QLZ_DISPATCH
+QLZ_TARGET_STATES(_2)
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _2_avx2
+QLZ_TARGET_BEGIN("avx2")
+#  include "quicklz.c"
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _2_avx512
+QLZ_TARGET_BEGIN("avx512f,avx512bw")
+#  include "quicklz.c"
+QLZ_TARGET_END
+QLZ_TARGET_END
+# endif /* ifdef QLZ_DISPATCH */
+# undef  QLZ_HEADER_STATE
+# undef  QLZ_INSTANCE
+# define QLZ_STREAMING_DYNAMIC
+# define QLZ_INSTANCE(name)       name ## _2s
+# include "quicklz.c"
+# ifdef QLZ_DISPATCH
+QLZ_TARGET_STATES(_2s)
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _2s_avx2
+QLZ_TARGET_BEGIN("avx2")
+#  include "quicklz.c"
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _2s_avx512
+QLZ_TARGET_BEGIN("avx512f,avx512bw")
+#  include "quicklz.c"
+QLZ_TARGET_END
+QLZ_TARGET_END
+# endif /* ifdef QLZ_DISPATCH */
+# undef  QLZ_HEADER_STATE
+# undef  QLZ_INSTANCE
+# undef  QLZ_STREAMING_DYNAMIC
+
+# undef  QLZ_COMPRESSION_LEVEL
+# define QLZ_COMPRESSION_LEVEL    3
+# define QLZ_INSTANCE(name)       name ## _3
+# include "quicklz.c"
+# ifdef QLZ_DISPATCH
+QLZ_TARGET_STATES(_3)
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _3_avx2
+QLZ_TARGET_BEGIN("avx2")
+#  include "quicklz.c"
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _3_avx512
+QLZ_TARGET_BEGIN("avx512f,avx512bw")
+#  include "quicklz.c"
+QLZ_TARGET_END
+QLZ_TARGET_END
+# endif /* ifdef QLZ_DISPATCH */
+# undef  QLZ_HEADER_STATE
+# undef  QLZ_INSTANCE
+# define QLZ_STREAMING_DYNAMIC
+# define QLZ_INSTANCE(name)       name ## _3s
+# include "quicklz.c"
+# ifdef QLZ_DISPATCH
+QLZ_TARGET_STATES(_3s)
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _3s_avx2
+QLZ_TARGET_BEGIN("avx2")
+#  include "quicklz.c"
+#  undef  QLZ_INSTANCE
+#  define QLZ_INSTANCE(name)       name ## _3s_avx512
+QLZ_TARGET_BEGIN("avx512f,avx512bw")
+#  include "quicklz.c"
+QLZ_TARGET_END
+QLZ_TARGET_END
+# endif /* ifdef QLZ_DISPATCH */
+# undef  QLZ_HEADER_STATE
+# undef  QLZ_INSTANCE
+# undef  QLZ_STREAMING_DYNAMIC
+
+# undef  QLZ_COMPRESSION_LEVEL
+# define QLZ_COMPRESSION_LEVEL    0
+# undef  QLZ_API
+# define QLZ_API
+# undef  QLZ_RUNTIME_ENGINES
+# include "quicklz.h"
+
+/* Index of the engine built for a level and streaming mode */
+# define QLZ_VARIANT(level, streaming) (( level ) * 2 + (( streaming ) != 0 ))
+
+# ifdef QLZ_DISPATCH
+
+/*
+ * The compressors built for one target, under the names of the plain
+ * engine. qlz_target_select() picks the table on the first call and
+ * keeps it, so later calls do not ask the processor again.
+ */
+
+#  ifdef QLZ_IOVEC
+#   define QLZ_TARGET_FIELDV(v)                                             \
+  size_t (*qlz_compressv_ ## v)(const struct iovec *, int, char *,        \
+                                qlz_state_compress_ ## v *);
+#   define QLZ_TARGET_ENTRYV(v)     qlz_compressv_ ## v,
+#  else  /* ifdef QLZ_IOVEC */
+#   define QLZ_TARGET_FIELDV(v)
+#   define QLZ_TARGET_ENTRYV(v)
+#  endif /* ifdef QLZ_IOVEC */
+
+#  define QLZ_TARGET_FIELD(v)                                              \
+  size_t (*qlz_compress_ ## v)(const void *, char *, size_t,              \
+                               qlz_state_compress_ ## v *);               \
+  QLZ_TARGET_FIELDV(v)
+#  define QLZ_TARGET_ENTRY(v, isa)                                         \
+  qlz_compress_ ## v ## isa, QLZ_TARGET_ENTRYV(v ## isa)
+#  define QLZ_TARGET_TABLE(isa)                                            \
+  {                                                                       \
+    QLZ_TARGET_ENTRY(1, isa) QLZ_TARGET_ENTRY(1s, isa)                    \
+    QLZ_TARGET_ENTRY(2, isa) QLZ_TARGET_ENTRY(2s, isa)                    \
+    QLZ_TARGET_ENTRY(3, isa) QLZ_TARGET_ENTRY(3s, isa)                    \
+    qlz_compress_small_3 ## isa, qlz_compress_batch_3 ## isa              \
   }
-#endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
 
-static size_t
-qlz_compress_core(const unsigned char *source, unsigned char *destination,
-                  size_t size, qlz_state_compress *state)
+typedef struct
 {
-  const unsigned char * last_byte  = source + size - 1;
-  const unsigned char * src        = source;
-  unsigned char *       cword_ptr  = destination;
-  unsigned char *       dst        = destination + CWORD_LEN;
-  ui32                  cword_val  = 1U << 31;
-  const unsigned char * last_matchstart
-    = last_byte - UNCONDITIONAL_MATCHLEN_COMPRESSOR - UNCOMPRESSED_END;
-  ui32                  fetch  = 0;
-  unsigned int          lits   = 0;
+  QLZ_TARGET_FIELD(1)
+  QLZ_TARGET_FIELD(1s)
+  QLZ_TARGET_FIELD(2)
+  QLZ_TARGET_FIELD(2s)
+  QLZ_TARGET_FIELD(3)
+  QLZ_TARGET_FIELD(3s)
+  size_t (*qlz_compress_small_3)(const void *, char *, size_t);
+  size_t (*qlz_compress_batch_3)(qlz_batch *, size_t);
+} qlz_target;
 
-  (void)lits;
+static const qlz_target qlz_target_plain   = QLZ_TARGET_TABLE();
+static const qlz_target qlz_target_avx2    = QLZ_TARGET_TABLE(_avx2);
+static const qlz_target qlz_target_avx512  = QLZ_TARGET_TABLE(_avx512);
 
-  if (src <= last_matchstart)
+static const qlz_target *
+qlz_target_select(void)
+{
+  static const qlz_target * target = NULL;
+  const qlz_target *        t      = __atomic_load_n(&target,
+                                                     __ATOMIC_RELAXED);
+
+  if (t == NULL)
     {
-      fetch = fast_read(src, 3);
-      (void)fetch;
+      __builtin_cpu_init();
+      t = __builtin_cpu_supports("avx512bw") ? &qlz_target_avx512
+          : __builtin_cpu_supports("avx2") ? &qlz_target_avx2
+          : &qlz_target_plain;
+      __atomic_store_n(&target, t, __ATOMIC_RELAXED);
     }
 
-  while (qlz_likely(src <= last_matchstart))
+  return t;
+}
+
+# endif /* ifdef QLZ_DISPATCH */
+
+struct qlz_state_compress
+{
+  int             level;
+  int             acceleration;
+  size_t          streaming_buffer;
+  size_t          stream_window;
+  unsigned char * stream_buffer;
+  union
     {
-      if (qlz_unlikely(( cword_val & 1 ) == 1))
-        {
-          /* Store uncompressed if compression ratio is too low */
-          if (src > source + ( size >> 1 )
-              && dst - destination > src - source - (( src - source ) >> 5 ))
-            {
-              return 0;
-            }
+      qlz_state_compress_1  l1;
+      qlz_state_compress_1s l1s;
+      qlz_state_compress_2  l2;
+      qlz_state_compress_2s l2s;
+      qlz_state_compress_3  l3;
+      qlz_state_compress_3s l3s;
+    } u;
+};
 
-          fast_write(( cword_val >> 1 ) | ( 1U << 31 ), cword_ptr, CWORD_LEN);
+struct qlz_state_decompress
+{
+  int             level;
+  size_t          streaming_buffer;
+  size_t          streaming_other;
+  size_t          stream_window;
+  unsigned char * stream_buffer;
+  size_t          stream_capacity;
+  union
+    {
+      qlz_state_decompress_1  l1;
+      qlz_state_decompress_1s l1s;
+      qlz_state_decompress_2  l2;
+      qlz_state_decompress_2s l2s;
+      qlz_state_decompress_3  l3;
+      qlz_state_decompress_3s l3s;
+    } u;
+};
 
-          cword_ptr   = dst;
-          dst        += CWORD_LEN;
-          cword_val   = 1U << 31;
-          (void)cword_val;
-          fetch       = fast_read(src, 3);
-          (void)fetch;
-        }
+/*
+ * Allocate a compression state for the given level (1, 2 or 3). A
+ * non-zero streaming_buffer enables streaming mode with a history of
+ * that many bytes, which is allocated apart from the hash tables.
+ */
 
+qlz_state_compress *
+qlz_state_compress_new(int level, size_t streaming_buffer)
+{
+  qlz_state_compress * state;
+  unsigned char *      stream_buffer;
+  size_t               size;
+
+  switch (QLZ_VARIANT(level, streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 0):
+      size = sizeof ( qlz_state_compress_1 );
+      break;
+
+    case QLZ_VARIANT(1, 1):
+      size = sizeof ( qlz_state_compress_1s );
+      break;
+
+    case QLZ_VARIANT(2, 0):
+      size = sizeof ( qlz_state_compress_2 );
+      break;
+
+    case QLZ_VARIANT(2, 1):
+      size = sizeof ( qlz_state_compress_2s );
+      break;
+
+    case QLZ_VARIANT(3, 0):
+      size = sizeof ( qlz_state_compress_3 );
+      break;
+
+    case QLZ_VARIANT(3, 1):
+      size = sizeof ( qlz_state_compress_3s );
+      break;
+
+    default:
+      return NULL;
+    }
+
+  if (streaming_buffer > 0xffffffff)
+    {
+      return NULL;
+    }
+
+  size   += offsetof(qlz_state_compress, u);
+  state   = (qlz_state_compress *)malloc(size);
+  if (state == NULL)
+    {
+      return NULL;
+    }
+
+  memset(state, 0, size);
+  state->level             = level;
+  state->streaming_buffer  = streaming_buffer;
+  stream_buffer            = NULL;
+  if (streaming_buffer > 0)
+    {
+      stream_buffer = (unsigned char *)malloc(streaming_buffer);
+      if (stream_buffer == NULL)
+        {
+          free(state);
+          return NULL;
+        }
+
+      state->stream_buffer = stream_buffer;
+    }
+
+  switch (QLZ_VARIANT(level, streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 1):
+      state->u.l1s.stream_buffer  = stream_buffer;
+      state->u.l1s.stream_size    = streaming_buffer;
+      break;
+
+    case QLZ_VARIANT(2, 1):
+      state->u.l2s.stream_buffer  = stream_buffer;
+      state->u.l2s.stream_size    = streaming_buffer;
+      break;
+
+    case QLZ_VARIANT(3, 1):
+      state->u.l3s.stream_buffer  = stream_buffer;
+      state->u.l3s.stream_size    = streaming_buffer;
+      break;
+    }
+
+  return state;
+}
+
+void
+qlz_state_compress_free(qlz_state_compress *state)
+{
+  if (state != NULL)
+    {
+      free(state->stream_buffer);
+      free(state);
+    }
+}
+
+/*
+ * Allocate a decompression state. The level and the streaming buffer
+ * size are taken from the header of each packet; streaming_buffer is
+ * only needed for streams whose size is not 100000 or 1000000 bytes
+ * and that do not begin with a stream header.
+ */
+
+qlz_state_decompress *
+qlz_state_decompress_new(size_t streaming_buffer)
+{
+  qlz_state_decompress *state
+    = (qlz_state_decompress *)malloc(sizeof ( qlz_state_decompress ));
+
+  if (state == NULL)
+    {
+      return NULL;
+    }
+
+  memset(state, 0, sizeof ( qlz_state_decompress ));
+  state->streaming_other = streaming_buffer;
+  if (streaming_buffer > 0)
+    {
+      state->stream_buffer = (unsigned char *)malloc(streaming_buffer);
+      if (state->stream_buffer == NULL)
+        {
+          free(state);
+          return NULL;
+        }
+
+      state->stream_capacity = streaming_buffer;
+    }
+
+  return state;
+}
+
+void
+qlz_state_decompress_free(qlz_state_decompress *state)
+{
+  if (state != NULL)
+    {
+      free(state->stream_buffer);
+      free(state);
+    }
+}
+
+size_t
+qlz_compress(const void *source, char *destination, size_t size,
+             qlz_state_compress *state)
+{
+  switch (QLZ_VARIANT(state->level, state->streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 0):
+      return QLZ_TARGET_CALL(qlz_compress_1,
+                             (source, destination, size, &state->u.l1));
+
+    case QLZ_VARIANT(1, 1):
+      return QLZ_TARGET_CALL(qlz_compress_1s,
+                             (source, destination, size, &state->u.l1s));
+
+    case QLZ_VARIANT(2, 0):
+      return QLZ_TARGET_CALL(qlz_compress_2,
+                             (source, destination, size, &state->u.l2));
+
+    case QLZ_VARIANT(2, 1):
+      return QLZ_TARGET_CALL(qlz_compress_2s,
+                             (source, destination, size, &state->u.l2s));
+
+    case QLZ_VARIANT(3, 0):
+      return QLZ_TARGET_CALL(qlz_compress_3,
+                             (source, destination, size, &state->u.l3));
+
+    case QLZ_VARIANT(3, 1):
+      return QLZ_TARGET_CALL(qlz_compress_3s,
+                             (source, destination, size, &state->u.l3s));
+    }
+  return 0;
+}
+
+# ifdef QLZ_IOVEC
+
+size_t
+qlz_compressv(const struct iovec *iov, int iovcnt, char *destination,
+              qlz_state_compress *state)
+{
+  switch (QLZ_VARIANT(state->level, state->streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 0):
+      return QLZ_TARGET_CALL(qlz_compressv_1,
+                             (iov, iovcnt, destination, &state->u.l1));
+
+    case QLZ_VARIANT(1, 1):
+      return QLZ_TARGET_CALL(qlz_compressv_1s,
+                             (iov, iovcnt, destination, &state->u.l1s));
+
+    case QLZ_VARIANT(2, 0):
+      return QLZ_TARGET_CALL(qlz_compressv_2,
+                             (iov, iovcnt, destination, &state->u.l2));
+
+    case QLZ_VARIANT(2, 1):
+      return QLZ_TARGET_CALL(qlz_compressv_2s,
+                             (iov, iovcnt, destination, &state->u.l2s));
+
+    case QLZ_VARIANT(3, 0):
+      return QLZ_TARGET_CALL(qlz_compressv_3,
+                             (iov, iovcnt, destination, &state->u.l3));
+
+    case QLZ_VARIANT(3, 1):
+      return QLZ_TARGET_CALL(qlz_compressv_3s,
+                             (iov, iovcnt, destination, &state->u.l3s));
+    }
+  return 0;
+}
+
+# endif /* ifdef QLZ_IOVEC */
+
+size_t
+qlz_compress_small(const void *source, char *destination, size_t size)
+{
+  return QLZ_TARGET_CALL(qlz_compress_small_3, (source, destination, size));
+}
+
+size_t
+qlz_compress_batch(qlz_batch *batch, size_t count)
+{
+  return QLZ_TARGET_CALL(qlz_compress_batch_3, (batch, count));
+}
+
+/*
+ * Switch the decompression state to another level or streaming
+ * size. The history and hash tables start out empty, as they do
+ * for a zeroed state of a fixed level, and the window is kept.
+ */
+
+static int
+qlz_state_decompress_setup(qlz_state_decompress *state, int level,
+                           size_t streaming_buffer)
+{
+  if (streaming_buffer > state->stream_capacity)
+    {
+      free(state->stream_buffer);
+      state->stream_buffer    = (unsigned char *)malloc(streaming_buffer);
+      state->stream_capacity  = state->stream_buffer ? streaming_buffer : 0;
+      if (state->stream_buffer == NULL)
+        {
+          state->level = 0;
+          return 0;
+        }
+    }
+
+  memset(&state->u, 0, sizeof ( state->u ));
+  state->level             = level;
+  state->streaming_buffer  = streaming_buffer;
+
+  switch (QLZ_VARIANT(level, streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 1):
+      state->u.l1s.stream_buffer  = state->stream_buffer;
+      state->u.l1s.stream_size    = streaming_buffer;
+      state->u.l1s.stream_window  = state->stream_window;
+      break;
+
+    case QLZ_VARIANT(2, 1):
+      state->u.l2s.stream_buffer  = state->stream_buffer;
+      state->u.l2s.stream_size    = streaming_buffer;
+      state->u.l2s.stream_window  = state->stream_window;
+      break;
+
+    case QLZ_VARIANT(3, 1):
+      state->u.l3s.stream_buffer  = state->stream_buffer;
+      state->u.l3s.stream_size    = streaming_buffer;
+      state->u.l3s.stream_window  = state->stream_window;
+      break;
+    }
+
+  return 1;
+}
+
+/*
+ * Set the state up for the level and streaming bits of the packet at
+ * source. Returns the variant of the engine, or -1 on failure.
+ */
+
+static int
+qlz_state_decompress_select(const char *source, qlz_state_decompress *state)
+{
+  int     level  = ( *source >> 2 ) & 3;
+  size_t  streaming_buffer;
+
+  /*
+   * 76543210
+   * 01SSLLHC
+   */
+
+  if (( *source & 0xc0 ) != 0x40)
+    {
+      return -1;
+    }
+
+  switch (( *source >> 4 ) & 3)
+    {
+    case 0:
+      streaming_buffer = 0;
+      break;
+
+    case 1:
+      streaming_buffer = 100000;
+      break;
+
+    case 2:
+      streaming_buffer = 1000000;
+      break;
+
+    default:
+      streaming_buffer = state->streaming_other;
+      if (streaming_buffer == 0)
+        {
+          return -1;
+        }
+    }
+
+  if (level != state->level || streaming_buffer != state->streaming_buffer)
+    {
+      if (!qlz_state_decompress_setup(state, level, streaming_buffer))
+        {
+          return -1;
+        }
+    }
+
+  return QLZ_VARIANT(level, streaming_buffer);
+}
+
+size_t
+qlz_decompress(const char *source, void *destination,
+               qlz_state_decompress *state)
+{
+  switch (qlz_state_decompress_select(source, state))
+    {
+    case QLZ_VARIANT(1, 0):
+      return qlz_decompress_1(source, destination, &state->u.l1);
+
+    case QLZ_VARIANT(1, 1):
+      return qlz_decompress_1s(source, destination, &state->u.l1s);
+
+    case QLZ_VARIANT(2, 0):
+      return qlz_decompress_2(source, destination, &state->u.l2);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_decompress_2s(source, destination, &state->u.l2s);
+
+    case QLZ_VARIANT(3, 0):
+      return qlz_decompress_3(source, destination, &state->u.l3);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_decompress_3s(source, destination, &state->u.l3s);
+    }
+  return 0;
+}
+
+int
+qlz_compress_skip(size_t size, qlz_state_compress *state)
+{
+  switch (QLZ_VARIANT(state->level, state->streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 0):
+      return qlz_compress_skip_1(size, &state->u.l1);
+
+    case QLZ_VARIANT(1, 1):
+      return qlz_compress_skip_1s(size, &state->u.l1s);
+
+    case QLZ_VARIANT(2, 0):
+      return qlz_compress_skip_2(size, &state->u.l2);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_compress_skip_2s(size, &state->u.l2s);
+
+    case QLZ_VARIANT(3, 0):
+      return qlz_compress_skip_3(size, &state->u.l3);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_compress_skip_3s(size, &state->u.l3s);
+    }
+  return 0;
+}
+
+int
+qlz_decompress_skip(const char *source, qlz_state_decompress *state)
+{
+  switch (qlz_state_decompress_select(source, state))
+    {
+    case QLZ_VARIANT(1, 0):
+      return qlz_decompress_skip_1(source, &state->u.l1);
+
+    case QLZ_VARIANT(1, 1):
+      return qlz_decompress_skip_1s(source, &state->u.l1s);
+
+    case QLZ_VARIANT(2, 0):
+      return qlz_decompress_skip_2(source, &state->u.l2);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_decompress_skip_2s(source, &state->u.l2s);
+
+    case QLZ_VARIANT(3, 0):
+      return qlz_decompress_skip_3(source, &state->u.l3);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_decompress_skip_3s(source, &state->u.l3s);
+    }
+  return 0;
+}
+
+size_t
+qlz_decompress_partial(const char *source, void *destination,
+                       size_t max_out, qlz_state_decompress *state)
+{
+  switch (qlz_state_decompress_select(source, state))
+    {
+    case QLZ_VARIANT(1, 0):
+      return qlz_decompress_partial_1(source, destination, max_out,
+                                      &state->u.l1);
+
+    case QLZ_VARIANT(1, 1):
+      return qlz_decompress_partial_1s(source, destination, max_out,
+                                       &state->u.l1s);
+
+    case QLZ_VARIANT(2, 0):
+      return qlz_decompress_partial_2(source, destination, max_out,
+                                      &state->u.l2);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_decompress_partial_2s(source, destination, max_out,
+                                       &state->u.l2s);
+
+    case QLZ_VARIANT(3, 0):
+      return qlz_decompress_partial_3(source, destination, max_out,
+                                      &state->u.l3);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_decompress_partial_3s(source, destination, max_out,
+                                       &state->u.l3s);
+    }
+  return 0;
+}
+
+void *
+qlz_compress_reserve(size_t size, qlz_state_compress *state)
+{
+  switch (QLZ_VARIANT(state->level, state->streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 1):
+      return qlz_compress_reserve_1s(size, &state->u.l1s);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_compress_reserve_2s(size, &state->u.l2s);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_compress_reserve_3s(size, &state->u.l3s);
+    }
+  return NULL;
+}
+
+size_t
+qlz_decompress_view(const char *source, const void **view,
+                    qlz_state_decompress *state)
+{
+  *view = NULL;
+  switch (qlz_state_decompress_select(source, state))
+    {
+    case QLZ_VARIANT(1, 1):
+      return qlz_decompress_view_1s(source, view, &state->u.l1s);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_decompress_view_2s(source, view, &state->u.l2s);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_decompress_view_3s(source, view, &state->u.l3s);
+    }
+  return 0;
+}
+
+/* Decompress the packets of a batch in order, as qlz_decompress() would */
+size_t
+qlz_decompress_batch(qlz_batch *batch, size_t count,
+                     qlz_state_decompress *state)
+{
+  size_t  total  = 0;
+  size_t  i;
+
+  for (i = 0; i < count; i++)
+    {
+      qlz_batch * item = batch + i;
+
+      if (i + 1 < count)
+        {
+          qlz_prefetch(batch[i + 1].source);
+        }
+
+      item->compressed   = qlz_size_compressed((const char *)item->source);
+      item->size         = qlz_decompress((const char *)item->source,
+                                          item->destination, state);
+      total             += item->size;
+    }
+
+  return total;
+}
+
+int
+qlz_state_compress_load_dict(qlz_state_compress *state, const void *dict,
+                             size_t size)
+{
+  switch (QLZ_VARIANT(state->level, state->streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 0):
+      return qlz_state_compress_load_dict_1(&state->u.l1, dict, size);
+
+    case QLZ_VARIANT(1, 1):
+      return qlz_state_compress_load_dict_1s(&state->u.l1s, dict, size);
+
+    case QLZ_VARIANT(2, 0):
+      return qlz_state_compress_load_dict_2(&state->u.l2, dict, size);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_state_compress_load_dict_2s(&state->u.l2s, dict, size);
+
+    case QLZ_VARIANT(3, 0):
+      return qlz_state_compress_load_dict_3(&state->u.l3, dict, size);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_state_compress_load_dict_3s(&state->u.l3s, dict, size);
+    }
+  return 0;
+}
+
+/*
+ * The level and streaming buffer size of the packets to come are
+ * given here, since the state learns them only from a packet.
+ */
+
+int
+qlz_state_decompress_load_dict(qlz_state_decompress *state, int level,
+                               size_t streaming_buffer, const void *dict,
+                               size_t size)
+{
+  if (level < 1 || level > 3 || streaming_buffer > 0xffffffff)
+    {
+      return 0;
+    }
+
+  if (level != state->level || streaming_buffer != state->streaming_buffer)
+    {
+      if (!qlz_state_decompress_setup(state, level, streaming_buffer))
+        {
+          return 0;
+        }
+    }
+
+  if (stream_bits(streaming_buffer) == 3)
+    {
+      state->streaming_other = streaming_buffer;
+    }
+
+  switch (QLZ_VARIANT(level, streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 0):
+      return qlz_state_decompress_load_dict_1(&state->u.l1, level,
+                                              streaming_buffer, dict, size);
+
+    case QLZ_VARIANT(1, 1):
+      return qlz_state_decompress_load_dict_1s(&state->u.l1s, level,
+                                               streaming_buffer, dict, size);
+
+    case QLZ_VARIANT(2, 0):
+      return qlz_state_decompress_load_dict_2(&state->u.l2, level,
+                                              streaming_buffer, dict, size);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_state_decompress_load_dict_2s(&state->u.l2s, level,
+                                               streaming_buffer, dict, size);
+
+    case QLZ_VARIANT(3, 0):
+      return qlz_state_decompress_load_dict_3(&state->u.l3, level,
+                                              streaming_buffer, dict, size);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_state_decompress_load_dict_3s(&state->u.l3s, level,
+                                               streaming_buffer, dict, size);
+    }
+  return 0;
+}
+
+/* Both states must have been created with the same level and buffer */
+int
+qlz_state_compress_copy(qlz_state_compress *destination,
+                        const qlz_state_compress *source)
+{
+  if (destination->level != source->level
+      || destination->streaming_buffer != source->streaming_buffer)
+    {
+      return 0;
+    }
+
+  destination->acceleration   = source->acceleration;
+  destination->stream_window  = source->stream_window;
+
+  switch (QLZ_VARIANT(source->level, source->streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 0):
+      return qlz_state_compress_copy_1(&destination->u.l1, &source->u.l1);
+
+    case QLZ_VARIANT(1, 1):
+      return qlz_state_compress_copy_1s(&destination->u.l1s, &source->u.l1s);
+
+    case QLZ_VARIANT(2, 0):
+      return qlz_state_compress_copy_2(&destination->u.l2, &source->u.l2);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_state_compress_copy_2s(&destination->u.l2s, &source->u.l2s);
+
+    case QLZ_VARIANT(3, 0):
+      return qlz_state_compress_copy_3(&destination->u.l3, &source->u.l3);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_state_compress_copy_3s(&destination->u.l3s, &source->u.l3s);
+    }
+  return 0;
+}
+
+/* The destination is set up for the level of the source first */
+int
+qlz_state_decompress_copy(qlz_state_decompress *destination,
+                          const qlz_state_decompress *source)
+{
+  destination->streaming_other  = source->streaming_other;
+  destination->stream_window    = source->stream_window;
+  if (destination->level != source->level
+      || destination->streaming_buffer != source->streaming_buffer)
+    {
+      if (!qlz_state_decompress_setup(destination, source->level,
+                                      source->streaming_buffer))
+        {
+          return 0;
+        }
+    }
+
+  switch (QLZ_VARIANT(source->level, source->streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 0):
+      return qlz_state_decompress_copy_1(&destination->u.l1, &source->u.l1);
+
+    case QLZ_VARIANT(1, 1):
+      return qlz_state_decompress_copy_1s(&destination->u.l1s,
+                                          &source->u.l1s);
+
+    case QLZ_VARIANT(2, 0):
+      return qlz_state_decompress_copy_2(&destination->u.l2, &source->u.l2);
+
+    case QLZ_VARIANT(2, 1):
+      return qlz_state_decompress_copy_2s(&destination->u.l2s,
+                                          &source->u.l2s);
+
+    case QLZ_VARIANT(3, 0):
+      return qlz_state_decompress_copy_3(&destination->u.l3, &source->u.l3);
+
+    case QLZ_VARIANT(3, 1):
+      return qlz_state_decompress_copy_3s(&destination->u.l3s,
+                                          &source->u.l3s);
+    }
+
+  /* A source that has not seen a packet yet */
+  memset(&destination->u, 0, sizeof ( destination->u ));
+  return 1;
+}
+
+#else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+
+#undef OFFSET_BASE
+#undef CAST
+#undef QLZ_STREAM_SIZE
+#undef TAG_NONE
+
+#if QLZ_COMPRESSION_LEVEL == 1 \
+  && defined QLZ_PTR_64        \
+  && QLZ_STREAMING == 0
+# define OFFSET_BASE   source
+# define CAST          (ui32)(size_t)
+#else
+# define OFFSET_BASE   0
+# define CAST
+#endif
+
+#if defined QLZ_STREAMING_DYNAMIC
+# define QLZ_STREAM_SIZE(state)   (( state )->stream_size )
+#else
+# define QLZ_STREAM_SIZE(state)   QLZ_STREAMING_BUFFER
+#endif
+
+#if QLZ_COMPRESSION_LEVEL == 2
+# define TAG_NONE      0xffffffffU
+#else
+# define TAG_NONE      0xffffU
+#endif
+
+/*
+ * Vector extensions the compiler may use for this engine, which the
+ * runtime level build compiles again for each target it dispatches to.
+ */
+
+#undef X86_AVX2
+#undef X86_AVX512
+#if defined X86_SSE2 && defined __AVX2__
+# define X86_AVX2
+#endif
+#if defined X86_AVX2 && defined __AVX512BW__
+# define X86_AVX512
+#endif
+
+/*
+ * Extend a match of src with o, whose first m bytes are known to be
+ * equal, up to remaining bytes, comparing 64, 32 or 16 bytes at a
+ * time where the vector unit allows. Bytes up to src + remaining - 1
+ * are read, so remaining must stay within the input.
+ */
+
+static __inline ui32
+match_length(const unsigned char *src, const unsigned char *o, ui32 m,
+             ui32 remaining)
+{
+#ifdef X86_AVX512
+    while (m + 64 <= remaining)
+      {
+        unsigned long long ne = ~(unsigned long long)_mm512_cmpeq_epi8_mask(
+                                  _mm512_loadu_si512(src + m),
+                                  _mm512_loadu_si512(o + m));
+        if (ne != 0)
+          {
+            return m + ((ui32)ne != 0
+                        ? lowest_bit((ui32)ne)
+                        : 32 + lowest_bit((ui32)( ne >> 32 )));
+          }
+
+        m += 64;
+      }
+#endif /* ifdef X86_AVX512 */
+#ifdef X86_AVX2
+    while (m + 32 <= remaining)
+      {
+        ui32 eq = (ui32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i *)( src + m )),
+                    _mm256_loadu_si256((const __m256i *)( o + m ))));
+        if (eq != 0xffffffffU)
+          {
+            return m + lowest_bit(~eq);
+          }
+
+        m += 32;
+      }
+#endif /* ifdef X86_AVX2 */
+#ifdef X86_SSE2
+    while (m + 16 <= remaining)
+      {
+        ui32 eq = (ui32)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i *)( src + m )),
+                    _mm_loadu_si128((const __m128i *)( o + m ))));
+        if (eq != 0xffff)
+          {
+            return m + lowest_bit(~eq);
+          }
+
+        m += 16;
+      }
+#endif /* ifdef X86_SSE2 */
+  while (m < remaining && src[m] == o[m])
+    {
+      m++;
+    }
+
+  return m;
+}
+
+#if defined X86_SSE2 && QLZ_COMPRESSION_LEVEL == 3 && QLZ_POINTERS == 16
+
+/*
+ * Bit k is set for each of the first n candidates whose tag is tag.
+ * The sixteen tags of a bucket are compared at once, so the match
+ * finder only branches on, and reads the input of, candidates whose
+ * first three bytes match.
+ */
+
+static __inline ui32
+match_candidates(const ui16 *cache, ui32 n, ui32 tag)
+{
+  __m128i  key  = _mm_set1_epi16((short)tag);
+  __m128i  lo   = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)cache),
+                                  key);
+  __m128i  hi   = _mm_cmpeq_epi16(
+                    _mm_loadu_si128((const __m128i *)( cache + 8 )), key);
+
+  return (ui32)_mm_movemask_epi8(_mm_packs_epi16(lo, hi))
+         & (( 1U << n ) - 1 );
+}
+
+#endif /* if defined X86_SSE2 && QLZ_COMPRESSION_LEVEL == 3 && QLZ_POINTERS == 16 */
+
+#if QLZ_COMPRESSION_LEVEL == 1
+  static int
+  same(const unsigned char *src, size_t n)
+  {
+    while (n > 0 && *( src + n ) == *src)
+      {
+        n--;
+      }
+    return n == 0 ? 1 : 0;
+  }
+#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+
+/*
+ * Level 1 compression and level 2 decompression empty their hash
+ * tables by starting a new generation, which only has to visit the
+ * buckets once every 255 resets, to move them to generation 0. Level
+ * 2 and 3 compression only clear their counters.
+ */
+
+static void
+reset_table_compress(qlz_state_compress *state)
+{
+#if QLZ_COMPRESSION_LEVEL == 1
+    if (++state->generation == 0)
+      {
+        int i;
+
+        for (i = 0; i < QLZ_HASH_VALUES; i++)
+          {
+            state->hash[i].cache = 0;
+          }
+
+        state->generation = 1;
+      }
+#else  /* if QLZ_COMPRESSION_LEVEL == 1 */
+    int i;
+
+    for (i = 0; i < QLZ_HASH_VALUES; i++)
+      {
+        state->hash_counter[i] = 0;
+      }
+#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+}
+
+static void
+reset_table_decompress(qlz_state_decompress *state)
+{
+  (void)state;
+#if QLZ_COMPRESSION_LEVEL == 2
+    if (++state->generation == 0)
+      {
+        memset(state->hash_counter, 0, sizeof ( state->hash_counter ));
+        state->generation = 1;
+      }
+#endif /* if QLZ_COMPRESSION_LEVEL == 2 */
+}
+
+#if QLZ_STREAMING
+
+/*
+ * Move the last keep bytes of the history to the start of the buffer
+ * and the hash entries with them. Level 1 drops the entries that fell
+ * out of the window; levels 2 and 3 point them at the start of the
+ * buffer, as the decompressor does, so that both sides agree on them,
+ * but with a tag that keeps the compressor from using them.
+ */
+
+static void
+slide_stream_compress(qlz_state_compress *state, size_t keep)
+{
+  size_t                delta  = state->stream_counter - keep;
+  const unsigned char * base   = state->stream_buffer + delta;
+  int                   i;
+
+  memmove(state->stream_buffer, base, keep);
+  for (i = 0; i < QLZ_HASH_VALUES; i++)
+    {
+# if QLZ_COMPRESSION_LEVEL == 1
+        if (state->hash[i].offset < base)
+          {
+            state->hash[i].offset = 0;
+          }
+        else
+          {
+            state->hash[i].offset -= delta;
+          }
+# else  /* if QLZ_COMPRESSION_LEVEL == 1 */
+        int j;
+
+        for (j = 0; j < QLZ_POINTERS; j++)
+          {
+            if (state->hash[i].offset[j] < delta)
+              {
+                state->hash[i].offset[j]  = 0;
+                state->hash[i].cache[j]   = TAG_NONE;
+              }
+            else
+              {
+                state->hash[i].offset[j] -= (ui32)delta;
+              }
+          }
+# endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+    }
+
+  state->stream_counter = keep;
+}
+
+static void
+slide_stream_decompress(qlz_state_decompress *state, size_t keep)
+{
+  size_t                delta  = state->stream_counter - keep;
+  const unsigned char * base   = state->stream_buffer + delta;
+
+  memmove(state->stream_buffer, base, keep);
+# if QLZ_COMPRESSION_LEVEL <= 2
+    {
+      int i;
+
+      for (i = 0; i < QLZ_HASH_VALUES; i++)
+        {
+#  if QLZ_COMPRESSION_LEVEL == 1
+            if (state->hash[i].offset < base)
+              {
+                state->hash[i].offset = state->stream_buffer;
+              }
+            else
+              {
+                state->hash[i].offset -= delta;
+              }
+#  else  /* if QLZ_COMPRESSION_LEVEL == 1 */
+            int j;
+
+            for (j = 0; j < QLZ_POINTERS; j++)
+              {
+                if (state->hash[i].offset[j] < base)
+                  {
+                    state->hash[i].offset[j] = state->stream_buffer;
+                  }
+                else
+                  {
+                    state->hash[i].offset[j] -= delta;
+                  }
+              }
+#  endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+        }
+    }
+# endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
+
+  state->stream_counter = keep;
+}
+
+#endif /* if QLZ_STREAMING */
+
+static __inline ui32
+hash_func(ui32 i)
+{
+#if QLZ_COMPRESSION_LEVEL == 2
+    return (( i >> 9 ) ^ ( i >> 13 ) ^ i ) & ( QLZ_HASH_VALUES - 1 );
+#else  /* if QLZ_COMPRESSION_LEVEL == 2 */
+    return (( i >> 12 ) ^ i ) & ( QLZ_HASH_VALUES - 1 );
+#endif /* if QLZ_COMPRESSION_LEVEL == 2 */
+}
+
+static __inline ui32
+hashat(const unsigned char *src)
+{
+  ui32 fetch, hash;
+
+  fetch  = fast_read(src, 3);
+  hash   = hash_func(fetch);
+  return hash;
+}
+
+#if QLZ_COMPRESSION_LEVEL >= 2
+
+/*
+ * Tag of a position whose first three bytes are fetch. TAG_NONE is
+ * the tag of no bytes at all, for a slot that has been dropped.
+ */
+static __inline ui32
+hash_tag(ui32 fetch)
+{
+# if QLZ_COMPRESSION_LEVEL == 2
+    return fetch & 0xffffff;
+# else  /* if QLZ_COMPRESSION_LEVEL == 2 */
+    return ( fetch >> 12 ) & 0xfff;
+# endif /* if QLZ_COMPRESSION_LEVEL == 2 */
+}
+
+/* Enter position src of the history that starts at base */
+static __inline void
+insert_hash(qlz_state_compress *state, const unsigned char *base,
+            const unsigned char *src)
+{
+  ui32           fetch  = fast_read(src, 3);
+  ui32           hash   = hash_func(fetch);
+  unsigned char  c      = state->hash_counter[hash]++;
+
+  state->hash[hash].cache[c & ( QLZ_POINTERS - 1 )]   = hash_tag(fetch);
+  state->hash[hash].offset[c & ( QLZ_POINTERS - 1 )]  = (ui32)( src - base );
+}
+
+#endif /* if QLZ_COMPRESSION_LEVEL >= 2 */
+
+static __inline void
+update_hash(qlz_state_decompress *state, const unsigned char *s)
+{
+#if QLZ_COMPRESSION_LEVEL == 1
+    ui32 hash;
+    hash                       = hashat(s);
+    state->hash[hash].offset   = s;
+    state->hash_counter[hash]  = 1;
+#elif QLZ_COMPRESSION_LEVEL == 2
+    ui32           hash;
+    unsigned char  c;
+    hash = hashat(s);
+    c = ( state->hash_counter[hash] >> 8 ) == state->generation
+        ? (unsigned char)state->hash_counter[hash] : 0;
+    state->hash[hash].offset[c & ( QLZ_POINTERS - 1 )] = s;
+    c++;
+    state->hash_counter[hash] = (ui16)( state->generation << 8 | c );
+#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+  (void)state;
+  (void)s;
+}
+
+#if QLZ_STREAMING && QLZ_COMPRESSION_LEVEL == 3 && defined QLZ_THREADS
+
+/*
+ * Enter the history from position from up to the stream counter
+ * into the hash table, so that a block compressed on another thread
+ * can refer to the blocks before it. The pool calls it by the name
+ * of the engine, so it is declared like the public functions.
+ */
+
+QLZ_API void
+prime_stream_compress(qlz_state_compress *state, size_t from)
+{
+  const unsigned char * src  = state->stream_buffer + from;
+  const unsigned char * end  = state->stream_buffer + state->stream_counter;
+
+  while (src + 4 <= end)
+    {
+      insert_hash(state, state->stream_buffer, src);
+      src++;
+    }
+}
+
+#endif /* if QLZ_STREAMING && QLZ_COMPRESSION_LEVEL == 3 && ... */
+
+#if QLZ_COMPRESSION_LEVEL <= 2
+  static void
+  update_hash_upto(qlz_state_decompress *state, unsigned char **lh,
+                   const unsigned char *max)
+  {
+    while (*lh < max)
+      {
+        ( *lh )++;
+        update_hash(state, *lh);
+      }
+  }
+#endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
+
+#if QLZ_COMPRESSION_LEVEL == 3
+
+/* Write the token of a match of matchlen bytes offset bytes back */
+static __inline unsigned char *
+write_match(unsigned char *dst, ui32 matchlen, ui32 offset)
+{
+  if (matchlen == 3 && offset <= 63)
+    {
+      *dst = (unsigned char)( offset << 2 );
+      return dst + 1;
+    }
+  else if (matchlen == 3 && offset <= 16383)
+    {
+      fast_write(( offset << 2 ) | 1, dst, 2);
+      return dst + 2;
+    }
+  else if (matchlen <= 18 && offset <= 1023)
+    {
+      fast_write((( matchlen - 3 ) << 2 ) | ( offset << 6 ) | 2, dst, 2);
+      return dst + 2;
+    }
+  else if (matchlen <= 33)
+    {
+      fast_write((( matchlen - 2 ) << 2 ) | ( offset << 7 ) | 3, dst, 3);
+      return dst + 3;
+    }
+  else
+    {
+      fast_write((( matchlen - 3 ) << 7 ) | ( offset << 15 ) | 3, dst, 4);
+      return dst + 4;
+    }
+}
+
+#endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+
+static size_t
+qlz_compress_core(const unsigned char *source, unsigned char *destination,
+                  size_t size, qlz_state_compress *state)
+{
+  const unsigned char * last_byte  = source + size - 1;
+  const unsigned char * src        = source;
+  unsigned char *       cword_ptr  = destination;
+  unsigned char *       dst        = destination + CWORD_LEN;
+  ui32                  cword_val  = 1U << 31;
+  const unsigned char * last_matchstart
+    = last_byte - UNCONDITIONAL_MATCHLEN_COMPRESSOR - UNCOMPRESSED_END;
+  ui32                  fetch  = 0;
+  unsigned int          lits   = 0;
+#if QLZ_COMPRESSION_LEVEL == 1
+    ui32                  generation
+      = (ui32)state->generation << 24;
+#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+#if QLZ_COMPRESSION_LEVEL >= 2
+    const unsigned char * history
+      = source - state->stream_counter;
+#endif /* if QLZ_COMPRESSION_LEVEL >= 2 */
+#if QLZ_COMPRESSION_LEVEL == 3
+
+  /*
+   * Above 1, the acceleration searches only the most recent of the
+   * other candidates, enters every accel-th position of a match into
+   * the hash table and, as misses accumulate, emits literals without
+   * searching. The decompressor does not depend on the hash table.
+   */
+
+    ui32                accel   = state->acceleration > 1
+                                  ? (ui32)state->acceleration : 1;
+    ui32                probes  = accel <= 5 ? QLZ_POINTERS >> ( accel - 1 )
+                                  : 0;
+    ui32                misses  = 0;
+    ui32                skip    = 0;
+
+  probes = probes > 0 ? probes : 1;
+#endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+
+  (void)lits;
+
+  if (src <= last_matchstart)
+    {
+      fetch = fast_read(src, 3);
+      (void)fetch;
+    }
+
+  while (qlz_likely(src <= last_matchstart))
+    {
+      if (qlz_unlikely(( cword_val & 1 ) == 1))
+        {
+          /* Store uncompressed if compression ratio is too low */
+          if (src > source + ( size >> 1 )
+              && dst - destination > src - source - (( src - source ) >> 5 ))
+            {
+              return 0;
+            }
+
+          fast_write(( cword_val >> 1 ) | ( 1U << 31 ), cword_ptr, CWORD_LEN);
+
+          cword_ptr   = dst;
+          dst        += CWORD_LEN;
+          cword_val   = 1U << 31;
+          (void)cword_val;
+          fetch       = fast_read(src, 3);
+          (void)fetch;
+        }
+
+#if QLZ_COMPRESSION_LEVEL == 1
+        {
+          const unsigned char * o;
+          ui32                  hash, key, cached;
+
+          hash                      = hash_func(fetch);
+          key                       = ( fetch & 0xffffff ) | generation;
+          cached                    = key ^ state->hash[hash].cache;
+          state->hash[hash].cache   = key;
+
+          o                         = state->hash[hash].offset + OFFSET_BASE;
+          state->hash[hash].offset  = CAST(src - OFFSET_BASE);
+            if (cached == 0 && o != OFFSET_BASE
+                && ( src - o > MINOFFSET
+                     || ( src == o + 1 && lits >= 3 && src > source + 3
+                          && same(src - 3, 6))))
+              {
+                size_t matchlen = 3;
+                hash          <<= 4;
+                cword_val       = ( cword_val >> 1 ) | ( 1U << 31 );
+
+# if defined X86X64 && defined QLZ_PTR_64
+                  {
+#  ifdef __GNUC__
+                      unsigned long long  a
+                          = *(unsigned long long *)( src + matchlen );
+                      unsigned long long  b
+                          = *(unsigned long long *)( o + matchlen );
+                      unsigned long long  c
+                          = a ^ b;
+#  else  /* ifdef __GNUC__ */
+                      unsigned int        a
+                          = *(unsigned int *)( src + matchlen );
+                      unsigned int        b
+                          = *(unsigned int *)( o + matchlen );
+                      unsigned int        c
+                          = a ^ b;
+#  endif /* ifdef __GNUC__ */
+                    if (qlz_unlikely(c == 0))
+                      {
+                        size_t  q
+                            = last_byte - UNCOMPRESSED_END - src + 1;
+                        size_t  remaining
+                            = q > 255 ? 255 : q;
+                        matchlen  = match_length(src, o,
+                                                 (ui32)( matchlen + sizeof ( c )),
+                                                 (ui32)remaining);
+                      }
+                    else
+                      {
+#  if defined _MSC_VER || defined __INTEL_COMPILER
+                          unsigned int index = 0;
+                          _BitScanForward((unsigned long *)&index, c);
+                          matchlen  += index >> 3;
+#  else  /* if defined _MSC_VER || defined __INTEL_COMPILER */
+                          matchlen  += __builtin_ctzll(c) >> 3;
+#  endif /* if defined _MSC_VER || defined __INTEL_COMPILER */
+                      }
+                  }
+# else  /* if defined X86X64 && defined QLZ_PTR_64 */
+                  {
+                    size_t  q
+                        = last_byte - UNCOMPRESSED_END - src + 1;
+                    size_t  remaining
+                        = q > 255 ? 255 : q;
+                    matchlen = match_length(src, o, (ui32)matchlen,
+                                            (ui32)remaining);
+                  }
+# endif /* if defined X86X64 && defined QLZ_PTR_64 */
+                src += matchlen;
+
+                if (qlz_likely(matchlen < 18))
+                  {
+                    fast_write((ui32)( matchlen - 2 ) | hash, dst, 2);
+                    dst += 2;
+                  }
+                else
+                  {
+                    fast_write((ui32)( matchlen << 16 ) | hash, dst, 3);
+                    dst += 3;
+                  }
+
+                fetch  = fast_read(src, 3);
+                lits   = 0;
+              }
+            else
+              {
+                lits++;
+                *dst = *src;
+                src++;
+                dst++;
+                cword_val  = ( cword_val >> 1 );
+# ifdef X86X64
+                  fetch    = fast_read(src, 3);
+# else  /* ifdef X86X64 */
+                  fetch    = ( fetch >> 8 & 0xffff ) | ( *( src + 2 ) << 16 );
+# endif /* ifdef X86X64 */
+              }
+        }
+#elif QLZ_COMPRESSION_LEVEL >= 2
+# if QLZ_COMPRESSION_LEVEL == 3
+          if (skip > 0)
+            {
+              skip--;
+              *dst = *src;
+              src++;
+              dst++;
+              cword_val = ( cword_val >> 1 );
+              continue;
+            }
+
+# endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+        {
+          const unsigned char * o, *offset2;
+          ui32                  hash, tag, matchlen, k, m, best_k = 0;
+# if QLZ_COMPRESSION_LEVEL == 3
+          ui32                  recent = ~0U;
+# endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+# if defined X86_SSE2 && QLZ_COMPRESSION_LEVEL == 3 && QLZ_POINTERS == 16
+          ui32                  found;
+# endif /* if defined X86_SSE2 && QLZ_COMPRESSION_LEVEL == 3 && QLZ_POINTERS == 16 */
+          unsigned char         c;
+          size_t                remaining
+              = ( last_byte - UNCOMPRESSED_END - src + 1 ) > 255
+                               ? 255
+                               : ( last_byte - UNCOMPRESSED_END - src + 1 );
+          (void)best_k;
+
+          fetch    = fast_read(src, 3);
+          hash     = hash_func(fetch);
+          tag      = hash_tag(fetch);
+
+          c        = state->hash_counter[hash];
+
+          offset2  = history + state->hash[hash].offset[0];
+          if (c > 0 && state->hash[hash].cache[0] == tag
+              && offset2 < src - MINOFFSET)
+            {
+              matchlen = match_length(src, offset2, 3, (ui32)remaining);
+            }
+          else
+            {
+              matchlen = 0;
+            }
+
+# if QLZ_COMPRESSION_LEVEL == 3
+            if (probes < QLZ_POINTERS)
+              {
+                recent   = (( 1U << probes ) - 1 )
+                           << (( c - probes ) & ( QLZ_POINTERS - 1 ));
+                recent  |= recent >> QLZ_POINTERS;
+              }
+
+# endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+# if defined X86_SSE2 && QLZ_COMPRESSION_LEVEL == 3 && QLZ_POINTERS == 16
+
+          /*
+           * Only the candidates whose first three bytes match are
+           * visited, in the same order as the loop below would.
+           */
+
+          found = match_candidates(state->hash[hash].cache,
+                                   c < QLZ_POINTERS ? c : QLZ_POINTERS,
+                                   tag) & recent & ~1U;
+
+          for (; found != 0; found &= found - 1)
+            {
+              k  = lowest_bit(found);
+              o  = history + state->hash[hash].offset[k];
+                if (o < src - MINOFFSET)
+# else  /* if defined X86_SSE2 && QLZ_COMPRESSION_LEVEL == 3 && QLZ_POINTERS == 16 */
+          for (k = 1; k < QLZ_POINTERS && c > k; k++)
+            {
+              o = history + state->hash[hash].offset[k];
+#  if QLZ_COMPRESSION_LEVEL == 3
+                if (( recent >> k & 1 ) != 0
+                    && state->hash[hash].cache[k] == tag
+                    && o < src - MINOFFSET)
+#  elif QLZ_COMPRESSION_LEVEL == 2
+                if (state->hash[hash].cache[k] == tag
+                    && *( src + matchlen ) == *( o + matchlen )
+                    && o < src - MINOFFSET)
+#  endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+# endif /* if defined X86_SSE2 && QLZ_COMPRESSION_LEVEL == 3 && QLZ_POINTERS == 16 */
+                {
+                  m = match_length(src, o, 3, (ui32)remaining);
+# if QLZ_COMPRESSION_LEVEL == 3
+                    if (( m > matchlen ) || ( m == matchlen && o > offset2 ))
+# elif QLZ_COMPRESSION_LEVEL == 2
+                    if (m > matchlen)
+# endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+                    {
+                      offset2   = o;
+                      (void)offset2;
+                      matchlen  = m;
+                      (void)matchlen;
+                      best_k    = k;
+                      (void)best_k;
+                    }
+                }
+            }
+
+          o                                                   = offset2;
+          (void)o;
+          state->hash[hash].cache[c & ( QLZ_POINTERS - 1 )]   = tag;
+          state->hash[hash].offset[c & ( QLZ_POINTERS - 1 )]
+              = (ui32)( src - history );
+          c++;
+          state->hash_counter[hash]                           = c;
+
+# if QLZ_COMPRESSION_LEVEL == 3
+            if (matchlen > 2 && src - o < 131071)
+              {
+                ui32    u;
+                size_t  offset = src - o;
+
+                misses = 0;
+                for (u = 1; u < matchlen; u += accel)
+                  {
+                    insert_hash(state, history, src + u);
+                  }
+
+                cword_val   = ( cword_val >> 1 ) | ( 1U << 31 );
+                src        += matchlen;
+                dst         = write_match(dst, matchlen, (ui32)offset);
+              }
+            else
+              {
+                *dst = *src;
+                src++;
+                dst++;
+                cword_val  = ( cword_val >> 1 );
+                misses++;
+                skip       = ( misses * ( accel - 1 )) >> 6;
+              }
+
+# elif QLZ_COMPRESSION_LEVEL == 2
+
+            if (matchlen > 2)
+              {
+                cword_val   = ( cword_val >> 1 ) | ( 1U << 31 );
+                src        += matchlen;
+
+                if (matchlen < 10)
+                  {
+                    ui32 f = best_k | (( matchlen - 2 ) << 2 ) | ( hash << 5 );
+                    fast_write(f, dst, 2);
+                    dst   += 2;
+                  }
+                else
+                  {
+                    ui32 f = best_k | ( matchlen << 16 ) | ( hash << 5 );
+                    fast_write(f, dst, 3);
+                    dst   += 3;
+                  }
+              }
+            else
+              {
+                *dst = *src;
+                src++;
+                dst++;
+                cword_val = ( cword_val >> 1 );
+              }
+
+# endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+        }
+#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+    }
+  while (src <= last_byte)
+    {
+      if (( cword_val & 1 ) == 1)
+        {
+          fast_write(( cword_val >> 1 ) | ( 1U << 31 ), cword_ptr, CWORD_LEN);
+          cword_ptr   = dst;
+          dst        += CWORD_LEN;
+          cword_val   = 1U << 31;
+        }
+
+#if QLZ_COMPRESSION_LEVEL < 3
+        if (src <= last_byte - 3)
+          {
+# if QLZ_COMPRESSION_LEVEL == 1
+              ui32 hash, fetch;
+              fetch                     = fast_read(src, 3);
+              hash                      = hash_func(fetch);
+              state->hash[hash].offset  = CAST(src - OFFSET_BASE);
+              state->hash[hash].cache   = ( fetch & 0xffffff ) | generation;
+# elif QLZ_COMPRESSION_LEVEL == 2
+              insert_hash(state, history, src);
+# endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+          }
+#endif /* if QLZ_COMPRESSION_LEVEL < 3 */
+      *dst = *src;
+      src++;
+      dst++;
+      cword_val = ( cword_val >> 1 );
+    }
+
+  while (( cword_val & 1 ) != 1)
+    {
+      cword_val = ( cword_val >> 1 );
+    }
+
+  fast_write(( cword_val >> 1 ) | ( 1U << 31 ), cword_ptr, CWORD_LEN);
+
+  /*
+   * Minimum size must be 9 bytes so that the qlz_size
+   * functions can take 9 bytes as argument.
+   */
+
+  return dst - destination < 9 ? 9 : dst - destination;
+}
+
+/*
+ * Decompress the size bytes of the packet at source into destination,
+ * where matches may not reach back beyond history. The first control
+ * word read at or after stop ends the packet early, as if it were
+ * complete, with up to HEAD_SLACK bytes written after stop.
+ */
+
+static size_t
+qlz_decompress_core(const unsigned char *source, unsigned char *destination,
+                    size_t size, qlz_state_decompress *state,
+                    const unsigned char *history, const unsigned char *stop)
+{
+  const unsigned char * src
+      = source + qlz_size_header((const char *)source);
+  unsigned char *       dst
+      = destination;
+  const unsigned char * last_destination_byte
+      = destination + size - 1;
+  ui32                  cword_val
+      = 1;
+  const unsigned char * last_matchstart
+      = last_destination_byte
+        - UNCONDITIONAL_MATCHLEN_DECOMPRESSOR
+        - UNCOMPRESSED_END;
+  unsigned char *       last_hashed
+      = destination - 1;
+  const unsigned char * last_source_byte
+     = source + qlz_size_compressed((const char *)source) - 1;
+#if QLZ_COMPRESSION_LEVEL == 3 && defined QLZ_TOKEN_TABLE
+
+    /*
+     * The five shapes of a level 3 match, indexed by the two low bits
+     * of the token, or 4 if its seven low bits are 3. The offset and
+     * the length are fields of the 32 bits read at the token. Define
+     * QLZ_TOKEN_TABLE to decode with this table instead of the chain
+     * of tests; it trades the branches for a dependent load and was
+     * not faster on mixed data where the chain is well predicted.
+     */
+
+    static const struct token3
+    {
+      unsigned char size;
+      unsigned char offset_shift;
+      unsigned char matchlen_shift;
+      unsigned char matchlen_base;
+      ui32          offset_mask;
+      ui32          matchlen_mask;
+    } tokens[5] = {
+      { 1, 2,  0, 3, 0x3f,    0    },
+      { 2, 2,  0, 3, 0x3fff,  0    },
+      { 2, 6,  2, 3, 0x3ff,   15   },
+      { 3, 7,  2, 2, 0x1ffff, 0x1f },
+      { 4, 15, 7, 3, 0x1ffff, 255  }
+    };
+#endif /* if QLZ_COMPRESSION_LEVEL == 3 && defined QLZ_TOKEN_TABLE */
+
+  (void)last_hashed;
+  (void)state;
+  (void)history;
+
+  for (;;)
+    {
+      ui32 fetch;
+
+      if (cword_val == 1)
+        {
+          if (qlz_unlikely(dst >= stop))
+            {
+              return size;
+            }
+
+#ifdef QLZ_MEMORY_SAFE
+            if (src + CWORD_LEN - 1 > last_source_byte)
+              {
+                return 0;
+              }
+#endif /* ifdef QLZ_MEMORY_SAFE */
+          cword_val   = fast_read(src, CWORD_LEN);
+          src        += CWORD_LEN;
+        }
+
+#ifdef QLZ_MEMORY_SAFE
+        if (src + 4 - 1 > last_source_byte)
+          {
+            return 0;
+          }
+#endif /* ifdef QLZ_MEMORY_SAFE */
+
+      fetch = fast_read(src, 4);
+
+      if (( cword_val & 1 ) == 1)
+        {
+          ui32                  matchlen;
+          const unsigned char * offset2;
+
+#if QLZ_COMPRESSION_LEVEL == 1
+            ui32 hash;
+            cword_val
+                = cword_val >> 1;
+            hash
+                = ( fetch >> 4 ) & 0xfff;
+            offset2
+                = (const unsigned char *)(size_t)state->hash[hash].offset;
+
+            if (( fetch & 0xf ) != 0)
+              {
+                matchlen   = ( fetch & 0xf ) + 2;
+                src       += 2;
+              }
+            else
+              {
+                matchlen   = *( src + 2 );
+                src       += 3;
+              }
+
+#elif QLZ_COMPRESSION_LEVEL == 2
+            ui32           hash;
+            unsigned char  c;
+            cword_val  = cword_val >> 1;
+            hash       = ( fetch >> 5 ) & 0x7ff;
+            c          = (unsigned char)( fetch & 0x3 );
+            offset2    = state->hash[hash].offset[c];
+
+            if (( fetch & ( 28 )) != 0)
+              {
+                matchlen   = (( fetch >> 2 ) & 0x7 ) + 2;
+                src       += 2;
+              }
+            else
+              {
+                matchlen   = *( src + 2 );
+                src       += 3;
+              }
+
+#elif QLZ_COMPRESSION_LEVEL == 3 && defined QLZ_TOKEN_TABLE
+            const struct token3 * t
+                = &tokens[( fetch & 3 ) + (( fetch & 127 ) == 3 )];
+            ui32                  offset;
+            cword_val  = cword_val >> 1;
+            offset     = ( fetch >> t->offset_shift ) & t->offset_mask;
+            matchlen   = (( fetch >> t->matchlen_shift ) & t->matchlen_mask )
+                         + t->matchlen_base;
+            src       += t->size;
+            offset2    = dst - offset;
+
+#elif QLZ_COMPRESSION_LEVEL == 3
+            ui32 offset;
+            cword_val = cword_val >> 1;
+            if (( fetch & 3 ) == 0)
+              {
+                offset    = ( fetch & 0xff ) >> 2;
+                matchlen  = 3;
+                src++;
+              }
+            else if (( fetch & 2 ) == 0)
+              {
+                offset     = ( fetch & 0xffff ) >> 2;
+                matchlen   = 3;
+                src       += 2;
+              }
+            else if (( fetch & 1 ) == 0)
+              {
+                offset     = (  fetch & 0xffff ) >> 6;
+                matchlen   = (( fetch >> 2 ) & 15 ) + 3;
+                src       += 2;
+              }
+            else if (( fetch & 127 ) != 3)
+              {
+                offset     = (  fetch >> 7 ) & 0x1ffff;
+                matchlen   = (( fetch >> 2 ) & 0x1f ) + 2;
+                src       += 3;
+              }
+            else
+              {
+                offset     = (  fetch >> 15 );
+                matchlen   = (( fetch >> 7 ) & 255 ) + 3;
+                src       += 4;
+              }
+
+            offset2 = dst - offset;
+#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+
+#ifdef QLZ_MEMORY_SAFE
+            if (offset2 < history || offset2 > dst - MINOFFSET - 1)
+              {
+                return 0;
+              }
+
+            if (matchlen
+                > (ui32)( last_destination_byte - dst - UNCOMPRESSED_END + 1 ))
+              {
+                return 0;
+              }
+#endif /* ifdef QLZ_MEMORY_SAFE */
+
+          if (qlz_likely(dst + matchlen + WILD_COPY_MARGIN
+                         <= last_destination_byte))
+            {
+              wild_copy_match(dst, offset2, matchlen);
+            }
+          else
+            {
+              memcpy_up(dst, offset2, matchlen);
+            }
+
+          dst += matchlen;
+
+#if QLZ_COMPRESSION_LEVEL <= 2
+            update_hash_upto(state, &last_hashed, dst - matchlen);
+            last_hashed = dst - 1;
+#endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
+        }
+      else
+        {
+          if (dst < last_matchstart)
+            {
+              unsigned int n = lowest_bit(cword_val);
+
+              /*
+               * The sentinel bit of cword_val ends the run, so n
+               * literals follow; up to 31 of them are moved with two
+               * 16 byte copies when the run ends before the literals
+               * at the end of the packet and the source has room.
+               */
+
+              if (n > 4 && dst + 32 <= last_matchstart
+                  && src + 32 <= last_source_byte)
+                {
+#ifdef X86_SSE2
+                    __m128i a = _mm_loadu_si128((const __m128i *)src);
+                    __m128i b = _mm_loadu_si128((const __m128i *)( src + 16 ));
+                    _mm_storeu_si128((__m128i *)dst, a);
+                    _mm_storeu_si128((__m128i *)( dst + 16 ), b);
+#else  /* ifdef X86_SSE2 */
+                    memmove(dst, src, 32);
+#endif /* ifdef X86_SSE2 */
+                }
+              else
+                {
+                  n = n > 4 ? 4 : n;
+#ifdef X86X64
+                    *(ui32 *)dst = *(ui32 *)src;
+#else  /* ifdef X86X64 */
+                    memcpy_up(dst, src, 4);
+#endif /* ifdef X86X64 */
+                }
+
+              cword_val   = cword_val >> n;
+              dst        += n;
+              src        += n;
+#if QLZ_COMPRESSION_LEVEL <= 2
+                update_hash_upto(state, &last_hashed, dst - 3);
+#endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
+            }
+          else
+            {
+              while (dst <= last_destination_byte)
+                {
+                  if (cword_val == 1)
+                    {
+                      src        += CWORD_LEN;
+                      cword_val   = 1U << 31;
+                    }
+
+#ifdef QLZ_MEMORY_SAFE
+                    if (src >= last_source_byte + 1)
+                      {
+                        return 0;
+                      }
+#endif /* ifdef QLZ_MEMORY_SAFE */
+                  *dst = *src;
+                  dst++;
+                  src++;
+                  cword_val = cword_val >> 1;
+                }
+
+#if QLZ_COMPRESSION_LEVEL <= 2
+                update_hash_upto(
+                  state,
+                  &last_hashed,
+                  last_destination_byte
+                    - 3); /* TODO: Use constant */
+#endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
+              return size;
+            }
+        }
+    }
+}
+
+/*
+ * Write the header of a packet of r bytes, base of which are the
+ * header, that holds size bytes, compressed or stored.
+ */
+
+static void
+write_header(char *destination, size_t base, size_t r, size_t size,
+             ui32 compressed, size_t streaming_buffer)
+{
+  if (base == 3)
+    {
+      *destination          = (unsigned char)( 0 | compressed );
+      *( destination + 1 )  = (unsigned char)r;
+      *( destination + 2 )  = (unsigned char)size;
+    }
+  else
+    {
+      *destination = (unsigned char)( 2 | compressed );
+      fast_write((ui32)r, destination + 1, 4);
+      fast_write((ui32)size, destination + 5, 4);
+    }
+
+  *destination  |= ( QLZ_COMPRESSION_LEVEL << 2 );
+  *destination  |= ( 1 << 6 );
+  *destination  |= ( stream_bits(streaming_buffer) << 4 );
+
+  /*
+   * 76543210
+   * 01SSLLHC
+   */
+}
+
+/*
+ * Compress size bytes of source or, if source is NULL, of the segments
+ * of iov one after the other. Segments are gathered into the streaming
+ * buffer where qlz_compress() copies its source anyway. A packet
+ * without history that does not fit there is gathered on the stack, or
+ * into a temporary buffer above QLZ_GATHER_STACK bytes.
+ */
+
+static size_t
+qlz_compress_gather(const void *source, const struct iovec *iov,
+                    char *destination, size_t size,
+                    qlz_state_compress *state)
+{
+  size_t  r;
+  ui32    compressed;
+  size_t  base;
+
+  if (size == 0 || size > 0xffffffff - 400)
+    {
+      return 0;
+    }
+
+  if (size < 216)
+    {
+      base = 3;
+    }
+  else
+    {
+      base = 9;
+    }
+
+#if QLZ_STREAMING
+    if (state->stream_counter + size - 1 >= QLZ_STREAM_SIZE(state))
+      {
+        size_t keep = state->stream_counter < state->stream_window
+                      ? state->stream_counter : state->stream_window;
+
+        if (keep > 0 && keep + size - 1 < QLZ_STREAM_SIZE(state))
+          {
+            slide_stream_compress(state, keep);
+          }
+      }
+
+    if (state->stream_counter + size - 1 >= QLZ_STREAM_SIZE(state))
+#endif /* if QLZ_STREAMING */
+  {
+    unsigned char  stack[QLZ_GATHER_STACK];
+    unsigned char *temp = NULL;
+
+    if (source == NULL)
+      {
+        unsigned char *buffer = NULL;
+#if QLZ_STREAMING
+          if (size <= QLZ_STREAM_SIZE(state))
+            {
+              buffer = state->stream_buffer;
+            }
+#endif /* if QLZ_STREAMING */
+        if (buffer == NULL && size <= sizeof ( stack ))
+          {
+            buffer = stack;
+          }
+
+        if (buffer == NULL)
+          {
+            buffer = temp = (unsigned char *)malloc(size);
+            if (buffer == NULL)
+              {
+                return 0;
+              }
+          }
+
+        qlz_gather(buffer, NULL, iov, size);
+        source = buffer;
+      }
+
+    reset_table_compress(state);
+    state->stream_counter  = 0;
+    r                      = base
+        + qlz_compress_core(
+      (const unsigned char *)source,
+      (unsigned char *)destination + base,
+      size,
+      state);
+#if QLZ_STREAMING
+      reset_table_compress(state);
+#endif /* if QLZ_STREAMING */
+    if (r == base)
+      {
+        memcpy(destination + base, source, size);
+        r           = size + base;
+        compressed  = 0;
+      }
+    else
+      {
+        compressed = 1;
+      }
+
+    free(temp);
+  }
+
+#if QLZ_STREAMING
+    else
+      {
+        unsigned char *src = state->stream_buffer + state->stream_counter;
+
+        qlz_gather(src, source, iov, size);
+        r = base
+            + qlz_compress_core(
+          src,
+          (unsigned char *)destination + base,
+          size,
+          state);
+
+        if (r == base)
+          {
+            memcpy(destination + base, src, size);
+            r           = size + base;
+            compressed  = 0;
+            reset_table_compress(state);
+          }
+        else
+          {
+            compressed = 1;
+          }
+
+        state->stream_counter += size;
+      }
+#endif /* if QLZ_STREAMING */
+  write_header(destination, base, r, size, compressed,
+               QLZ_STREAM_SIZE(state));
+  return r;
+}
+
+QLZ_API size_t
+qlz_compress(const void *source, char *destination, size_t size,
+             qlz_state_compress *state)
+{
+  return qlz_compress_gather(source, NULL, destination, size, state);
+}
+
+/*
+ * Returns where the next size bytes go in the history, sliding or
+ * dropping it as qlz_compress() of size bytes would, so that the
+ * message can be read or built there and compressed from there with
+ * nothing copied. Returns NULL without streaming, or if size is 0 or
+ * larger than the streaming buffer. The runtime level library calls only
+ * the streaming engines.
+ */
+
+#if QLZ_STREAMING || !defined( QLZ_RUNTIME_ENGINES )
+
+QLZ_API void *
+qlz_compress_reserve(size_t size, qlz_state_compress *state)
+{
+#if QLZ_STREAMING
+    if (size == 0 || size > QLZ_STREAM_SIZE(state))
+      {
+        return NULL;
+      }
+
+    if (state->stream_counter + size - 1 >= QLZ_STREAM_SIZE(state))
+      {
+        size_t keep = state->stream_counter < state->stream_window
+                      ? state->stream_counter : state->stream_window;
+
+        if (keep > 0 && keep + size - 1 < QLZ_STREAM_SIZE(state))
+          {
+            slide_stream_compress(state, keep);
+          }
+      }
+
+    /* A packet that starts a new history is compressed from the start */
+    if (state->stream_counter + size - 1 >= QLZ_STREAM_SIZE(state))
+      {
+        return state->stream_buffer;
+      }
+
+    return state->stream_buffer + state->stream_counter;
+#else  /* if QLZ_STREAMING */
+    (void)size;
+    (void)state;
+    return NULL;
+#endif /* if QLZ_STREAMING */
+}
+
+#endif /* if QLZ_STREAMING || !defined( QLZ_RUNTIME_ENGINES ) */
+
+#ifdef QLZ_IOVEC
+
+/*
+ * Compress the iovcnt segments of iov as one message, into the same
+ * packet as qlz_compress() of their concatenation. Segments that
+ * follow each other in memory are compressed where they are.
+ */
+
+QLZ_API size_t
+qlz_compressv(const struct iovec *iov, int iovcnt, char *destination,
+              qlz_state_compress *state)
+{
+  const unsigned char * source    = NULL;
+  const unsigned char * end       = NULL;
+  size_t                size      = 0;
+  int                   adjacent  = 1;
+  int                   i;
+
+  for (i = 0; i < iovcnt; i++)
+    {
+      const unsigned char *base = (const unsigned char *)iov[i].iov_base;
+
+      if (iov[i].iov_len == 0)
+        {
+          continue;
+        }
+
+      if (source == NULL)
+        {
+          source = base;
+        }
+      else if (base != end)
+        {
+          adjacent = 0;
+        }
+
+      end   = base + iov[i].iov_len;
+      size += iov[i].iov_len;
+    }
+
+  return qlz_compress_gather(adjacent ? source : NULL, iov, destination,
+                             size, state);
+}
+
+#endif /* ifdef QLZ_IOVEC */
+
+#if QLZ_COMPRESSION_LEVEL == 3 && !QLZ_STREAMING
+
+/*
+ * Compress size bytes, at most QLZ_SMALL_MAX, into a level 3 packet
+ * without a state, or return 0 to store them. The hash table holds a
+ * single position per bucket and lives on the stack, sized to the
+ * input, so that only a few cache lines are cleared and searched for a
+ * short message. Its entries are base plus the position in the
+ * message, and it is cleared only when base is 0: the smaller entries
+ * left by earlier messages of a batch count as position 0, as those of
+ * a cleared table do.
+ */
+
+static size_t
+qlz_compress_small_core(const unsigned char *source,
+                        unsigned char *destination, size_t size,
+                        ui16 *table, ui32 base)
+{
+  const unsigned char * last_byte  = source + size - 1;
+  const unsigned char * src        = source;
+  unsigned char *       cword_ptr  = destination;
+  unsigned char *       dst        = destination + CWORD_LEN;
+  ui32                  cword_val  = 1U << 31;
+  const unsigned char * last_matchstart
+    = last_byte - UNCONDITIONAL_MATCHLEN_COMPRESSOR - UNCOMPRESSED_END;
+  int                   bits  = size > BATCH_MAX ? SMALL_HASH_BITS
+                                : SMALL_HASH_BITS - 2;
+
+  if (base == 0)
+    {
+      memset(table, 0, sizeof ( table[0] ) << bits);
+    }
+
+  while (src <= last_matchstart)
+    {
+      const unsigned char * o;
+      ui32                  fetch, hash, entry;
+
+      if (qlz_unlikely(( cword_val & 1 ) == 1))
+        {
+          /* Store uncompressed if compression ratio is too low */
+          if (src > source + ( size >> 1 )
+              && dst - destination > src - source - (( src - source ) >> 5 ))
+            {
+              return 0;
+            }
+
+          fast_write(( cword_val >> 1 ) | ( 1U << 31 ), cword_ptr, CWORD_LEN);
+
+          cword_ptr   = dst;
+          dst        += CWORD_LEN;
+          cword_val   = 1U << 31;
+        }
+
+      fetch  = fast_read(src, 3) & 0xffffff;
+      hash   = ( fetch * 2654435761U ) >> ( 32 - bits );
+      entry  = table[hash];
+
+      /* Without a branch, as old and new entries alternate in a batch */
+      o      = source + (( entry - base ) & ( 0U - ( entry >= base )));
+
+      /* Keep an entry too close to use, as in a run of one byte */
+      if (src - o <= MINOFFSET)
+        {
+          o = src;
+        }
+      else
+        {
+          table[hash] = (ui16)( base + ( src - source ));
+        }
+
+      if (o != src && ( fast_read(o, 3) & 0xffffff ) == fetch)
+        {
+          size_t  q         = last_byte - UNCOMPRESSED_END - src + 1;
+          ui32    matchlen  = match_length(src, o, 3,
+                                           q > 255 ? 255 : (ui32)q);
+          ui32    offset    = (ui32)( src - o );
+
+          cword_val   = ( cword_val >> 1 ) | ( 1U << 31 );
+          dst         = write_match(dst, matchlen, offset);
+          src        += matchlen;
+
+          /* Enter the end of the match, where the next one may start */
+          fetch        = fast_read(src - 2, 3) & 0xffffff;
+          hash         = ( fetch * 2654435761U ) >> ( 32 - bits );
+          table[hash]  = (ui16)( base + ( src - 2 - source ));
+        }
+      else
+        {
+          *dst = *src;
+          src++;
+          dst++;
+          cword_val = ( cword_val >> 1 );
+        }
+    }
+
+  while (src <= last_byte)
+    {
+      if (( cword_val & 1 ) == 1)
+        {
+          fast_write(( cword_val >> 1 ) | ( 1U << 31 ), cword_ptr, CWORD_LEN);
+          cword_ptr   = dst;
+          dst        += CWORD_LEN;
+          cword_val   = 1U << 31;
+        }
+
+      *dst = *src;
+      src++;
+      dst++;
+      cword_val = ( cword_val >> 1 );
+    }
+
+  while (( cword_val & 1 ) != 1)
+    {
+      cword_val = ( cword_val >> 1 );
+    }
+
+  fast_write(( cword_val >> 1 ) | ( 1U << 31 ), cword_ptr, CWORD_LEN);
+  return dst - destination < 9 ? 9 : dst - destination;
+}
+
+QLZ_API size_t
+qlz_compress_small(const void *source, char *destination, size_t size)
+{
+  size_t  base  = size < 216 ? 3 : 9;
+  size_t  r;
+  ui16    table[1 << SMALL_HASH_BITS];
+
+  if (size == 0 || size > QLZ_SMALL_MAX)
+    {
+      return 0;
+    }
+
+  r = qlz_compress_small_core((const unsigned char *)source,
+                              (unsigned char *)destination + base, size,
+                              table, 0);
+  if (r == 0)
+    {
+      memcpy(destination + base, source, size);
+      write_header(destination, base, size + base, size, 0, 0);
+      return size + base;
+    }
+
+  write_header(destination, base, r + base, size, 1, 0);
+  return r + base;
+}
+
+/*
+ * Compress each message of the batch into the same packet as
+ * qlz_compress_small(). The messages of at most BATCH_MAX bytes share
+ * one table, which is cleared once for every 64 KiB of them instead
+ * of once for each, and the next message is fetched while the current
+ * one is compressed.
+ */
+
+QLZ_API size_t
+qlz_compress_batch(qlz_batch *batch, size_t count)
+{
+  ui16    table[1 << ( SMALL_HASH_BITS - 2 )];
+  ui32    position  = 0;
+  size_t  total     = 0;
+  size_t  i;
+
+  for (i = 0; i < count; i++)
+    {
+      qlz_batch * item  = batch + i;
+      size_t      size  = item->size;
+      size_t      base  = size < 216 ? 3 : 9;
+      size_t      r;
+
+      if (i + 1 < count)
+        {
+          qlz_prefetch(batch[i + 1].source);
+        }
+
+      if (size == 0 || size > BATCH_MAX)
+        {
+          item->compressed = qlz_compress_small(item->source,
+                                                item->destination, size);
+          total += item->compressed;
+          continue;
+        }
+
+      if (position + size > 65536)
+        {
+          position = 0;
+        }
+
+      r = qlz_compress_small_core((const unsigned char *)item->source,
+                                  (unsigned char *)item->destination + base,
+                                  size, table, position);
+      position += (ui32)size;
+      if (r == 0)
+        {
+          memcpy(item->destination + base, item->source, size);
+          write_header(item->destination, base, size + base, size, 0, 0);
+          r = size;
+        }
+      else
+        {
+          write_header(item->destination, base, r + base, size, 1, 0);
+        }
+
+      item->compressed   = r + base;
+      total             += r + base;
+    }
+
+  return total;
+}
+
+#endif /* if QLZ_COMPRESSION_LEVEL == 3 && !QLZ_STREAMING */
+
+/*
+ * Decompress the first limit bytes, fewer than size, of the compressed
+ * packet at source into destination, without the rest. The core writes
+ * past limit before it stops, so it decompresses into a buffer with
+ * HEAD_SLACK bytes to spare, on the stack for a short head.
+ */
+
+static size_t
+qlz_decompress_head(const unsigned char *source, unsigned char *destination,
+                    size_t size, size_t limit, qlz_state_decompress *state)
+{
+  unsigned char   stack[HEAD_SLACK + 512];
+  unsigned char * buffer  = stack;
+  size_t          room    = size - limit > HEAD_SLACK
+                            ? limit + HEAD_SLACK : size;
+  size_t          r;
+
+  if (room > sizeof ( stack ))
+    {
+      buffer = (unsigned char *)malloc(room);
+      if (buffer == NULL)
+        {
+          return 0;
+        }
+    }
+
+  r = qlz_decompress_core(source, buffer, size, state, buffer,
+                          buffer + limit);
+  if (r != 0)
+    {
+      memcpy(destination, buffer, limit);
+      r = limit;
+    }
+
+  if (buffer != stack)
+    {
+      free(buffer);
+    }
+
+  return r;
+}
+
+#if QLZ_STREAMING
+
+/*
+ * Slide the history, if there is a window, so that a message of size
+ * bytes fits after it. Returns 1 if the message is added to the
+ * history, or 0 if it starts a new one.
+ */
+
+static int
+fits_stream_decompress(qlz_state_decompress *state, size_t size)
+{
+  if (state->stream_counter + size - 1 >= QLZ_STREAM_SIZE(state))
+    {
+      size_t keep = state->stream_counter < state->stream_window
+                    ? state->stream_counter : state->stream_window;
+
+      if (keep > 0 && keep + size - 1 < QLZ_STREAM_SIZE(state))
+        {
+          slide_stream_decompress(state, keep);
+        }
+    }
+
+  return state->stream_counter + size - 1 < QLZ_STREAM_SIZE(state);
+}
+
+/*
+ * Decompress the packet at source, whose message of size bytes fits
+ * after the history, to dst at the end of the history, and add it.
+ */
+
+static size_t
+qlz_decompress_append(const char *source, unsigned char *dst, size_t size,
+                      qlz_state_decompress *state)
+{
+  if (( *source & 1 ) == 1)
+    {
+      size = qlz_decompress_core(
+        (const unsigned char *)source,
+        dst,
+        size,
+        state,
+        (const unsigned char *)state->stream_buffer,
+        dst + size);
+    }
+  else
+    {
+
+     /*
+      * if(csiz != dsiz + qlz_size_header(source))
+      *     return 0;
+      */
+
+      memcpy(dst, source + qlz_size_header(source), size);
+      reset_table_decompress(state);
+    }
+
+  state->stream_counter += size;
+  return size;
+}
+
+#endif /* if QLZ_STREAMING */
+
+/*
+ * Decompress the packet at source into destination. Only the first
+ * limit bytes are written, and only they are decompressed if the
+ * packet starts a new history, which the rest is not needed for.
+ */
+
+static size_t
+qlz_decompress_to(const char *source, void *destination, size_t limit,
+                  qlz_state_decompress *state)
+{
+  size_t  dsiz  = qlz_size_decompressed(source);
+  size_t  csiz  = qlz_size_compressed(source);
+
+#if QLZ_STREAMING
+    if (!fits_stream_decompress(state, dsiz))
+#endif /* if QLZ_STREAMING */
+  {
+    if (( *source & 1 ) == 1)
+      {
+        reset_table_decompress(state);
+        if (limit < dsiz)
+          {
+            dsiz = qlz_decompress_head(
+              (const unsigned char *)source,
+              (unsigned char *)destination,
+              dsiz,
+              limit,
+              state);
+          }
+        else
+          {
+            dsiz = qlz_decompress_core(
+              (const unsigned char *)source,
+              (unsigned char *)destination,
+              dsiz,
+              state,
+              (const unsigned char *)destination,
+              (const unsigned char *)destination + dsiz);
+          }
+      }
+    else
+      {
+        if (csiz != dsiz + qlz_size_header(source))
+          {
+            return 0;
+          }
+
+        dsiz = dsiz < limit ? dsiz : limit;
+        memmove(destination, source + qlz_size_header(source), dsiz);
+      }
+
+    state->stream_counter = 0;
+    reset_table_decompress(state);
+  }
+
+#if QLZ_STREAMING
+    else
+      {
+        unsigned char *dst = state->stream_buffer + state->stream_counter;
+
+        dsiz = qlz_decompress_append(source, dst, dsiz, state);
+        dsiz = dsiz < limit ? dsiz : limit;
+        memcpy(destination, dst, dsiz);
+      }
+#endif /* if QLZ_STREAMING */
+  return dsiz;
+}
+
+QLZ_API size_t
+qlz_decompress(const char *source, void *destination,
+               qlz_state_decompress *state)
+{
+  return qlz_decompress_to(source, destination,
+                           qlz_size_decompressed(source), state);
+}
+
+/*
+ * Decompress at most the first max_out bytes of the packet at source
+ * into destination. The rest of a packet that starts a new history is
+ * not decompressed; a packet that adds to the history is decompressed
+ * whole into it, as the next packets need, and only copied out in part.
+ * Returns the bytes written, or 0 if the packet is bad or max_out is 0;
+ * a max_out of 0 still adds the packet to the history.
+ */
+
+QLZ_API size_t
+qlz_decompress_partial(const char *source, void *destination,
+                       size_t max_out, qlz_state_decompress *state)
+{
+  return qlz_decompress_to(source, destination, max_out, state);
+}
+
+/*
+ * Decompress the packet at source into the history and set *view to
+ * the message there, which stays valid until the next call on state,
+ * so that it is not copied out. Returns 0, and leaves the state alone,
+ * without streaming or for a message larger than the streaming buffer,
+ * which qlz_decompress() must decompress.
+ */
+
+#if QLZ_STREAMING || !defined( QLZ_RUNTIME_ENGINES )
+
+QLZ_API size_t
+qlz_decompress_view(const char *source, const void **view,
+                    qlz_state_decompress *state)
+{
+  *view = NULL;
+#if QLZ_STREAMING
+    {
+      size_t          dsiz    = qlz_size_decompressed(source);
+      unsigned char * buffer  = state->stream_buffer;
+
+      if (dsiz == 0 || dsiz > QLZ_STREAM_SIZE(state))
+        {
+          return 0;
+        }
+
+      if (fits_stream_decompress(state, dsiz))
+        {
+          *view = buffer + state->stream_counter;
+          return qlz_decompress_append(source, buffer + state->stream_counter,
+                                       dsiz, state);
+        }
+
+      /* A stored packet that starts a new history is left in source */
+      reset_table_decompress(state);
+      if (( *source & 1 ) == 1)
+        {
+          dsiz   = qlz_decompress_core((const unsigned char *)source, buffer,
+                                       dsiz, state, buffer, buffer + dsiz);
+          *view  = dsiz != 0 ? buffer : NULL;
+        }
+      else if (qlz_size_compressed(source)
+               == dsiz + qlz_size_header(source))
+        {
+          *view = source + qlz_size_header(source);
+        }
+      else
+        {
+          return 0;
+        }
+
+      state->stream_counter = 0;
+      reset_table_decompress(state);
+      return dsiz;
+    }
+#else  /* if QLZ_STREAMING */
+    (void)source;
+    (void)state;
+    return 0;
+#endif /* if QLZ_STREAMING */
+}
+
+#endif /* if QLZ_STREAMING || !defined( QLZ_RUNTIME_ENGINES ) */
+
+/*
+ * Decompress the packets of a batch in order, so that a streaming state
+ * follows them as it follows single calls. The next packet is fetched
+ * while the current one is decompressed, which hides the cache miss on
+ * packets that are scattered in memory. The runtime level library has
+ * its own, which follows the level of each packet.
+ */
+
+#ifndef QLZ_RUNTIME_ENGINES
+
+QLZ_API size_t
+qlz_decompress_batch(qlz_batch *batch, size_t count,
+                     qlz_state_decompress *state)
+{
+  size_t  total  = 0;
+  size_t  i;
+
+  for (i = 0; i < count; i++)
+    {
+      qlz_batch * item = batch + i;
+
+      if (i + 1 < count)
+        {
+          qlz_prefetch(batch[i + 1].source);
+        }
+
+      item->compressed   = qlz_size_compressed((const char *)item->source);
+      item->size         = qlz_decompress((const char *)item->source,
+                                          item->destination, state);
+      total             += item->size;
+    }
+
+  return total;
+}
+
+#endif /* ifndef QLZ_RUNTIME_ENGINES */
+
+/*
+ * Returns 1 if a packet of size bytes does not depend on the history
+ * of state, which is then reset as qlz_compress() would reset it, so
+ * that the packet can be compressed on a fresh state of the same
+ * settings. Returns 0, and leaves the state alone, otherwise.
+ */
+
+QLZ_API int
+qlz_compress_skip(size_t size, qlz_state_compress *state)
+{
+#if QLZ_STREAMING
+    size_t keep = state->stream_counter < state->stream_window
+                  ? state->stream_counter : state->stream_window;
+
+    if (size == 0 || state->stream_counter + size - 1 < QLZ_STREAM_SIZE(state)
+        || ( keep > 0 && keep + size - 1 < QLZ_STREAM_SIZE(state)))
+      {
+        return 0;
+      }
+
+    reset_table_compress(state);
+    state->stream_counter = 0;
+    return 1;
+#else  /* if QLZ_STREAMING */
+    (void)state;
+    return size > 0;
+#endif /* if QLZ_STREAMING */
+}
+
+/* The same for the packet at source and a decompression state */
+QLZ_API int
+qlz_decompress_skip(const char *source, qlz_state_decompress *state)
+{
+#if QLZ_STREAMING
+    size_t  dsiz  = qlz_size_decompressed(source);
+    size_t  keep  = state->stream_counter < state->stream_window
+                    ? state->stream_counter : state->stream_window;
+
+    if (state->stream_counter + dsiz - 1 < QLZ_STREAM_SIZE(state)
+        || ( keep > 0 && keep + dsiz - 1 < QLZ_STREAM_SIZE(state)))
+      {
+        return 0;
+      }
+
+    reset_table_decompress(state);
+    state->stream_counter = 0;
+#else  /* if QLZ_STREAMING */
+    (void)source;
+    (void)state;
+#endif /* if QLZ_STREAMING */
+  return 1;
+}
+
+/*
+ * Start the history over with size bytes of dict, and enter them into
+ * the hash table as a packet would, so that the next packets can refer
+ * to them. The decompressor does the same with the same dictionary.
+ * Returns 0 if dict does not fit in the streaming buffer with a byte
+ * to spare, or if there is no streaming buffer.
+ */
+
+QLZ_API int
+qlz_state_compress_load_dict(qlz_state_compress *state, const void *dict,
+                             size_t size)
+{
+#if QLZ_STREAMING
+    const unsigned char * src  = state->stream_buffer;
+    const unsigned char * end  = state->stream_buffer + size;
+
+    if (size >= QLZ_STREAM_SIZE(state))
+      {
+        return 0;
+      }
+
+    reset_table_compress(state);
+    memcpy(state->stream_buffer, dict, size);
+    state->stream_counter = size;
+    while (src + 4 <= end)
+      {
+# if QLZ_COMPRESSION_LEVEL == 1
+          ui32 fetch, hash;
+          fetch                     = fast_read(src, 3);
+          hash                      = hash_func(fetch);
+          state->hash[hash].offset  = CAST(src - OFFSET_BASE);
+          state->hash[hash].cache   = ( fetch & 0xffffff )
+                                      | (ui32)state->generation << 24;
+# else  /* if QLZ_COMPRESSION_LEVEL == 1 */
+          insert_hash(state, state->stream_buffer, src);
+# endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+        src++;
+      }
+
+    return 1;
+#else  /* if QLZ_STREAMING */
+    (void)state;
+    (void)dict;
+    return size == 0;
+#endif /* if QLZ_STREAMING */
+}
+
+QLZ_API int
+qlz_state_decompress_load_dict(qlz_state_decompress *state, int level,
+                               size_t streaming_buffer, const void *dict,
+                               size_t size)
+{
+#if QLZ_STREAMING
+    unsigned char *       s    = state->stream_buffer;
+    const unsigned char * end  = state->stream_buffer + size;
+
+    if (level != QLZ_COMPRESSION_LEVEL
+        || streaming_buffer != QLZ_STREAM_SIZE(state)
+        || size >= streaming_buffer)
+      {
+        return 0;
+      }
+
+    reset_table_decompress(state);
+    memcpy(state->stream_buffer, dict, size);
+    state->stream_counter = size;
+    while (s + 4 <= end)
+      {
+        update_hash(state, s);
+        s++;
+      }
+
+    return 1;
+#else  /* if QLZ_STREAMING */
+    (void)state;
+    (void)dict;
+    return level == QLZ_COMPRESSION_LEVEL && streaming_buffer == 0
+           && size == 0;
+#endif /* if QLZ_STREAMING */
+}
+
+/*
+ * Copy source, such as a state primed with a dictionary, over
+ * destination, which has its own streaming buffer of the same size.
+ * Only the used part of the history is copied, and the level 1 and 2
+ * hash entries that point into it are moved to the new buffer.
+ */
+
+QLZ_API int
+qlz_state_compress_copy(qlz_state_compress *destination,
+                        const qlz_state_compress *source)
+{
+#if QLZ_STREAMING
+    if (QLZ_STREAM_SIZE(destination) != QLZ_STREAM_SIZE(source))
+      {
+        return 0;
+      }
+
+    memcpy(destination->stream_buffer, source->stream_buffer,
+           source->stream_counter);
+    destination->stream_window = source->stream_window;
+#endif /* if QLZ_STREAMING */
+  destination->stream_counter = source->stream_counter;
+#if QLZ_COMPRESSION_LEVEL == 3
+    destination->acceleration = source->acceleration;
+#endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+  memcpy(destination->hash_counter, source->hash_counter,
+         sizeof ( source->hash_counter ));
+#if QLZ_COMPRESSION_LEVEL == 1 && QLZ_STREAMING
+    {
+      size_t  delta  = (size_t)destination->stream_buffer
+                       - (size_t)source->stream_buffer;
+      int     i;
+
+      for (i = 0; i < QLZ_HASH_VALUES; i++)
+        {
+          destination->hash[i].cache   = source->hash[i].cache;
+          destination->hash[i].offset  = (const unsigned char *)(size_t)
+            ((size_t)source->hash[i].offset
+             + ( source->hash[i].offset != NULL ? delta : 0 ));
+        }
+    }
+#else  /* if QLZ_COMPRESSION_LEVEL == 1 && QLZ_STREAMING */
+    memcpy(destination->hash, source->hash, sizeof ( source->hash ));
+#endif /* if QLZ_COMPRESSION_LEVEL == 1 && QLZ_STREAMING */
 #if QLZ_COMPRESSION_LEVEL == 1
+    destination->generation = source->generation;
+#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+  return 1;
+}
+
+QLZ_API int
+qlz_state_decompress_copy(qlz_state_decompress *destination,
+                          const qlz_state_decompress *source)
+{
+#if QLZ_STREAMING
+    if (QLZ_STREAM_SIZE(destination) != QLZ_STREAM_SIZE(source))
+      {
+        return 0;
+      }
+
+    memcpy(destination->stream_buffer, source->stream_buffer,
+           source->stream_counter);
+    destination->stream_window = source->stream_window;
+#endif /* if QLZ_STREAMING */
+  destination->stream_counter = source->stream_counter;
+#if QLZ_COMPRESSION_LEVEL <= 2
+    memcpy(destination->hash_counter, source->hash_counter,
+           sizeof ( source->hash_counter ));
+    destination->generation = source->generation;
+# if QLZ_STREAMING
+      {
+        const unsigned char * const * from
+          = (const unsigned char * const *)source->hash;
+        const unsigned char **        to
+          = (const unsigned char **)destination->hash;
+        size_t                        delta
+          = (size_t)destination->stream_buffer
+            - (size_t)source->stream_buffer;
+        size_t                        i;
+
+        for (i = 0; i < QLZ_HASH_VALUES * QLZ_POINTERS; i++)
+          {
+            to[i] = (const unsigned char *)(size_t)
+              ((size_t)from[i] + ( from[i] != NULL ? delta : 0 ));
+          }
+      }
+# else  /* if QLZ_STREAMING */
+      memcpy(destination->hash, source->hash, sizeof ( source->hash ));
+# endif /* if QLZ_STREAMING */
+#endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
+  return 1;
+}
+
+#endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+
+#ifndef QLZ_INSTANCE
+
+/*
+ * A stream header is a packet of 9 bytes, or of 13 bytes if the
+ * stream uses a window (W), that tells the decompressor the streaming
+ * buffer size, which the SS bits of a packet cannot tell for sizes
+ * other than 100000 and 1000000, and the window. Packets always start
+ * with 01 in the high bits.
+ *
+ * 76543210
+ * 10SSLL1W + header size (4 bytes) + streaming buffer size (4 bytes)
+ *          + window (4 bytes, if W)
+ */
+
+size_t
+qlz_stream_header_write(const qlz_state_compress *state, char *destination)
+{
+  int     level;
+  size_t  streaming_buffer, window, size;
+
+#if QLZ_COMPRESSION_LEVEL == 0
+    level             = state->level;
+    streaming_buffer  = state->streaming_buffer;
+    window            = state->stream_window;
+#elif QLZ_STREAMING_BUFFER > 0
+    level             = QLZ_COMPRESSION_LEVEL;
+    streaming_buffer  = QLZ_STREAMING_BUFFER;
+    window            = state->stream_window;
+#else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+    (void)state;
+    level             = QLZ_COMPRESSION_LEVEL;
+    streaming_buffer  = QLZ_STREAMING_BUFFER;
+    window            = 0;
+#endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+
+  size = window > 0 ? 13 : 9;
+  *destination = (char)( 0x80 | ( stream_bits(streaming_buffer) << 4 )
+                         | ( level << 2 ) | 2 | ( window > 0 ));
+  fast_write((ui32)size, destination + 1, 4);
+  fast_write((ui32)streaming_buffer, destination + 5, 4);
+  if (window > 0)
+    {
+      fast_write((ui32)window, destination + 9, 4);
+    }
+
+  return size;
+}
+
+size_t
+qlz_stream_header_read(const char *source, qlz_state_decompress *state)
+{
+  size_t  streaming_buffer, window, size;
+
+  size = ( *source & 1 ) ? 13 : 9;
+  if (( *source & 0xc2 ) != 0x82 || qlz_size_compressed(source) != size)
+    {
+      return 0;
+    }
+
+  streaming_buffer  = qlz_size_decompressed(source);
+  window            = size > 9 ? fast_read(source + 9, 4) : 0;
+  if (stream_bits(streaming_buffer) != (( *source >> 4 ) & 3 )
+      || ( size > 9 && ( window == 0 || window >= streaming_buffer )))
+    {
+      return 0;
+    }
+
+#if QLZ_COMPRESSION_LEVEL == 0
+    if (streaming_buffer != 0)
+      {
+        state->streaming_other = streaming_buffer;
+      }
+#else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+    if (streaming_buffer != QLZ_STREAMING_BUFFER)
+      {
+        return 0;
+      }
+#endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+
+  if (!qlz_state_decompress_set_window(state, window))
+    {
+      return 0;
+    }
+
+  return size;
+}
+
+/*
+ * Keep the last window bytes of the history when the streaming buffer
+ * is full, instead of starting over. Both sides must use the same
+ * window, which must be smaller than the streaming buffer. A window
+ * of 0 restores the default. Returns 0 if the window cannot be used.
+ */
+
+int
+qlz_state_compress_set_window(qlz_state_compress *state, size_t window)
+{
+#if QLZ_COMPRESSION_LEVEL == 0
+    if (window > 0 && window >= state->streaming_buffer)
+      {
+        return 0;
+      }
+
+    state->stream_window = window;
+    switch (QLZ_VARIANT(state->level, state->streaming_buffer))
+      {
+      case QLZ_VARIANT(1, 1):
+        state->u.l1s.stream_window = window;
+        break;
+
+      case QLZ_VARIANT(2, 1):
+        state->u.l2s.stream_window = window;
+        break;
+
+      case QLZ_VARIANT(3, 1):
+        state->u.l3s.stream_window = window;
+        break;
+      }
+#elif QLZ_STREAMING_BUFFER > 0
+    if (window >= QLZ_STREAMING_BUFFER)
+      {
+        return 0;
+      }
+
+    state->stream_window = window;
+#else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+    (void)state;
+    if (window > 0)
+      {
+        return 0;
+      }
+#endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+  return 1;
+}
+
+int
+qlz_state_decompress_set_window(qlz_state_decompress *state, size_t window)
+{
+#if QLZ_COMPRESSION_LEVEL == 0
+    /* streaming_buffer is set by the first packet, so check the other */
+    if (window > 0 && window >= state->streaming_other)
+      {
+        return 0;
+      }
+
+    state->stream_window = window;
+    switch (QLZ_VARIANT(state->level, state->streaming_buffer))
+      {
+      case QLZ_VARIANT(1, 1):
+        state->u.l1s.stream_window = window;
+        break;
+
+      case QLZ_VARIANT(2, 1):
+        state->u.l2s.stream_window = window;
+        break;
+
+      case QLZ_VARIANT(3, 1):
+        state->u.l3s.stream_window = window;
+        break;
+      }
+#elif QLZ_STREAMING_BUFFER > 0
+    if (window >= QLZ_STREAMING_BUFFER)
+      {
+        return 0;
+      }
+
+    state->stream_window = window;
+#else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+    (void)state;
+    if (window > 0)
+      {
+        return 0;
+      }
+#endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+  return 1;
+}
+
+/*
+ * Trade compression for speed at level 3, which searches less as the
+ * acceleration grows. 0 and 1 restore the default. Returns 0 if the
+ * acceleration cannot be used by the level.
+ */
+
+int
+qlz_state_compress_set_acceleration(qlz_state_compress *state,
+                                    int acceleration)
+{
+  if (acceleration < 0)
+    {
+      return 0;
+    }
+
+#if QLZ_COMPRESSION_LEVEL == 0
+    if (state->level != 3)
+      {
+        return acceleration <= 1;
+      }
+
+    state->acceleration = acceleration;
+    if (state->streaming_buffer > 0)
+      {
+        state->u.l3s.acceleration = acceleration;
+      }
+    else
+      {
+        state->u.l3.acceleration = acceleration;
+      }
+#elif QLZ_COMPRESSION_LEVEL == 3
+    state->acceleration = acceleration;
+#else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+    (void)state;
+    if (acceleration > 1)
+      {
+        return 0;
+      }
+#endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+  return 1;
+}
+
+int
+qlz_get_setting(int setting)
+{
+  switch (setting)
+    {
+    case 0:
+      return QLZ_COMPRESSION_LEVEL;  //-V1037
+
+    case 1:
+      return sizeof ( qlz_state_compress );
+
+    case 2:
+      return sizeof ( qlz_state_decompress );
+
+    case 3:
+      return QLZ_STREAMING_BUFFER;
+
+#ifdef QLZ_MEMORY_SAFE
+        case 6:
+          return 1;
+
+#else  /* ifdef QLZ_MEMORY_SAFE */
+        case 6:
+          return 0;
+
+#endif /* ifdef QLZ_MEMORY_SAFE */
+        case 7:
+          return QLZ_VERSION_MAJOR; //-V1037
+
+        case 8:
+          return QLZ_VERSION_MINOR;
+
+        case 9:
+          return QLZ_VERSION_REVISION;
+    }
+  return -1;
+}
+
+size_t
+qlz_compress_bound(size_t size)
+{
+  return QLZ_COMPRESS_BOUND(size);
+}
+
+/*
+ * Follow qlz_decompress_core() through the packet at source without
+ * writing, and return how many bytes the buffer must hold beyond the
+ * decompressed size for the packet to be decompressed over itself from
+ * the end of the buffer. At each step the writes must stay behind the
+ * next byte of the packet to be read: a match writes up to
+ * WILD_COPY_MARGIN bytes past its end, or 3 in memcpy_up(), and a run
+ * of literals 32 bytes or 4. Returns 0 if the packet is bad.
+ */
+
+size_t
+qlz_inplace_margin(const char *source)
+{
+  const unsigned char * packet  = (const unsigned char *)source;
+  size_t                header  = qlz_size_header(source);
+  size_t                c       = qlz_size_compressed(source);
+  size_t                d       = qlz_size_decompressed(source);
+  size_t                last_matchstart
+    = UNCONDITIONAL_MATCHLEN_DECOMPRESSOR + UNCOMPRESSED_END + 1;
+  int                   level   = ( *packet >> 2 ) & 3;
+  size_t                src     = header;
+  size_t                dst     = 0;
+  size_t                margin  = c > d ? c - d : 0;
+  size_t                end;
+  ui32                  cword   = 1;
+
+  if (( *packet & 1 ) == 0)
+    {
+      return c == d + header ? header : 0;
+    }
+
+  if (level == 0 || d == 0)
+    {
+      return 0;
+    }
+
+  /* last_matchstart counts back from the end of the destination */
+  last_matchstart = d > last_matchstart ? d - last_matchstart : 0;
+
+  for (;;)
+    {
+      ui32 fetch, matchlen;
+
+      if (cword == 1)
         {
-          const unsigned char * o;
-          ui32                  hash, cached;
+          if (src + CWORD_LEN > c)
+            {
+              return 0;
+            }
 
-          hash                      = hash_func(fetch);
-          cached                    = fetch ^ state->hash[hash].cache;
-          state->hash[hash].cache   = fetch;
+          cword  = fast_read(packet + src, CWORD_LEN);
+          src   += CWORD_LEN;
+          if (cword <= 1)
+            {
+              return 0;
+            }
+        }
 
-          o                         = state->hash[hash].offset + OFFSET_BASE;
-          state->hash[hash].offset  = CAST(src - OFFSET_BASE);
-# ifdef X86X64
-            if (( cached & 0xffffff ) == 0 && o != OFFSET_BASE
-                && ( src - o > MINOFFSET
-                     || ( src == o + 1 && lits >= 3 && src > source + 3
-                          && same(src - 3, 6))))
-              {
-# else  /* ifdef X86X64 */
-            if (cached == 0 && o != OFFSET_BASE
-                && ( src - o > MINOFFSET
-                     || ( src == o + 1 && lits >= 3 && src > source + 3
-                          && same(src - 3, 6))))
-              {
-# endif /* ifdef X86X64 */
-                size_t matchlen = 3;
-                hash          <<= 4;
-                cword_val       = ( cword_val >> 1 ) | ( 1U << 31 );
+      if (src + 4 > c)
+        {
+          return 0;
+        }
 
-# if defined X86X64 && defined QLZ_PTR_64
-                  {
-#  ifdef __GNUC__
-                      unsigned long long  a
-                          = *(unsigned long long *)( src + matchlen );
-                      unsigned long long  b
-                          = *(unsigned long long *)( o + matchlen );
-                      unsigned long long  c
-                          = a ^ b;
-#  else  /* ifdef __GNUC__ */
-                      unsigned int        a
-                          = *(unsigned int *)( src + matchlen );
-                      unsigned int        b
-                          = *(unsigned int *)( o + matchlen );
-                      unsigned int        c
-                          = a ^ b;
-#  endif /* ifdef __GNUC__ */
-                    if (qlz_unlikely(c == 0))
-                      {
-                        size_t  q
-                            = last_byte - UNCOMPRESSED_END - src + 1;
-                        size_t  remaining
-                            = q > 255 ? 255 : q;
-                        matchlen += sizeof ( c );
-                        while (src[matchlen] == o[matchlen] //-V781
-                                 && matchlen < remaining)
-                          {
-                            matchlen++;
-                          }
-                      }
-                    else
-                      {
-#  if defined _MSC_VER || defined __INTEL_COMPILER
-                          unsigned int index = 0;
-                          _BitScanForward((unsigned long *)&index, c);
-                          matchlen  += index >> 3;
-#  else  /* if defined _MSC_VER || defined __INTEL_COMPILER */
-                          matchlen  += __builtin_ctzll(c) >> 3;
-#  endif /* if defined _MSC_VER || defined __INTEL_COMPILER */
-                      }
-                  }
-# else  /* if defined X86X64 && defined QLZ_PTR_64 */
-                  if (src[matchlen] == o[matchlen])
-                    {
-                      size_t  q
-                          = last_byte - UNCOMPRESSED_END - src + 1;
-                      size_t  remaining
-                          = q > 255 ? 255 : q;
-                      matchlen++;
-                      while (
-                              src[matchlen] == o[matchlen]
-                               && matchlen < remaining)
-                        {
-                          matchlen++;
-                        }
-                    }
-# endif /* if defined X86X64 && defined QLZ_PTR_64 */
-                src += matchlen;
+      fetch = fast_read(packet + src, 4);
 
-                if (qlz_likely(matchlen < 18))
-                  {
-                    fast_write((ui32)( matchlen - 2 ) | hash, dst, 2);
-                    dst += 2;
-                  }
-                else
-                  {
-                    fast_write((ui32)( matchlen << 16 ) | hash, dst, 3);
-                    dst += 3;
-                  }
+      if (( cword & 1 ) == 1)
+        {
+          cword = cword >> 1;
+          if (level <= 2
+              && ( fetch & ( level == 1 ? 0xf : 28 )) != 0)
+            {
+              matchlen   = level == 1 ? ( fetch & 0xf ) + 2
+                           : (( fetch >> 2 ) & 0x7 ) + 2;
+              src       += 2;
+            }
+          else if (level <= 2)
+            {
+              matchlen   = packet[src + 2];
+              src       += 3;
+            }
+          else if (( fetch & 3 ) == 0)
+            {
+              matchlen   = 3;
+              src       += 1;
+            }
+          else if (( fetch & 2 ) == 0)
+            {
+              matchlen   = 3;
+              src       += 2;
+            }
+          else if (( fetch & 1 ) == 0)
+            {
+              matchlen   = (( fetch >> 2 ) & 15 ) + 3;
+              src       += 2;
+            }
+          else if (( fetch & 127 ) != 3)
+            {
+              matchlen   = (( fetch >> 2 ) & 0x1f ) + 2;
+              src       += 3;
+            }
+          else
+            {
+              matchlen   = (( fetch >> 7 ) & 255 ) + 3;
+              src       += 4;
+            }
 
-                fetch  = fast_read(src, 3);
-                lits   = 0;
-              }
-            else
-              {
-                lits++;
-                *dst = *src;
-                src++;
-                dst++;
-                cword_val  = ( cword_val >> 1 );
-# ifdef X86X64
-                  fetch    = fast_read(src, 3);
-# else  /* ifdef X86X64 */
-                  fetch    = ( fetch >> 8 & 0xffff ) | ( *( src + 2 ) << 16 );
-# endif /* ifdef X86X64 */
-              }
+          if (dst + matchlen + UNCOMPRESSED_END > d)
+            {
+              return 0;
+            }
+
+          end   = dst + matchlen
+                  + ( dst + matchlen + WILD_COPY_MARGIN < d
+                      ? WILD_COPY_MARGIN : 3 );
+          dst  += matchlen;
         }
-#elif QLZ_COMPRESSION_LEVEL >= 2
+      else if (dst < last_matchstart)
         {
-          const unsigned char * o, *offset2;
-          ui32                  hash, matchlen, k, m, best_k = 0;
-          unsigned char         c;
-          size_t                remaining
-              = ( last_byte - UNCOMPRESSED_END - src + 1 ) > 255
-                               ? 255
-                               : ( last_byte - UNCOMPRESSED_END - src + 1 );
-          (void)best_k;
-
-          fetch    = fast_read(src, 3);
-          hash     = hash_func(fetch);
+          ui32 n = lowest_bit(cword);
 
-          c        = state->hash_counter[hash];
+          if (n > 4 && dst + 32 <= last_matchstart && src + 33 <= c)
+            {
+              end = dst + 32;
+            }
+          else
+            {
+              n    = n > 4 ? 4 : n;
+              end  = dst + 4;
+            }
 
-          offset2  = state->hash[hash].offset[0];
-          if (offset2 < src - MINOFFSET && c > 0
-              && (( fast_read(offset2, 3) ^ fetch ) & 0xffffff ) == 0)
+          cword   = cword >> n;
+          dst    += n;
+          src    += n;
+        }
+      else
+        {
+          while (dst < d)
             {
-              matchlen = 3;
-              if (*( offset2 + matchlen ) == *( src + matchlen ))
+              if (cword == 1)
                 {
-                  matchlen = 4;
-                  while (*( offset2 + matchlen ) == *( src + matchlen )
-                         && matchlen < remaining)
-                    {
-                      matchlen++;
-                    }
+                  src    += CWORD_LEN;
+                  cword   = 1U << 31;
+                }
+
+              if (src >= c)
+                {
+                  return 0;
+                }
+
+              dst++;
+              src++;
+              cword = cword >> 1;
+              if (dst + c > src + d && dst + c - src - d > margin)
+                {
+                  margin = dst + c - src - d;
                 }
             }
-          else
+
+          return margin > 0 ? margin : 1;
+        }
+
+      if (end + c > src + d && end + c - src - d > margin)
+        {
+          margin = end + c - src - d;
+        }
+    }
+}
+
+/*
+ * Dictionary training. The samples are scored by the three-byte
+ * strings that the hash tables are keyed on: a string counts once for
+ * each sample it occurs in, less one, since a string of a single
+ * sample is no use to the others. The samples are cut into as many
+ * epochs as the dictionary has segments, and the segment with the
+ * highest sum of counts is taken from each epoch; its strings then
+ * count 0, so that the next segments bring new ones. The segments are
+ * written in increasing order of score, which puts the best of them
+ * at the end of the dictionary, next to the packets that refer to it,
+ * where level 3 has its shortest offsets and the level 1 and 2 hash
+ * entries are the last to be replaced.
+ */
+
+# define QLZ_TRAIN_SEGMENT        64
+# define QLZ_TRAIN_HASH_BITS      20
+
+typedef struct
+{
+  size_t position;
+  ui32   score;
+} qlz_train_segment;
+
+static __inline ui32
+qlz_train_hash(const unsigned char *p)
+{
+  ui32 v = (ui32)p[0] | (ui32)p[1] << 8 | (ui32)p[2] << 16;
+
+  return ( v * 2654435761U ) >> ( 32 - QLZ_TRAIN_HASH_BITS );
+}
+
+static int
+qlz_train_compare(const void *a, const void *b)
+{
+  ui32  x  = ((const qlz_train_segment *)a )->score;
+  ui32  y  = ((const qlz_train_segment *)b )->score;
+
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Build a dictionary of at most capacity bytes, and QLZ_DICT_MAX, from
+ * count samples of sizes[i] bytes stored one after the other. Returns
+ * the size of the dictionary, or 0 if capacity is 0, if the samples are
+ * larger than capacity but too small to give each of its segments a
+ * stretch to be taken from, or if memory runs out.
+ */
+
+size_t
+qlz_train_dict(void *dict, size_t capacity, const void *samples,
+               const size_t *sizes, size_t count)
+{
+  const unsigned char * data      = (const unsigned char *)samples;
+  unsigned char *       out       = (unsigned char *)dict;
+  qlz_train_segment *   segments;
+  ui32 *                counts, *seen;
+  size_t                total     = 0, epochs, epoch, used, i, j, n;
+  size_t                size      = 0;
+
+  for (i = 0; i < count; i++)
+    {
+      total += sizes[i];
+    }
+
+  capacity = capacity < QLZ_DICT_MAX ? capacity : QLZ_DICT_MAX;
+  if (capacity == 0)
+    {
+      return 0;
+    }
+
+  if (total <= capacity)
+    {
+      memcpy(out, data, total);
+      return total;
+    }
+
+  epochs    = ( capacity + QLZ_TRAIN_SEGMENT - 1 ) / QLZ_TRAIN_SEGMENT;
+  epoch     = total / epochs;
+  counts    = (ui32 *)calloc((size_t)1 << QLZ_TRAIN_HASH_BITS,
+                             sizeof ( ui32 ));
+  seen      = (ui32 *)calloc((size_t)1 << QLZ_TRAIN_HASH_BITS,
+                             sizeof ( ui32 ));
+  segments  = (qlz_train_segment *)malloc(epochs * sizeof ( *segments ));
+  if (counts == NULL || seen == NULL || segments == NULL
+      || epoch < QLZ_TRAIN_SEGMENT)
+    {
+      free(counts);
+      free(seen);
+      free(segments);
+      return 0;
+    }
+
+  /* Count the samples each string occurs in */
+  for (i = 0, used = 0; i < count; used += sizes[i], i++)
+    {
+      for (j = 0; j + 3 <= sizes[i]; j++)
+        {
+          ui32 h = qlz_train_hash(data + used + j);
+
+          if (seen[h] != i + 1)
             {
-              matchlen = 0;
+              seen[h] = (ui32)( i + 1 );
+              counts[h]++;
             }
+        }
+    }
 
-          for (k = 1; k < QLZ_POINTERS && c > k; k++)
+  for (i = 0; i < (size_t)1 << QLZ_TRAIN_HASH_BITS; i++)
+    {
+      counts[i] -= counts[i] > 0;
+    }
+
+  /* Take the best segment of each epoch */
+  for (n = 0; n < epochs; n++)
+    {
+      const unsigned char * base   = data + n * epoch;
+      ui32                  score  = 0, best = 0;
+      size_t                best_j = 0;
+
+      for (j = 0; j + 3 <= epoch; j++)
+        {
+          score += counts[qlz_train_hash(base + j)];
+          if (j + 3 >= QLZ_TRAIN_SEGMENT)
             {
-              o = state->hash[hash].offset[k];
-# if QLZ_COMPRESSION_LEVEL == 3
-                if ((( fast_read(o, 3) ^ fetch ) & 0xffffff ) == 0
-                    && o < src - MINOFFSET)
-# elif QLZ_COMPRESSION_LEVEL == 2
-                if (*( src + matchlen ) == *( o + matchlen )
-                    && (( fast_read(o, 3) ^ fetch ) & 0xffffff ) == 0
-                    && o < src - MINOFFSET)
-# endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+              size_t start = j + 3 - QLZ_TRAIN_SEGMENT;
+
+              if (score > best)
                 {
-                  m = 3;
-                  while (*( o + m ) == *( src + m ) && m < remaining)
-                    {
-                      m++;
-                    }
-# if QLZ_COMPRESSION_LEVEL == 3
-                    if (( m > matchlen ) || ( m == matchlen && o > offset2 ))
-# elif QLZ_COMPRESSION_LEVEL == 2
-                    if (m > matchlen)
-# endif /* if QLZ_COMPRESSION_LEVEL == 3 */
-                    {
-                      offset2   = o;
-                      (void)offset2;
-                      matchlen  = m;
-                      (void)matchlen;
-                      best_k    = k;
-                      (void)best_k;
-                    }
+                  best    = score;
+                  best_j  = start;
                 }
+
+              score -= counts[qlz_train_hash(base + start)];
             }
+        }
 
-          o                                                   = offset2;
-          (void)o;
-          state->hash[hash].offset[c & ( QLZ_POINTERS - 1 )]  = src;
-          c++;
-          state->hash_counter[hash]                           = c;
+      segments[n].position  = n * epoch + best_j;
+      segments[n].score     = best;
+      for (j = 0; j + 3 <= QLZ_TRAIN_SEGMENT; j++)
+        {
+          counts[qlz_train_hash(data + segments[n].position + j)] = 0;
+        }
+    }
 
-# if QLZ_COMPRESSION_LEVEL == 3
-            if (matchlen > 2 && src - o < 131071)
-              {
-                ui32    u;
-                size_t  offset = src - o;
+  /* Best last, and the first one cut to fit */
+  qsort(segments, epochs, sizeof ( *segments ), qlz_train_compare);
+  for (n = 0; n < epochs; n++)
+    {
+      size_t skip = n == 0 ? epochs * QLZ_TRAIN_SEGMENT - capacity : 0;
 
-                for (u = 1; u < matchlen; u++)
-                  {
-                    hash = hashat(src + u);
-                    c = state->hash_counter[hash]++;
-                    state->hash[hash].offset[c & ( QLZ_POINTERS - 1 )]
-                        = src + u;
-                  }
+      memcpy(out + size, data + segments[n].position + skip,
+             QLZ_TRAIN_SEGMENT - skip);
+      size += QLZ_TRAIN_SEGMENT - skip;
+    }
 
-                cword_val   = ( cword_val >> 1 ) | ( 1U << 31 );
-                src        += matchlen;
+  free(counts);
+  free(seen);
+  free(segments);
+  return size;
+}
 
-                if (matchlen == 3 && offset <= 63)
-                  {
-                    *dst = (unsigned char)( offset << 2 );
-                    dst++;
-                  }
-                else if (matchlen == 3 && offset <= 16383)
-                  {
-                    ui32 f = (ui32)(( offset << 2 ) | 1 );
-                    fast_write(f, dst, 2);
-                    dst   += 2;
-                  }
-                else if (matchlen <= 18 && offset <= 1023)
-                  {
-                    ui32 f
-                        = (( matchlen - 3 ) << 2 ) | ((ui32)offset << 6 ) | 2;
-                    fast_write(f, dst, 2);
-                    dst += 2;
-                  }
-                else if (matchlen <= 33)
-                  {
-                    ui32 f
-                        = (( matchlen - 2 ) << 2 ) | ((ui32)offset << 7 ) | 3;
-                    fast_write(f, dst, 3);
-                    dst += 3;
-                  }
-                else
-                  {
-                    ui32 f
-                        = (( matchlen - 3 ) << 7 ) | ((ui32)offset << 15 ) | 3;
-                    fast_write(f, dst, 4);
-                    dst += 4;
-                  }
-              }
-            else
-              {
-                *dst = *src;
-                src++;
-                dst++;
-                cword_val = ( cword_val >> 1 );
-              }
+#ifdef QLZ_THREADS
+
+# if QLZ_COMPRESSION_LEVEL != 0 && QLZ_STREAMING_BUFFER > 0
+#  error QLZ_THREADS needs QLZ_COMPRESSION_LEVEL 0 or no streaming buffer
+# endif
+
+# include <pthread.h>
+# include <unistd.h>
+
+/* Default size of the blocks of qlz_compress_parallel() */
+# define QLZ_PARALLEL_BLOCK       1048576
+
+# define QLZ_JOB_COMPRESS         0
+# define QLZ_JOB_DECOMPRESS       1
+# define QLZ_JOB_STREAM           2
+
+/* History that reaches every back-reference of level 3 */
+# define QLZ_PRIME_SIZE           131072
+
+struct qlz_job
+{
+  qlz_pool *   pool;
+  qlz_job *    next;
+  int          kind;
+  int          level;
+  const char * source;
+  char *       destination;
+  size_t       size;
+  size_t       result;
+  int          done;
+# if QLZ_COMPRESSION_LEVEL == 0
+    /* QLZ_JOB_STREAM: the stream and the history before the block */
+    const qlz_state_compress * stream;
+    size_t                     history;
+    const char *               prime[2];
+    size_t                     prime_size[2];
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+};
+
+struct qlz_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  work;
+  pthread_cond_t  done;
+  qlz_job *       head;
+  qlz_job *       tail;
+  int             stop;
+  int             threads;
+  pthread_t *     thread;
+};
+
+/* States of one worker, created on first use */
+typedef struct
+{
+  qlz_state_compress *   compress[4];
+  qlz_state_decompress * decompress;
+  qlz_state_compress *   stream;
+} qlz_worker;
+
+static qlz_state_compress *
+qlz_worker_compress(qlz_worker *worker, int level)
+{
+  if (level < 1 || level > 3)
+    {
+      return NULL;
+    }
+
+  if (worker->compress[level] == NULL)
+    {
+# if QLZ_COMPRESSION_LEVEL == 0
+        worker->compress[level] = qlz_state_compress_new(level, 0);
+# else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+        if (level != QLZ_COMPRESSION_LEVEL)
+          {
+            return NULL;
+          }
+
+        worker->compress[level]
+          = (qlz_state_compress *)malloc(sizeof ( qlz_state_compress ));
+        if (worker->compress[level] != NULL)
+          {
+            memset(worker->compress[level], 0, sizeof ( qlz_state_compress ));
+          }
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+    }
+
+  return worker->compress[level];
+}
+
+static qlz_state_decompress *
+qlz_worker_decompress(qlz_worker *worker)
+{
+  if (worker->decompress == NULL)
+    {
+# if QLZ_COMPRESSION_LEVEL == 0
+        worker->decompress = qlz_state_decompress_new(0);
+# else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+        worker->decompress
+          = (qlz_state_decompress *)malloc(sizeof ( qlz_state_decompress ));
+        if (worker->decompress != NULL)
+          {
+            memset(worker->decompress, 0, sizeof ( qlz_state_decompress ));
+          }
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+    }
+
+  return worker->decompress;
+}
+
+# if QLZ_COMPRESSION_LEVEL == 0
+
+/* Forget the history of a state, as qlz_compress() does on a reset */
+static void
+qlz_worker_reset(qlz_state_compress *state)
+{
+  switch (QLZ_VARIANT(state->level, state->streaming_buffer))
+    {
+    case QLZ_VARIANT(1, 1):
+      reset_table_compress_1s(&state->u.l1s);
+      state->u.l1s.stream_counter = 0;
+      break;
+
+    case QLZ_VARIANT(2, 1):
+      reset_table_compress_2s(&state->u.l2s);
+      state->u.l2s.stream_counter = 0;
+      break;
+
+    case QLZ_VARIANT(3, 1):
+      reset_table_compress_3s(&state->u.l3s);
+      state->u.l3s.stream_counter = 0;
+      break;
+    }
+}
+
+/*
+ * Compress a block of the stream of job->stream on a state of the same
+ * settings. A block of level 3 gets the history that the decompressor
+ * will have before it, of which the last bytes are copied in and
+ * entered into the hash table; any other block starts a new history.
+ */
+
+static size_t
+qlz_worker_stream(qlz_worker *worker, qlz_job *job)
+{
+  qlz_state_compress * state   = worker->stream;
+  size_t               primed  = job->prime_size[0] + job->prime_size[1];
+  unsigned char *      history;
+
+  if (state != NULL
+      && ( state->level != job->stream->level
+           || state->streaming_buffer != job->stream->streaming_buffer ))
+    {
+      qlz_state_compress_free(state);
+      state = NULL;
+    }
+
+  if (state == NULL)
+    {
+      state           = qlz_state_compress_new(job->stream->level,
+                                               job->stream->streaming_buffer);
+      worker->stream  = state;
+      if (state == NULL)
+        {
+          return 0;
+        }
+    }
+
+  qlz_state_compress_set_window(state, job->stream->stream_window);
+  qlz_state_compress_set_acceleration(state, job->stream->acceleration);
+  qlz_worker_reset(state);
+  if (job->history > 0)
+    {
+      history = state->stream_buffer + job->history - primed;
+      memcpy(history, job->prime[0], job->prime_size[0]);
+      memcpy(history + job->prime_size[0], job->prime[1], job->prime_size[1]);
+      state->u.l3s.stream_counter = job->history;
+      prime_stream_compress_3s(&state->u.l3s, job->history - primed);
+    }
+
+  return qlz_compress(job->source, job->destination, job->size, state);
+}
+
+/*
+ * Decompress a packet that starts a new history, such as one that
+ * qlz_decompress_skip() accepted, with the engine of its level that
+ * does not stream.
+ */
+
+static size_t
+qlz_worker_fresh(qlz_state_decompress *state, const char *source,
+                 void *destination)
+{
+  int level = ( *source >> 2 ) & 3;
+
+  if (( *source & 0xc0 ) != 0x40)
+    {
+      return 0;
+    }
+
+  if (level != state->level || state->streaming_buffer != 0)
+    {
+      if (!qlz_state_decompress_setup(state, level, 0))
+        {
+          return 0;
+        }
+    }
+
+  switch (level)
+    {
+    case 1:
+      return qlz_decompress_1(source, destination, &state->u.l1);
+
+    case 2:
+      return qlz_decompress_2(source, destination, &state->u.l2);
+
+    case 3:
+      return qlz_decompress_3(source, destination, &state->u.l3);
+    }
+  return 0;
+}
+
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+
+static void
+qlz_worker_run(qlz_worker *worker, qlz_job *job)
+{
+  qlz_state_compress *   compress;
+  qlz_state_decompress * decompress;
+
+  job->result = 0;
+# if QLZ_COMPRESSION_LEVEL == 0
+    if (job->kind == QLZ_JOB_STREAM)
+      {
+        job->result = qlz_worker_stream(worker, job);
+        return;
+      }
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+
+  if (job->kind == QLZ_JOB_COMPRESS)
+    {
+      compress = qlz_worker_compress(worker, job->level);
+      if (compress != NULL)
+        {
+          job->result = qlz_compress(job->source, job->destination,
+                                     job->size, compress);
+        }
+    }
+  else
+    {
+      decompress = qlz_worker_decompress(worker);
+      if (decompress != NULL)
+        {
+# if QLZ_COMPRESSION_LEVEL == 0
+            job->result = qlz_worker_fresh(decompress, job->source,
+                                           job->destination);
+# else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+            job->result = qlz_decompress(job->source, job->destination,
+                                         decompress);
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+        }
+    }
+}
 
-# elif QLZ_COMPRESSION_LEVEL == 2
+static void *
+qlz_worker_main(void *arg)
+{
+  qlz_pool * pool = (qlz_pool *)arg;
+  qlz_worker worker;
+  qlz_job *  job;
+  int        i;
 
-            if (matchlen > 2)
-              {
-                cword_val   = ( cword_val >> 1 ) | ( 1U << 31 );
-                src        += matchlen;
+  memset(&worker, 0, sizeof ( worker ));
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+    {
+      while (pool->head == NULL && !pool->stop)
+        {
+          pthread_cond_wait(&pool->work, &pool->lock);
+        }
 
-                if (matchlen < 10)
-                  {
-                    ui32 f = best_k | (( matchlen - 2 ) << 2 ) | ( hash << 5 );
-                    fast_write(f, dst, 2);
-                    dst   += 2;
-                  }
-                else
-                  {
-                    ui32 f = best_k | ( matchlen << 16 ) | ( hash << 5 );
-                    fast_write(f, dst, 3);
-                    dst   += 3;
-                  }
-              }
-            else
-              {
-                *dst = *src;
-                src++;
-                dst++;
-                cword_val = ( cword_val >> 1 );
-              }
+      if (pool->head == NULL)
+        {
+          break;
+        }
 
-# endif /* if QLZ_COMPRESSION_LEVEL == 3 */
+      job         = pool->head;
+      pool->head  = job->next;
+      if (pool->head == NULL)
+        {
+          pool->tail = NULL;
         }
-#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+
+      pthread_mutex_unlock(&pool->lock);
+      qlz_worker_run(&worker, job);
+      pthread_mutex_lock(&pool->lock);
+      job->done = 1;
+      pthread_cond_broadcast(&pool->done);
     }
-  while (src <= last_byte)
+
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < 4; i++)
     {
-      if (( cword_val & 1 ) == 1)
+# if QLZ_COMPRESSION_LEVEL == 0
+        qlz_state_compress_free(worker.compress[i]);
+# else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+        free(worker.compress[i]);
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+    }
+
+# if QLZ_COMPRESSION_LEVEL == 0
+    qlz_state_decompress_free(worker.decompress);
+    qlz_state_compress_free(worker.stream);
+# else  /* if QLZ_COMPRESSION_LEVEL == 0 */
+    free(worker.decompress);
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+  return NULL;
+}
+
+/*
+ * Start a pool of threads workers, or of one worker for each online
+ * processor if threads is 0. The pool can be shared by any number of
+ * threads until it is freed.
+ */
+
+qlz_pool *
+qlz_pool_new(int threads)
+{
+  qlz_pool * pool;
+
+  if (threads <= 0)
+    {
+      long n = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = n > 0 ? (int)n : 1;
+    }
+
+  pool = (qlz_pool *)malloc(sizeof ( qlz_pool ));
+  if (pool == NULL)
+    {
+      return NULL;
+    }
+
+  memset(pool, 0, sizeof ( qlz_pool ));
+  pool->thread = (pthread_t *)malloc(threads * sizeof ( pthread_t ));
+  if (pool->thread == NULL)
+    {
+      free(pool);
+      return NULL;
+    }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  while (pool->threads < threads)
+    {
+      if (pthread_create(&pool->thread[pool->threads], NULL,
+                         qlz_worker_main, pool) != 0)
         {
-          fast_write(( cword_val >> 1 ) | ( 1U << 31 ), cword_ptr, CWORD_LEN);
-          cword_ptr   = dst;
-          dst        += CWORD_LEN;
-          cword_val   = 1U << 31;
+          break;
         }
 
-#if QLZ_COMPRESSION_LEVEL < 3
-        if (src <= last_byte - 3)
-          {
-# if QLZ_COMPRESSION_LEVEL == 1
-              ui32 hash, fetch;
-              fetch                     = fast_read(src, 3);
-              hash                      = hash_func(fetch);
-              state->hash[hash].offset  = CAST(src - OFFSET_BASE);
-              state->hash[hash].cache   = fetch;
-# elif QLZ_COMPRESSION_LEVEL == 2
-              ui32           hash;
-              unsigned char  c;
-              hash = hashat(src);
-              c = state->hash_counter[hash];
-              state->hash[hash].offset[c & ( QLZ_POINTERS - 1 )] = src;
-              c++;
-              state->hash_counter[hash] = c;
-# endif /* if QLZ_COMPRESSION_LEVEL == 1 */
-          }
-#endif /* if QLZ_COMPRESSION_LEVEL < 3 */
-      *dst = *src;
-      src++;
-      dst++;
-      cword_val = ( cword_val >> 1 );
+      pool->threads++;
     }
 
-  while (( cword_val & 1 ) != 1)
+  if (pool->threads == 0)
     {
-      cword_val = ( cword_val >> 1 );
+      qlz_pool_free(pool);
+      return NULL;
     }
 
-  fast_write(( cword_val >> 1 ) | ( 1U << 31 ), cword_ptr, CWORD_LEN);
+  return pool;
+}
 
-  /*
-   * Minimum size must be 9 bytes so that the qlz_size
-   * functions can take 9 bytes as argument.
-   */
+/* Finish the queued jobs and stop the workers */
+void
+qlz_pool_free(qlz_pool *pool)
+{
+  int i;
 
-  return dst - destination < 9 ? 9 : dst - destination;
+  if (pool == NULL)
+    {
+      return;
+    }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->threads; i++)
+    {
+      pthread_join(pool->thread[i], NULL);
+    }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->thread);
+  free(pool);
 }
 
-static size_t
-qlz_decompress_core(const unsigned char *source, unsigned char *destination,
-                    size_t size, qlz_state_decompress *state,
-                    const unsigned char *history)
+static void
+qlz_pool_push(qlz_pool *pool, qlz_job *job)
 {
-  const unsigned char * src
-      = source + qlz_size_header((const char *)source);
-  unsigned char *       dst
-      = destination;
-  const unsigned char * last_destination_byte
-      = destination + size - 1;
-  ui32                  cword_val
-      = 1;
-  const unsigned char * last_matchstart
-      = last_destination_byte
-        - UNCONDITIONAL_MATCHLEN_DECOMPRESSOR
-        - UNCOMPRESSED_END;
-  unsigned char *       last_hashed
-      = destination - 1;
-  const unsigned char * last_source_byte
-     = source + qlz_size_compressed((const char *)source) - 1;
-  static const ui32     bitlut[16]
-     = { 4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0 };
+  job->pool  = pool;
+  job->next  = NULL;
+  job->done  = 0;
 
-  (void)last_source_byte;
-  (void)last_hashed;
-  (void)state;
-  (void)history;
-
-  for (;;)
+  pthread_mutex_lock(&pool->lock);
+  if (pool->tail == NULL)
     {
-      ui32 fetch;
+      pool->head = job;
+    }
+  else
+    {
+      pool->tail->next = job;
+    }
 
-      if (cword_val == 1)
-        {
-#ifdef QLZ_MEMORY_SAFE
-            if (src + CWORD_LEN - 1 > last_source_byte)
-              {
-                return 0;
-              }
-#endif /* ifdef QLZ_MEMORY_SAFE */
-          cword_val   = fast_read(src, CWORD_LEN);
-          src        += CWORD_LEN;
-        }
+  pool->tail = job;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
 
-#ifdef QLZ_MEMORY_SAFE
-        if (src + 4 - 1 > last_source_byte)
-          {
-            return 0;
-          }
-#endif /* ifdef QLZ_MEMORY_SAFE */
+static void
+qlz_pool_wait(qlz_job *job)
+{
+  qlz_pool *pool = job->pool;
 
-      fetch = fast_read(src, 4);
+  pthread_mutex_lock(&pool->lock);
+  while (!job->done)
+    {
+      pthread_cond_wait(&pool->done, &pool->lock);
+    }
 
-      if (( cword_val & 1 ) == 1)
-        {
-          ui32                  matchlen;
-          const unsigned char * offset2;
+  pthread_mutex_unlock(&pool->lock);
+}
 
-#if QLZ_COMPRESSION_LEVEL == 1
-            ui32 hash;
-            cword_val
-                = cword_val >> 1;
-            hash
-                = ( fetch >> 4 ) & 0xfff;
-            offset2
-                = (const unsigned char *)(size_t)state->hash[hash].offset;
+/*
+ * Compress size bytes of source as independent packets of block_size
+ * bytes (QLZ_PARALLEL_BLOCK if 0) on the pool. Each block is first
+ * compressed into its own slot of destination and then moved down
+ * behind the previous one. Returns the total size, or 0 on failure.
+ */
 
-            if (( fetch & 0xf ) != 0)
-              {
-                matchlen   = ( fetch & 0xf ) + 2;
-                src       += 2;
-              }
-            else
-              {
-                matchlen   = *( src + 2 );
-                src       += 3;
-              }
+size_t
+qlz_compress_parallel(qlz_pool *pool, int level, const void *source,
+                      char *destination, size_t size, size_t block_size)
+{
+  qlz_job * jobs;
+  size_t    blocks, i, r = 0, failed = 0;
 
-#elif QLZ_COMPRESSION_LEVEL == 2
-            ui32           hash;
-            unsigned char  c;
-            cword_val  = cword_val >> 1;
-            hash       = ( fetch >> 5 ) & 0x7ff;
-            c          = (unsigned char)( fetch & 0x3 );
-            offset2    = state->hash[hash].offset[c];
+  if (block_size == 0)
+    {
+      block_size = QLZ_PARALLEL_BLOCK;
+    }
 
-            if (( fetch & ( 28 )) != 0)
-              {
-                matchlen   = (( fetch >> 2 ) & 0x7 ) + 2;
-                src       += 2;
-              }
-            else
-              {
-                matchlen   = *( src + 2 );
-                src       += 3;
-              }
+  if (size == 0 || block_size > 0xffffffff - 400)
+    {
+      return 0;
+    }
 
-#elif QLZ_COMPRESSION_LEVEL == 3
-            ui32 offset;
-            cword_val = cword_val >> 1;
-            if (( fetch & 3 ) == 0)
-              {
-                offset    = ( fetch & 0xff ) >> 2;
-                matchlen  = 3;
-                src++;
-              }
-            else if (( fetch & 2 ) == 0)
-              {
-                offset     = ( fetch & 0xffff ) >> 2;
-                matchlen   = 3;
-                src       += 2;
-              }
-            else if (( fetch & 1 ) == 0)
-              {
-                offset     = (  fetch & 0xffff ) >> 6;
-                matchlen   = (( fetch >> 2 ) & 15 ) + 3;
-                src       += 2;
-              }
-            else if (( fetch & 127 ) != 3)
-              {
-                offset     = (  fetch >> 7 ) & 0x1ffff;
-                matchlen   = (( fetch >> 2 ) & 0x1f ) + 2;
-                src       += 3;
-              }
-            else
-              {
-                offset     = (  fetch >> 15 );
-                matchlen   = (( fetch >> 7 ) & 255 ) + 3;
-                src       += 4;
-              }
+  blocks  = ( size - 1 ) / block_size + 1;
+  jobs    = (qlz_job *)malloc(blocks * sizeof ( qlz_job ));
+  if (jobs == NULL)
+    {
+      return 0;
+    }
 
-            offset2 = dst - offset;
-#endif /* if QLZ_COMPRESSION_LEVEL == 1 */
+  for (i = 0; i < blocks; i++)
+    {
+      jobs[i].kind         = QLZ_JOB_COMPRESS;
+      jobs[i].level        = level;
+      jobs[i].source       = (const char *)source + i * block_size;
+      jobs[i].destination  = destination
+                             + i * QLZ_COMPRESS_BOUND(block_size);
+      jobs[i].size         = i + 1 < blocks ? block_size
+                                            : size - i * block_size;
+      qlz_pool_push(pool, &jobs[i]);
+    }
 
-#ifdef QLZ_MEMORY_SAFE
-            if (offset2 < history || offset2 > dst - MINOFFSET - 1)
-              {
-                return 0;
-              }
+  for (i = 0; i < blocks; i++)
+    {
+      qlz_pool_wait(&jobs[i]);
+      if (jobs[i].result == 0)
+        {
+          failed = 1;
+        }
+      else if (!failed)
+        {
+          memmove(destination + r, jobs[i].destination, jobs[i].result);
+          r += jobs[i].result;
+        }
+    }
+
+  free(jobs);
+  return failed ? 0 : r;
+}
+
+/*
+ * Decompress the size bytes of packets at source, which must not be
+ * streamed, into destination of destination_size bytes. The packets are
+ * decompressed on the pool. Returns the total decompressed size, or 0 on
+ * failure, before anything is written if the packets are cut short or
+ * hold more than destination_size bytes.
+ */
 
-            if (matchlen
-                > (ui32)( last_destination_byte - dst - UNCOMPRESSED_END + 1 ))
-              {
-                return 0;
-              }
-#endif /* ifdef QLZ_MEMORY_SAFE */
+size_t
+qlz_decompress_parallel(qlz_pool *pool, const char *source, size_t size,
+                        void *destination, size_t destination_size)
+{
+  qlz_job * jobs;
+  size_t    blocks, i, c, d, r, failed = 0;
 
-          memcpy_up(dst, offset2, matchlen);
-          dst += matchlen;
+  for (blocks = 0, c = 0, d = 0; c < size; blocks++)
+    {
+      if (size - c < 9 && ( size - c < 3 || ( source[c] & 2 ) != 0 ))
+        {
+          return 0;
+        }
 
-#if QLZ_COMPRESSION_LEVEL <= 2
-            update_hash_upto(state, &last_hashed, dst - matchlen);
-            last_hashed = dst - 1;
-#endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
+      /* Streamed packets depend on the ones before them */
+      if (qlz_size_compressed(source + c) > size - c
+          || qlz_size_compressed(source + c) < qlz_size_header(source + c)
+          || ( source[c] & 0x30 ) != 0)
+        {
+          return 0;
         }
-      else
+
+      if (qlz_size_decompressed(source + c) > destination_size - d)
         {
-          if (dst < last_matchstart)
-            {
-              unsigned int n = bitlut[cword_val & 0xf];
-#ifdef X86X64
-                *(ui32 *)dst = *(ui32 *)src;
-#else  /* ifdef X86X64 */
-                memcpy_up(dst, src, 4);
-#endif /* ifdef X86X64 */
-              cword_val   = cword_val >> n;
-              dst        += n;
-              src        += n;
-#if QLZ_COMPRESSION_LEVEL <= 2
-                update_hash_upto(state, &last_hashed, dst - 3);
-#endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
-            }
-          else
-            {
-              while (dst <= last_destination_byte)
-                {
-                  if (cword_val == 1)
-                    {
-                      src        += CWORD_LEN;
-                      cword_val   = 1U << 31;
-                    }
+          return 0;
+        }
 
-#ifdef QLZ_MEMORY_SAFE
-                    if (src >= last_source_byte + 1)
-                      {
-                        return 0;
-                      }
-#endif /* ifdef QLZ_MEMORY_SAFE */
-                  *dst = *src;
-                  dst++;
-                  src++;
-                  cword_val = cword_val >> 1;
-                }
+      d += qlz_size_decompressed(source + c);
+      c += qlz_size_compressed(source + c);
+    }
 
-#if QLZ_COMPRESSION_LEVEL <= 2
-                update_hash_upto(
-                  state,
-                  &last_hashed,
-                  last_destination_byte
-                    - 3); /* TODO: Use constant */
-#endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
-              return size;
-            }
+  if (blocks == 0)
+    {
+      return 0;
+    }
+
+  jobs = (qlz_job *)malloc(blocks * sizeof ( qlz_job ));
+  if (jobs == NULL)
+    {
+      return 0;
+    }
+
+  for (i = 0, c = 0, d = 0; i < blocks; i++)
+    {
+      jobs[i].kind         = QLZ_JOB_DECOMPRESS;
+      jobs[i].level        = 0;
+      jobs[i].source       = source + c;
+      jobs[i].destination  = (char *)destination + d;
+      jobs[i].size         = qlz_size_decompressed(source + c);
+      c                   += qlz_size_compressed(source + c);
+      d                   += jobs[i].size;
+      qlz_pool_push(pool, &jobs[i]);
+    }
+
+  for (i = 0, r = 0; i < blocks; i++)
+    {
+      qlz_pool_wait(&jobs[i]);
+      if (jobs[i].result != jobs[i].size)
+        {
+          failed = 1;
         }
+
+      r += jobs[i].result;
     }
+
+  free(jobs);
+  return failed ? 0 : r;
 }
 
+# if QLZ_COMPRESSION_LEVEL == 0
+
+/*
+ * Compress size bytes of source as blocks of block_size bytes (a
+ * quarter of the streaming buffer if 0) that continue the stream of
+ * state, as if qlz_compress() had been called for each block.
+ *
+ * Blocks of a level 3 stream are all compressed on the pool, and the
+ * state is left with the history the decompressor will have and an
+ * empty hash table. Levels 1 and 2 name their matches by hash slot,
+ * so only the blocks that qlz_compress_skip() accepts go to the pool
+ * and the others are compressed in turn by the calling thread.
+ */
+
 size_t
-qlz_compress(const void *source, char *destination, size_t size,
-             qlz_state_compress *state)
+qlz_compress_stream_parallel(qlz_pool *pool, qlz_state_compress *state,
+                             const void *source, char *destination,
+                             size_t size, size_t block_size)
 {
-  size_t  r;
-  ui32    compressed;
-  size_t  base;
+  const char *                  src   = (const char *)source;
+  qlz_state_compress_3s *       l3s   = &state->u.l3s;
+  size_t                        end   = state->streaming_buffer;
+  size_t                        window, counter, start, base, blocks;
+  size_t                        keep, primed, i, n, r = 0, failed = 0;
+  qlz_job *                     jobs;
 
-  if (size == 0 || size > 0xffffffff - 400)
+  if (end == 0)
     {
-      return 0;
+      return qlz_compress_parallel(pool, state->level, source, destination,
+                                   size, block_size);
     }
 
-  if (size < 216)
+  if (block_size == 0)
     {
-      base = 3;
+      block_size = end / 4 > 0 ? end / 4 : 1;
     }
-  else
+
+  if (size == 0 || block_size > 0xffffffff - 400)
     {
-      base = 9;
+      return 0;
     }
 
-#if QLZ_STREAMING_BUFFER > 0
-    if (state->stream_counter + size - 1 >= QLZ_STREAMING_BUFFER)
-#endif /* if QLZ_STREAMING_BUFFER > 0 */
-  {
-    reset_table_compress(state);
-    r = base
-        + qlz_compress_core(
-      (const unsigned char *)source,
-      (unsigned char *)destination + base,
-      size,
-      state);
-#if QLZ_STREAMING_BUFFER > 0
-      reset_table_compress(state);
-#endif /* if QLZ_STREAMING_BUFFER > 0 */
-    if (r == base)
-      {
-        memcpy(destination + base, source, size);
-        r           = size + base;
-        compressed  = 0;
-      }
-    else
-      {
-        compressed = 1;
-      }
+  blocks  = ( size - 1 ) / block_size + 1;
+  jobs    = (qlz_job *)malloc(blocks * sizeof ( qlz_job ));
+  if (jobs == NULL)
+    {
+      return 0;
+    }
 
-    state->stream_counter = 0;
-  }
+  /*
+   * For level 3, positions count from the start of the history of the
+   * state, which is followed by source. The history of the
+   * decompressor starts at base and holds counter bytes; it moves as
+   * qlz_compress() would move it, which depends only on the sizes of
+   * the blocks.
+   */
 
-#if QLZ_STREAMING_BUFFER > 0
-    else
-      {
-        unsigned char *src = state->stream_buffer + state->stream_counter;
+  window   = state->stream_window;
+  counter  = state->level == 3 ? l3s->stream_counter : 0;
+  start    = counter;
+  base     = 0;
+  for (i = 0; i < blocks; i++)
+    {
+      n = i + 1 < blocks ? block_size : size - i * block_size;
 
-        memcpy(src, source, size);
-        r = base
-            + qlz_compress_core(
-          src,
-          (unsigned char *)destination + base,
-          size,
-          state);
+      jobs[i].kind           = QLZ_JOB_STREAM;
+      jobs[i].level          = state->level;
+      jobs[i].source         = src + i * block_size;
+      jobs[i].destination    = destination
+                               + i * QLZ_COMPRESS_BOUND(block_size);
+      jobs[i].size           = n;
+      jobs[i].stream         = state;
+      jobs[i].history        = 0;
+      jobs[i].prime[0]       = jobs[i].source;
+      jobs[i].prime_size[0]  = 0;
+      jobs[i].prime_size[1]  = 0;
 
-        if (r == base)
-          {
-            memcpy(destination + base, src, size);
-            r           = size + base;
-            compressed  = 0;
-            reset_table_compress(state);
-          }
-        else
-          {
-            compressed = 1;
-          }
+      if (state->level != 3)
+        {
+          if (qlz_compress_skip(n, state))
+            {
+              qlz_pool_push(pool, &jobs[i]);
+            }
+          else
+            {
+              jobs[i].pool    = pool;
+              jobs[i].result  = qlz_compress(jobs[i].source,
+                                             jobs[i].destination, n, state);
+              jobs[i].done    = 1;
+            }
 
-        state->stream_counter += size;
-      }
-#endif /* if QLZ_STREAMING_BUFFER > 0 */
-  if (base == 3)
+          continue;
+        }
+
+      jobs[i].history = counter;
+      if (counter + n - 1 >= end)
+        {
+          keep = counter < window ? counter : window;
+          if (keep > 0 && keep + n - 1 < end)
+            {
+              base     += counter - keep;
+              counter   = keep;
+            }
+        }
+
+      if (counter + n - 1 >= end)
+        {
+          counter          = 0;
+          base             = start + n;
+          jobs[i].history  = 0;
+        }
+      else
+        {
+          /* The slide keeps at most window bytes of the primed ones */
+          primed = window > QLZ_PRIME_SIZE ? window : QLZ_PRIME_SIZE;
+          primed = jobs[i].history < primed ? jobs[i].history : primed;
+          if (start - primed < l3s->stream_counter)
+            {
+              jobs[i].prime[0]       = (const char *)state->stream_buffer
+                                       + start - primed;
+              jobs[i].prime_size[0]  = l3s->stream_counter
+                                       - ( start - primed );
+              if (jobs[i].prime_size[0] > primed)
+                {
+                  jobs[i].prime_size[0] = primed;
+                }
+            }
+
+          jobs[i].prime[1]       = src + start - l3s->stream_counter
+                                   - ( primed - jobs[i].prime_size[0] );
+          jobs[i].prime_size[1]  = primed - jobs[i].prime_size[0];
+          counter               += n;
+        }
+
+      start += n;
+      qlz_pool_push(pool, &jobs[i]);
+    }
+
+  for (i = 0; i < blocks; i++)
     {
-      *destination          = (unsigned char)( 0 | compressed );
-      *( destination + 1 )  = (unsigned char)r;
-      *( destination + 2 )  = (unsigned char)size;
+      qlz_pool_wait(&jobs[i]);
+      if (jobs[i].result == 0)
+        {
+          failed = 1;
+        }
+      else if (!failed)
+        {
+          memmove(destination + r, jobs[i].destination, jobs[i].result);
+          r += jobs[i].result;
+        }
     }
-  else
+
+  free(jobs);
+
+  /* Leave the history of the decompressor in a level 3 state */
+  if (state->level == 3)
     {
-      *destination = (unsigned char)( 2 | compressed );
-      fast_write((ui32)r, destination + 1, 4);
-      fast_write((ui32)size, destination + 5, 4);
+      n = 0;
+      if (base < l3s->stream_counter)
+        {
+          n = l3s->stream_counter - base;
+          memmove(state->stream_buffer, state->stream_buffer + base, n);
+          base = l3s->stream_counter;
+        }
+
+      memcpy(state->stream_buffer + n, src + base - l3s->stream_counter,
+             counter - n);
+      l3s->stream_counter = counter;
+      memset(l3s->hash_counter, 0, sizeof ( l3s->hash_counter ));
     }
 
-  *destination  |= ( QLZ_COMPRESSION_LEVEL << 2 );
-  *destination  |= ( 1 << 6 );
-  *destination  |= (( QLZ_STREAMING_BUFFER == 0
-                        ? 0
-                        : ( QLZ_STREAMING_BUFFER == 100000
-                               ? 1
-                               : ( QLZ_STREAMING_BUFFER == 1000000 ? 2 : 3 )))
-                   << 4 );
+  return failed ? 0 : r;
+}
 
-  /*
-   * 76543210
-   * 01SSLLHC
-   */
+/*
+ * Queue the compression of a block in the stream of state, which must
+ * not depend on the history, as after qlz_compress_skip() returned 1.
+ * Only the settings of state are read, so it may go on compressing.
+ */
 
-  return r;
+qlz_job *
+qlz_pool_submit_compress_stream(qlz_pool *pool,
+                                const qlz_state_compress *state,
+                                const void *source, char *destination,
+                                size_t size)
+{
+  qlz_job *job = (qlz_job *)malloc(sizeof ( qlz_job ));
+
+  if (job == NULL)
+    {
+      return NULL;
+    }
+
+  job->kind           = QLZ_JOB_STREAM;
+  job->level          = state->level;
+  job->source         = (const char *)source;
+  job->destination    = destination;
+  job->size           = size;
+  job->stream         = state;
+  job->history        = 0;
+  job->prime[0]       = job->source;
+  job->prime_size[0]  = 0;
+  job->prime_size[1]  = 0;
+  qlz_pool_push(pool, job);
+  return job;
 }
 
-size_t
-qlz_decompress(const char *source, void *destination,
-               qlz_state_decompress *state)
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+
+/* Queue one qlz_compress() on the pool */
+qlz_job *
+qlz_pool_submit_compress(qlz_pool *pool, int level, const void *source,
+                         char *destination, size_t size)
 {
-  size_t  dsiz  = qlz_size_decompressed(source);
-  size_t  csiz  = qlz_size_compressed(source);
+  qlz_job *job = (qlz_job *)malloc(sizeof ( qlz_job ));
 
-#if QLZ_STREAMING_BUFFER > 0
-    if (state->stream_counter + qlz_size_decompressed(source) - 1
-        >= QLZ_STREAMING_BUFFER)
-#endif /* if QLZ_STREAMING_BUFFER > 0 */
-  {
-    if (( *source & 1 ) == 1)
-      {
-        reset_table_decompress(state);
-        dsiz = qlz_decompress_core(
-          (const unsigned char *)source,
-          (unsigned char *)destination,
-          dsiz,
-          state,
-          (const unsigned char *)destination);
-      }
-    else
-      {
-        if (csiz != dsiz + qlz_size_header(source))
-          {
-            return 0;
-          }
+  if (job == NULL)
+    {
+      return NULL;
+    }
 
-        memcpy(destination, source + qlz_size_header(source), dsiz);
-      }
+  job->kind         = QLZ_JOB_COMPRESS;
+  job->level        = level;
+  job->source       = (const char *)source;
+  job->destination  = destination;
+  job->size         = size;
+  qlz_pool_push(pool, job);
+  return job;
+}
 
-    state->stream_counter = 0;
-    reset_table_decompress(state);
-  }
+/*
+ * Queue one qlz_decompress() of a packet that does not depend on the
+ * history, such as one that qlz_decompress_skip() accepted.
+ */
+qlz_job *
+qlz_pool_submit_decompress(qlz_pool *pool, const char *source,
+                           void *destination)
+{
+  qlz_job *job = (qlz_job *)malloc(sizeof ( qlz_job ));
 
-#if QLZ_STREAMING_BUFFER > 0
-    else
-      {
-        unsigned char *dst = state->stream_buffer + state->stream_counter;
-        if (( *source & 1 ) == 1)
-          {
-            dsiz = qlz_decompress_core(
-              (const unsigned char *)source,
-              dst,
-              dsiz,
-              state,
-              (const unsigned char *)state->stream_buffer);
-          }
-        else
-          {
+  if (job == NULL)
+    {
+      return NULL;
+    }
 
-           /*
-            * if(csiz != dsiz + qlz_size_header(source))
-            *     return 0;
-            */
+  job->kind         = QLZ_JOB_DECOMPRESS;
+  job->level        = 0;
+  job->source       = source;
+  job->destination  = (char *)destination;
+  job->size         = 0;
+  qlz_pool_push(pool, job);
+  return job;
+}
 
-            memcpy(dst, source + qlz_size_header(source), dsiz);
-            reset_table_decompress(state);
-          }
+/* Wait for a submitted job and free it */
+size_t
+qlz_job_wait(qlz_job *job)
+{
+  size_t r;
 
-        memcpy(destination, dst, dsiz);
-        state->stream_counter += dsiz;
-      }
-#endif /* if QLZ_STREAMING_BUFFER > 0 */
-  return dsiz;
+  qlz_pool_wait(job);
+  r = job->result;
+  free(job);
+  return r;
 }
+
+#endif /* ifdef QLZ_THREADS */
+
+#endif /* ifndef QLZ_INSTANCE */
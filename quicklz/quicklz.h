@@ -17,9 +17,13 @@
  */
 
 /*
- * You can edit following user settings. Data must be decompressed with the
- * same setting of QLZ_COMPRESSION_LEVEL and QLZ_STREAMING_BUFFER as it was
- * compressed (see manual).
+ * You can edit following user settings. With QLZ_COMPRESSION_LEVEL 1, 2 or
+ * 3, data must be decompressed with the same setting of
+ * QLZ_COMPRESSION_LEVEL and QLZ_STREAMING_BUFFER as it was compressed (see
+ * manual). QLZ_COMPRESSION_LEVEL 0 builds all three levels into the same
+ * library instead: the level and the streaming buffer size are given at
+ * runtime to qlz_state_compress_new(), and qlz_decompress() follows the
+ * level and streaming bits found in the header of each packet.
  */
 
 /* QuickLZ 1.5.1 BETA 7 */
@@ -28,6 +32,7 @@
 #  define QLZ_COMPRESSION_LEVEL 3
 /* #  define QLZ_COMPRESSION_LEVEL 2 */
 /* #  define QLZ_COMPRESSION_LEVEL 1 */
+/* #  define QLZ_COMPRESSION_LEVEL 0 */
 # endif
 
 # ifndef QLZ_STREAMING_BUFFER
@@ -36,6 +41,22 @@
 /* #  define QLZ_STREAMING_BUFFER 1000000 */
 # endif
 
+/*
+ * Define QLZ_THREADS to build the thread pool and the parallel functions
+ * below, which need POSIX threads and either QLZ_COMPRESSION_LEVEL 0 or
+ * no streaming buffer.
+ */
+
+/* # define QLZ_THREADS */
+
+/*
+ * Define QLZ_TOKEN_TABLE to decode level 3 matches with a table of the
+ * shapes of their tokens instead of a chain of tests. It reads the same
+ * packets, and was not faster on mixed data.
+ */
+
+/* # define QLZ_TOKEN_TABLE */
+
 /* Default to memory safety */
 # ifdef QLZ_MEMORY_SAFE
 #  undef QLZ_MEMORY_SAFE
@@ -46,19 +67,184 @@
 # define QLZ_VERSION_MINOR      5
 # define QLZ_VERSION_REVISION   1
 
+/* Largest packet written by qlz_stream_header_write() */
+# define QLZ_STREAM_HEADER_SIZE 13
+
+/* Largest message accepted by qlz_compress_small() */
+# define QLZ_SMALL_MAX          65536
+
+/* Largest message qlz_compressv() gathers on the stack without streaming */
+# define QLZ_GATHER_STACK       4096
+
+/* Largest dictionary built by qlz_train_dict(), the reach of level 3 */
+# define QLZ_DICT_MAX           131072
+
+/*
+ * Bytes of destination that qlz_compress() and the other compressors
+ * may write for a message of size bytes, at any level and streaming or
+ * not. A message that would grow is stored, except below 400 bytes where
+ * it can grow by up to the control words of the literals. The bound
+ * never decreases with size.
+ */
+# define QLZ_COMPRESS_BOUND(size)                                 \
+  ( ( size ) < 5 ? 13                                             \
+    : ( size ) + (( size ) < 216 ? 4 : 10 )                       \
+      + (( size ) < 155 ? 4 * (( size ) / 31 ) + 4                \
+         : ( size ) < 376 ? 24 : ( size ) < 400 ? 400 - ( size ) : 0 ))
+
 /* Using size_t, memset() and memcpy() */
 # include <string.h>
 
+/*
+ * qlz_compressv() takes the struct iovec of <sys/uio.h>, where there is
+ * one. Callers include <sys/uio.h> themselves to fill it in.
+ */
+# if !defined _WIN32
+#  define QLZ_IOVEC
+struct iovec;
+# endif /* if !defined _WIN32 */
+
 /* Verify compression level */
-# if QLZ_COMPRESSION_LEVEL  != 1 \
+# if QLZ_COMPRESSION_LEVEL  != 0 \
+   && QLZ_COMPRESSION_LEVEL != 1 \
    && QLZ_COMPRESSION_LEVEL != 2 \
    && QLZ_COMPRESSION_LEVEL != 3
-#  error QLZ_COMPRESSION_LEVEL must be one of 1, 2, 3
+#  error QLZ_COMPRESSION_LEVEL must be one of 0, 1, 2, 3
 # endif
 
 typedef unsigned int ui32;
 typedef unsigned short int ui16;
 
+/*
+ * Detect if pointer size is 64-bit. It's not fatal if some
+ * 64-bit target is not detected because this is only for
+ * adding an optional 64-bit optimization.
+ */
+
+# if defined _LP64 || defined __LP64__ || defined __64BIT__ || _ADDR64 \
+  || defined _WIN64 || defined __arch64__ || __WORDSIZE == 64          \
+  || ( defined __sparc && defined __sparcv9 ) || defined __x86_64      \
+  || defined __amd64 || defined __x86_64__ || defined _M_X64           \
+  || defined _M_IA64 || defined __ia64 || defined __IA64__
+#  define QLZ_PTR_64
+# endif
+
+#endif /* ifndef QLZ_HEADER */
+
+/*
+ * Private names of the engine. quicklz.c (for level 0) and quicklz.hpp
+ * define QLZ_INSTANCE(name) while they include quicklz.c once for each
+ * level, and include quicklz.h again afterwards to drop the names.
+ */
+
+#if defined QLZ_INSTANCE && !defined QLZ_HEADER_NAMES
+# define QLZ_HEADER_NAMES
+# define qlz_hash_compress        QLZ_INSTANCE(qlz_hash_compress)
+# define qlz_hash_decompress      QLZ_INSTANCE(qlz_hash_decompress)
+# define qlz_state_compress       QLZ_INSTANCE(qlz_state_compress)
+# define qlz_state_decompress     QLZ_INSTANCE(qlz_state_decompress)
+# define qlz_compress             QLZ_INSTANCE(qlz_compress)
+# define qlz_compress_gather      QLZ_INSTANCE(qlz_compress_gather)
+# define qlz_compressv            QLZ_INSTANCE(qlz_compressv)
+# define qlz_decompress           QLZ_INSTANCE(qlz_decompress)
+# define qlz_decompress_to        QLZ_INSTANCE(qlz_decompress_to)
+# define qlz_decompress_head      QLZ_INSTANCE(qlz_decompress_head)
+# define qlz_decompress_append    QLZ_INSTANCE(qlz_decompress_append)
+# define fits_stream_decompress   QLZ_INSTANCE(fits_stream_decompress)
+# define qlz_decompress_partial   QLZ_INSTANCE(qlz_decompress_partial)
+# define qlz_compress_reserve     QLZ_INSTANCE(qlz_compress_reserve)
+# define qlz_decompress_view      QLZ_INSTANCE(qlz_decompress_view)
+# define qlz_decompress_batch     QLZ_INSTANCE(qlz_decompress_batch)
+# define qlz_compress_core        QLZ_INSTANCE(qlz_compress_core)
+# define qlz_decompress_core      QLZ_INSTANCE(qlz_decompress_core)
+# define qlz_compress_skip        QLZ_INSTANCE(qlz_compress_skip)
+# define qlz_decompress_skip      QLZ_INSTANCE(qlz_decompress_skip)
+# define qlz_state_compress_load_dict \
+                                  QLZ_INSTANCE(qlz_state_compress_load_dict)
+# define qlz_state_decompress_load_dict \
+                                  QLZ_INSTANCE(qlz_state_decompress_load_dict)
+# define qlz_state_compress_copy  QLZ_INSTANCE(qlz_state_compress_copy)
+# define qlz_state_decompress_copy \
+                                  QLZ_INSTANCE(qlz_state_decompress_copy)
+# define same                     QLZ_INSTANCE(same)
+# define reset_table_compress     QLZ_INSTANCE(reset_table_compress)
+# define reset_table_decompress   QLZ_INSTANCE(reset_table_decompress)
+# define slide_stream_compress    QLZ_INSTANCE(slide_stream_compress)
+# define slide_stream_decompress  QLZ_INSTANCE(slide_stream_decompress)
+# define prime_stream_compress    QLZ_INSTANCE(prime_stream_compress)
+# define hash_func                QLZ_INSTANCE(hash_func)
+# define hashat                   QLZ_INSTANCE(hashat)
+# define hash_tag                 QLZ_INSTANCE(hash_tag)
+# define insert_hash              QLZ_INSTANCE(insert_hash)
+# define update_hash              QLZ_INSTANCE(update_hash)
+# define update_hash_upto         QLZ_INSTANCE(update_hash_upto)
+# define match_length             QLZ_INSTANCE(match_length)
+# define match_candidates         QLZ_INSTANCE(match_candidates)
+# define write_match              QLZ_INSTANCE(write_match)
+# define write_header             QLZ_INSTANCE(write_header)
+# define qlz_compress_small       QLZ_INSTANCE(qlz_compress_small)
+# define qlz_compress_small_core  QLZ_INSTANCE(qlz_compress_small_core)
+# define qlz_compress_batch       QLZ_INSTANCE(qlz_compress_batch)
+#elif !defined QLZ_INSTANCE && defined QLZ_HEADER_NAMES
+# undef  QLZ_HEADER_NAMES
+# undef  qlz_hash_compress
+# undef  qlz_hash_decompress
+# undef  qlz_state_compress
+# undef  qlz_state_decompress
+# undef  qlz_compress
+# undef  qlz_compress_gather
+# undef  qlz_compressv
+# undef  qlz_decompress
+# undef  qlz_decompress_to
+# undef  qlz_decompress_head
+# undef  qlz_decompress_append
+# undef  fits_stream_decompress
+# undef  qlz_decompress_partial
+# undef  qlz_compress_reserve
+# undef  qlz_decompress_view
+# undef  qlz_decompress_batch
+# undef  qlz_compress_core
+# undef  qlz_decompress_core
+# undef  qlz_compress_skip
+# undef  qlz_decompress_skip
+# undef  qlz_state_compress_load_dict
+# undef  qlz_state_decompress_load_dict
+# undef  qlz_state_compress_copy
+# undef  qlz_state_decompress_copy
+# undef  same
+# undef  reset_table_compress
+# undef  reset_table_decompress
+# undef  slide_stream_compress
+# undef  slide_stream_decompress
+# undef  prime_stream_compress
+# undef  hash_func
+# undef  hashat
+# undef  hash_tag
+# undef  insert_hash
+# undef  update_hash
+# undef  update_hash_upto
+# undef  match_length
+# undef  match_candidates
+# undef  write_match
+# undef  write_header
+# undef  qlz_compress_small
+# undef  qlz_compress_small_core
+# undef  qlz_compress_batch
+#endif /* if defined QLZ_INSTANCE && !defined QLZ_HEADER_NAMES */
+
+/*
+ * Hash tables and states of one compression level. When
+ * QLZ_COMPRESSION_LEVEL is 0, quicklz.c includes this part
+ * once per level and streaming mode, under private names.
+ */
+
+#if QLZ_COMPRESSION_LEVEL != 0 && !defined QLZ_HEADER_STATE
+# define QLZ_HEADER_STATE
+
+# undef QLZ_POINTERS
+# undef QLZ_HASH_VALUES
+# undef QLZ_STREAMING
+
 /*
  * Decrease QLZ_POINTERS for level 3 to increase compression speed.
  * Do not touch any other values!
@@ -76,32 +262,41 @@ typedef unsigned short int ui16;
 # endif /* if QLZ_COMPRESSION_LEVEL == 1 */
 
 /*
- * Detect if pointer size is 64-bit. It's not fatal if some
- * 64-bit target is not detected because this is only for
- * adding an optional 64-bit optimization.
+ * QLZ_STREAMING_DYNAMIC replaces the fixed stream_buffer array
+ * by a pointer and a size that are set up at runtime.
  */
 
-# if defined _LP64 || defined __LP64__ || defined __64BIT__ || _ADDR64 \
-  || defined _WIN64 || defined __arch64__ || __WORDSIZE == 64          \
-  || ( defined __sparc && defined __sparcv9 ) || defined __x86_64      \
-  || defined __amd64 || defined __x86_64__ || defined _M_X64           \
-  || defined _M_IA64 || defined __ia64 || defined __IA64__
-#  define QLZ_PTR_64
+# if defined QLZ_STREAMING_DYNAMIC || QLZ_STREAMING_BUFFER > 0
+#  define QLZ_STREAMING         1
+# else
+#  define QLZ_STREAMING         0
 # endif
 
-/* Hash entry */
+/*
+ * Hash entry. Levels 2 and 3 keep 32-bit positions in the history
+ * and a tag of the three bytes found there, so that candidates are
+ * compared without reading the input. Level 3 hashes the low half of
+ * the bytes with the high half, which is all its tag has to hold.
+ * Level 1 keeps the three bytes, and the generation of the table they
+ * were entered in above them.
+ */
+
 typedef struct
 {
 # if QLZ_COMPRESSION_LEVEL == 1
     ui32 cache;
 #  if defined QLZ_PTR_64 \
-    && QLZ_STREAMING_BUFFER == 0
+    && QLZ_STREAMING == 0
       unsigned int offset;
-#  else  /* if defined QLZ_PTR_64 && QLZ_STREAMING_BUFFER == 0 */
+#  else  /* if defined QLZ_PTR_64 && QLZ_STREAMING == 0 */
       const unsigned char *offset;
-#  endif /* if defined QLZ_PTR_64 && QLZ_STREAMING_BUFFER == 0 */
+#  endif /* if defined QLZ_PTR_64 && QLZ_STREAMING == 0 */
+# elif QLZ_COMPRESSION_LEVEL == 2
+    ui32 cache[QLZ_POINTERS];
+    ui32 offset[QLZ_POINTERS];
 # else  /* if QLZ_COMPRESSION_LEVEL == 1 */
-    const unsigned char *offset[QLZ_POINTERS];
+    ui16 cache[QLZ_POINTERS];
+    ui32 offset[QLZ_POINTERS];
 # endif /* if QLZ_COMPRESSION_LEVEL == 1 */
 } qlz_hash_compress;
 
@@ -114,41 +309,103 @@ typedef struct
 # endif /* if QLZ_COMPRESSION_LEVEL == 1 */
 } qlz_hash_decompress;
 
-/* States */
+/*
+ * States. A reset of a level 1 compressor or a level 2 decompressor
+ * only steps its generation, which the latter keeps above the count
+ * of each bucket, and a bucket of another generation is empty.
+ */
 typedef struct
 {
-# if QLZ_STREAMING_BUFFER > 0
+# if defined QLZ_STREAMING_DYNAMIC
+    unsigned char *stream_buffer;
+    size_t stream_size;
+# elif QLZ_STREAMING_BUFFER > 0
     unsigned char stream_buffer[QLZ_STREAMING_BUFFER];
-# endif /* if QLZ_STREAMING_BUFFER > 0 */
+# endif /* if defined QLZ_STREAMING_DYNAMIC */
   size_t stream_counter;
+# if QLZ_STREAMING
+    size_t stream_window;
+# endif /* if QLZ_STREAMING */
+# if QLZ_COMPRESSION_LEVEL == 3
+    int acceleration;
+# endif /* if QLZ_COMPRESSION_LEVEL == 3 */
   qlz_hash_compress hash[QLZ_HASH_VALUES];
   unsigned char hash_counter[QLZ_HASH_VALUES];
+# if QLZ_COMPRESSION_LEVEL == 1
+    unsigned char generation;
+# endif /* if QLZ_COMPRESSION_LEVEL == 1 */
 } qlz_state_compress;
 
 # if QLZ_COMPRESSION_LEVEL == 1 \
   || QLZ_COMPRESSION_LEVEL == 2
   typedef struct
   {
-#  if QLZ_STREAMING_BUFFER > 0
+#  if defined QLZ_STREAMING_DYNAMIC
+      unsigned char *stream_buffer;
+      size_t stream_size;
+#  elif QLZ_STREAMING_BUFFER > 0
       unsigned char stream_buffer[QLZ_STREAMING_BUFFER];
-#  endif /* if QLZ_STREAMING_BUFFER > 0 */
+#  endif /* if defined QLZ_STREAMING_DYNAMIC */
     qlz_hash_decompress hash[QLZ_HASH_VALUES];
-    unsigned char hash_counter[QLZ_HASH_VALUES];
+    ui16 hash_counter[QLZ_HASH_VALUES];
+    unsigned char generation;
     size_t stream_counter;
+#  if QLZ_STREAMING
+      size_t stream_window;
+#  endif /* if QLZ_STREAMING */
   } qlz_state_decompress;
 # elif QLZ_COMPRESSION_LEVEL == 3
   typedef struct
   {
-#  if QLZ_STREAMING_BUFFER > 0
+#  if defined QLZ_STREAMING_DYNAMIC
+      unsigned char *stream_buffer;
+      size_t stream_size;
+#  elif QLZ_STREAMING_BUFFER > 0
       unsigned char stream_buffer[QLZ_STREAMING_BUFFER];
-#  endif /* if QLZ_STREAMING_BUFFER > 0 */
+#  endif /* if defined QLZ_STREAMING_DYNAMIC */
 #  if QLZ_COMPRESSION_LEVEL <= 2
       qlz_hash_decompress hash[QLZ_HASH_VALUES];
 #  endif /* if QLZ_COMPRESSION_LEVEL <= 2 */
     size_t stream_counter;
+#  if QLZ_STREAMING
+      size_t stream_window;
+#  endif /* if QLZ_STREAMING */
   } qlz_state_decompress;
 # endif /* if QLZ_COMPRESSION_LEVEL == 1 || QLZ_COMPRESSION_LEVEL == 2 */
 
+#endif /* if QLZ_COMPRESSION_LEVEL != 0 && !defined QLZ_HEADER_STATE */
+
+#ifndef QLZ_HEADER_API
+# define QLZ_HEADER_API
+
+/*
+ * With QLZ_COMPRESSION_LEVEL 0 the states are sized at runtime
+ * and must be created by qlz_state_compress_new() and
+ * qlz_state_decompress_new() instead of being zeroed by the caller.
+ */
+
+# if QLZ_COMPRESSION_LEVEL == 0
+  typedef struct qlz_state_compress   qlz_state_compress;
+  typedef struct qlz_state_decompress qlz_state_decompress;
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+
+/*
+ * A message of qlz_compress_batch(). destination must hold
+ * QLZ_COMPRESS_BOUND(size) bytes, and compressed is set to the size of
+ * the packet written there, or to 0 if size is 0 or larger than
+ * QLZ_SMALL_MAX. For qlz_decompress_batch(), source is a packet, and
+ * size is set to the size decompressed into destination, or to 0 if the
+ * packet is bad.
+ */
+
+typedef struct qlz_batch
+{
+  const void * source;
+  size_t       size;
+  char *       destination;
+  size_t       compressed;
+} qlz_batch;
+
 # if defined( __cplusplus )
   extern "C"
   {
@@ -163,8 +420,182 @@ size_t qlz_decompress(const char *source, void *destination,
                       qlz_state_decompress *state);
 int qlz_get_setting(int setting);
 
+/*
+ * qlz_decompress_partial() decompresses only the first max_out bytes of a
+ * message, for a look at its start. A packet that starts a new history, as
+ * every packet does without streaming, is decompressed no further than
+ * needed.
+ */
+size_t qlz_decompress_partial(const char *source, void *destination,
+                              size_t max_out, qlz_state_decompress *state);
+
+/*
+ * qlz_compressv() compresses a message held in several buffers, such as a
+ * chain of network buffers, as one packet, so that matches can span the
+ * buffers. In streaming mode they are gathered straight into the history,
+ * so that no copy is made beyond the one qlz_compress() makes. Otherwise
+ * buffers that are not one after the other in memory are gathered into a
+ * copy, on the stack up to QLZ_GATHER_STACK bytes and allocated for each
+ * call above that, so a caller that compresses larger messages this way
+ * often does better to gather them into a buffer of its own and call
+ * qlz_compress().
+ */
+# ifdef QLZ_IOVEC
+size_t qlz_compressv(const struct iovec *iov, int iovcnt, char *destination,
+                     qlz_state_compress *state);
+# endif /* ifdef QLZ_IOVEC */
+
+/*
+ * Streams with a buffer size other than 100000 or 1000000 can begin with
+ * the packet written by qlz_stream_header_write(), so that the
+ * decompressor learns the size, and the window, from
+ * qlz_stream_header_read().
+ */
+size_t qlz_stream_header_write(const qlz_state_compress *state,
+                               char *destination);
+size_t qlz_stream_header_read(const char *source,
+                              qlz_state_decompress *state);
+int qlz_compress_skip(size_t size, qlz_state_compress *state);
+int qlz_decompress_skip(const char *source, qlz_state_decompress *state);
+
+/*
+ * In streaming mode the history can be the buffer that the application
+ * reads messages into and reads them from. qlz_compress_reserve() returns
+ * where the next message goes in the history of a compressor; written
+ * there, by recv() for instance, it is compressed with no copy.
+ * qlz_decompress_view() decompresses a packet into the history and
+ * returns where the message is, valid until the next packet, instead of
+ * copying it to a destination.
+ */
+void *qlz_compress_reserve(size_t size, qlz_state_compress *state);
+size_t qlz_decompress_view(const char *source, const void **view,
+                           qlz_state_decompress *state);
+
+/*
+ * In streaming mode the history is dropped when the buffer is full. After
+ * qlz_state_compress_set_window() it keeps the last window bytes instead,
+ * so that the following packets can still refer to them. The decompressor
+ * must be given the same window, by qlz_state_decompress_set_window() or
+ * by reading the stream header, which includes the window.
+ */
+int qlz_state_compress_set_window(qlz_state_compress *state, size_t window);
+int qlz_state_decompress_set_window(qlz_state_decompress *state,
+                                    size_t window);
+
+/*
+ * Level 3 searches less, for more speed and less compression, as the
+ * acceleration grows from the default of 1. Any decompressor reads the
+ * result.
+ */
+int qlz_state_compress_set_acceleration(qlz_state_compress *state,
+                                        int acceleration);
+
+/*
+ * A streaming state can start from a preset dictionary, which the load
+ * functions put at the start of the history. Packets that follow it can
+ * refer to it until the buffer is full. The copy functions copy such a
+ * state, so that each message can be compressed, or decompressed, from
+ * the dictionary alone. qlz_train_dict() builds a dictionary from
+ * samples of the messages.
+ */
+int qlz_state_compress_load_dict(qlz_state_compress *state, const void *dict,
+                                 size_t size);
+int qlz_state_decompress_load_dict(qlz_state_decompress *state, int level,
+                                   size_t streaming_buffer, const void *dict,
+                                   size_t size);
+int qlz_state_compress_copy(qlz_state_compress *destination,
+                            const qlz_state_compress *source);
+int qlz_state_decompress_copy(qlz_state_decompress *destination,
+                              const qlz_state_decompress *source);
+size_t qlz_train_dict(void *dict, size_t capacity, const void *samples,
+                      const size_t *sizes, size_t count);
+
+/*
+ * qlz_compress_bound() is the size of destination that the compressors
+ * need for a message. A packet can be decompressed over itself: placed at
+ * the end of a buffer of qlz_size_decompressed() plus qlz_inplace_margin()
+ * bytes, it is decompressed to the start of the same buffer, with or
+ * without streaming.
+ */
+size_t qlz_compress_bound(size_t size);
+size_t qlz_inplace_margin(const char *source);
+
+/*
+ * qlz_decompress_batch() decompresses an array of packets in order.
+ * qlz_compress_small() compresses a message of up to QLZ_SMALL_MAX bytes
+ * into a level 3 packet without a state, using a small hash table on the
+ * stack, and the packets are read by qlz_decompress() as any other.
+ * qlz_compress_batch() writes the same packets for an array of messages,
+ * faster for many short ones, as it clears its hash table less often and
+ * fetches each message while compressing the one before it.
+ */
+size_t qlz_decompress_batch(qlz_batch *batch, size_t count,
+                            qlz_state_decompress *state);
+# if QLZ_COMPRESSION_LEVEL == 0 \
+  || ( QLZ_COMPRESSION_LEVEL == 3 && QLZ_STREAMING_BUFFER == 0 )
+size_t qlz_compress_small(const void *source, char *destination,
+                          size_t size);
+size_t qlz_compress_batch(qlz_batch *batch, size_t count);
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 || ... */
+
+# if QLZ_COMPRESSION_LEVEL == 0
+qlz_state_compress *qlz_state_compress_new(int level,
+                                           size_t streaming_buffer);
+void qlz_state_compress_free(qlz_state_compress *state);
+qlz_state_decompress *qlz_state_decompress_new(size_t streaming_buffer);
+void qlz_state_decompress_free(qlz_state_decompress *state);
+# endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+
+# ifdef QLZ_THREADS
+
+/*
+ * A pool of worker threads, each with its own states. Blocks compressed
+ * by the parallel functions are independent packets, written one after
+ * the other, so destination must hold QLZ_COMPRESS_BOUND(block_size)
+ * bytes for each block.
+ * Jobs may be submitted from many threads; qlz_job_wait() returns the
+ * result of qlz_compress() or qlz_decompress() and frees the job.
+ *
+ * qlz_compress_stream_parallel() continues the stream of a level 3 state
+ * in parallel. Each block is compressed with the history the decompressor
+ * will have when it reaches the block, so the output is decompressed one
+ * packet after the other as usual.
+ *
+ * A streamed packet that qlz_compress_skip() or qlz_decompress_skip()
+ * finds to start a new history can also be handed to the pool, by
+ * qlz_pool_submit_compress_stream() or qlz_pool_submit_decompress().
+ */
+
+typedef struct qlz_pool qlz_pool;
+typedef struct qlz_job  qlz_job;
+
+qlz_pool *qlz_pool_new(int threads);
+void qlz_pool_free(qlz_pool *pool);
+size_t qlz_compress_parallel(qlz_pool *pool, int level, const void *source,
+                             char *destination, size_t size,
+                             size_t block_size);
+size_t qlz_decompress_parallel(qlz_pool *pool, const char *source,
+                               size_t size, void *destination,
+                               size_t destination_size);
+qlz_job *qlz_pool_submit_compress(qlz_pool *pool, int level,
+                                  const void *source, char *destination,
+                                  size_t size);
+qlz_job *qlz_pool_submit_decompress(qlz_pool *pool, const char *source,
+                                    void *destination);
+size_t qlz_job_wait(qlz_job *job);
+#  if QLZ_COMPRESSION_LEVEL == 0
+size_t qlz_compress_stream_parallel(qlz_pool *pool, qlz_state_compress *state,
+                                    const void *source, char *destination,
+                                    size_t size, size_t block_size);
+qlz_job *qlz_pool_submit_compress_stream(qlz_pool *pool,
+                                         const qlz_state_compress *state,
+                                         const void *source,
+                                         char *destination, size_t size);
+#  endif /* if QLZ_COMPRESSION_LEVEL == 0 */
+# endif /* ifdef QLZ_THREADS */
+
 # if defined( __cplusplus )
   }
 # endif /* if defined( __cplusplus ) */
 
-#endif /* ifndef QLZ_HEADER */
+#endif /* ifndef QLZ_HEADER_API */
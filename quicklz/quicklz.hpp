@@ -0,0 +1,650 @@
+/* SPDX-License-Identifier: GPL-1.0-only OR GPL-2.0-only OR GPL-3.0-only */
+
+#ifndef QLZ_HEADER_HPP
+# define QLZ_HEADER_HPP
+
+/*
+ * QuickLZ - Fast data compression library
+ *
+ * Copyright (c) 2006-2011 Lasse Mikkel Reinhold <lar@quicklz.com>
+ * Copyright (c) 2023 Jeffrey H. Johnson <trnsz@pobox.com>
+ *
+ * QuickLZ can be used for free under the GPL 1, 2 or 3 license (where anything
+ * released into public must be open source) or under a commercial license if
+ * such has been acquired (see http://www.quicklz.com/order.html). The
+ * commercial license does not cover derived or ported versions created by
+ * third parties under GPL.
+ */
+
+/*
+ * Header-only C++ front end. Every level is compiled from quicklz.c
+ * into namespace qlz::detail as inline functions, so several levels
+ * can be used in one translation unit and each compressor<> and
+ * decompressor<> calls a copy of the engine specialized for its
+ * level. Nothing has to be linked.
+ *
+ *   qlz::compressor<3>            c;
+ *   qlz::decompressor<3>          d;
+ *   qlz::compressor<1, 1000000>   streaming;
+ *
+ * The streaming buffer size is a template argument so that both
+ * sides agree on it, but is kept in the state by the engine, as is
+ * the window set by window().
+ */
+
+# include <cstddef>
+# include <memory>
+# include <stdlib.h>
+# include <string.h>
+# if defined _MSC_VER
+#  include <intrin.h>
+# endif /* if defined _MSC_VER */
+# if defined __AVX2__
+#  include <immintrin.h>
+# elif defined __SSE2__ || defined _M_X64
+#  include <emmintrin.h>
+# endif /* if defined __AVX2__ */
+# if __cplusplus >= 202002L && defined __has_include
+#  if __has_include(<span>)
+#   include <span>
+#   define QLZ_HAVE_SPAN
+#  endif /* if __has_include(<span>) */
+# endif /* if __cplusplus >= 202002L && defined __has_include */
+
+# include "quicklz.h"
+# ifdef QLZ_IOVEC
+#  include <sys/uio.h>
+# endif /* ifdef QLZ_IOVEC */
+
+# pragma push_macro("QLZ_COMPRESSION_LEVEL")
+# pragma push_macro("QLZ_STREAMING_BUFFER")
+# pragma push_macro("QLZ_HEADER_STATE")
+# pragma push_macro("QLZ_POINTERS")
+# pragma push_macro("QLZ_HASH_VALUES")
+# pragma push_macro("QLZ_STREAMING")
+# pragma push_macro("QLZ_COMMON")
+# pragma push_macro("QLZ_API")
+
+# undef  QLZ_COMPRESSION_LEVEL
+# undef  QLZ_STREAMING_BUFFER
+# define QLZ_STREAMING_BUFFER     0
+# undef  QLZ_COMMON
+# undef  QLZ_API
+# define QLZ_API                  inline
+
+
+namespace qlz
+{
+namespace detail
+{
+/* The constants quicklz.h sets for each level, as it is included */
+template <int Level> struct level_constants;
+
+# define QLZ_COMPRESSION_LEVEL    1
+# define QLZ_INSTANCE(name)       name ## _1
+# undef  QLZ_HEADER_STATE
+# include "quicklz.c"
+# undef  QLZ_INSTANCE
+template <> struct level_constants<1>
+{
+  static constexpr int pointers     = QLZ_POINTERS;
+  static constexpr int hash_values  = QLZ_HASH_VALUES;
+};
+# define QLZ_STREAMING_DYNAMIC
+# define QLZ_INSTANCE(name)       name ## _1s
+# undef  QLZ_HEADER_STATE
+# include "quicklz.c"
+# undef  QLZ_INSTANCE
+# undef  QLZ_STREAMING_DYNAMIC
+
+# undef  QLZ_COMPRESSION_LEVEL
+# define QLZ_COMPRESSION_LEVEL    2
+# define QLZ_INSTANCE(name)       name ## _2
+# undef  QLZ_HEADER_STATE
+# include "quicklz.c"
+# undef  QLZ_INSTANCE
+template <> struct level_constants<2>
+{
+  static constexpr int pointers     = QLZ_POINTERS;
+  static constexpr int hash_values  = QLZ_HASH_VALUES;
+};
+# define QLZ_STREAMING_DYNAMIC
+# define QLZ_INSTANCE(name)       name ## _2s
+# undef  QLZ_HEADER_STATE
+# include "quicklz.c"
+# undef  QLZ_INSTANCE
+# undef  QLZ_STREAMING_DYNAMIC
+
+# undef  QLZ_COMPRESSION_LEVEL
+# define QLZ_COMPRESSION_LEVEL    3
+# define QLZ_INSTANCE(name)       name ## _3
+# undef  QLZ_HEADER_STATE
+# include "quicklz.c"
+# undef  QLZ_INSTANCE
+template <> struct level_constants<3>
+{
+  static constexpr int pointers     = QLZ_POINTERS;
+  static constexpr int hash_values  = QLZ_HASH_VALUES;
+};
+# define QLZ_STREAMING_DYNAMIC
+# define QLZ_INSTANCE(name)       name ## _3s
+# undef  QLZ_HEADER_STATE
+# include "quicklz.c"
+# undef  QLZ_INSTANCE
+# undef  QLZ_STREAMING_DYNAMIC
+} /* namespace detail */
+} /* namespace qlz */
+
+# include "quicklz.h"
+# undef  OFFSET_BASE
+# undef  CAST
+# undef  QLZ_STREAM_SIZE
+# undef  TAG_NONE
+
+# pragma pop_macro("QLZ_API")
+# pragma pop_macro("QLZ_COMMON")
+# pragma pop_macro("QLZ_STREAMING")
+# pragma pop_macro("QLZ_HASH_VALUES")
+# pragma pop_macro("QLZ_POINTERS")
+# pragma pop_macro("QLZ_HEADER_STATE")
+# pragma pop_macro("QLZ_STREAMING_BUFFER")
+# pragma pop_macro("QLZ_COMPRESSION_LEVEL")
+
+namespace qlz
+{
+
+/* Constants of a level, as the engine was built with them */
+template <int Level> struct traits : detail::level_constants<Level>
+{
+};
+
+/* Worst case size of compressing size bytes, as QLZ_COMPRESS_BOUND() */
+constexpr std::size_t
+bound(std::size_t size)
+{
+  return QLZ_COMPRESS_BOUND(size);
+}
+
+/*
+ * Compress at most 65536 bytes into a level 3 packet without a
+ * compressor. Returns 0 if size is 0 or too large.
+ */
+
+inline std::size_t
+compress_small(const void *source, std::size_t size, char *destination)
+{
+  return detail::qlz_compress_small_3(source, destination, size);
+}
+
+/*
+ * Compress each message of the batch as compress_small() does. Returns
+ * the total size of the packets.
+ */
+
+inline std::size_t
+compress_batch(qlz_batch *batch, std::size_t count)
+{
+  return detail::qlz_compress_batch_3(batch, count);
+}
+
+inline std::size_t
+size_compressed(const char *source)
+{
+  return detail::qlz_size_compressed(source);
+}
+
+inline std::size_t
+size_decompressed(const char *source)
+{
+  return detail::qlz_size_decompressed(source);
+}
+
+namespace detail
+{
+
+template <int Level, bool Streaming> struct engine;
+
+# ifdef QLZ_IOVEC
+#  define QLZ_ENGINE_IOVEC(suffix)                                        \
+    static std::size_t                                                  \
+    compressv(const struct iovec *iov, int iovcnt, char *destination,   \
+              state_compress *state)                                    \
+    {                                                                   \
+      return qlz_compressv_ ## suffix(iov, iovcnt, destination, state); \
+    }
+# else  /* ifdef QLZ_IOVEC */
+#  define QLZ_ENGINE_IOVEC(suffix)
+# endif /* ifdef QLZ_IOVEC */
+
+# define QLZ_ENGINE(level, streaming, suffix)                             \
+  template <> struct engine<level, streaming>                           \
+  {                                                                     \
+    typedef qlz_state_compress_ ## suffix   state_compress;             \
+    typedef qlz_state_decompress_ ## suffix state_decompress;           \
+                                                                        \
+    static std::size_t                                                  \
+    compress(const void *source, char *destination, std::size_t size,   \
+             state_compress *state)                                     \
+    {                                                                   \
+      return qlz_compress_ ## suffix(source, destination, size, state); \
+    }                                                                   \
+                                                                        \
+    QLZ_ENGINE_IOVEC(suffix)                                            \
+                                                                        \
+    static std::size_t                                                  \
+    decompress(const char *source, void *destination,                   \
+               state_decompress *state)                                 \
+    {                                                                   \
+      return qlz_decompress_ ## suffix(source, destination, state);     \
+    }                                                                   \
+                                                                        \
+    static std::size_t                                                  \
+    decompress_partial(const char *source, void *destination,           \
+                       std::size_t max_out, state_decompress *state)    \
+    {                                                                   \
+      return qlz_decompress_partial_ ## suffix(source, destination,     \
+                                               max_out, state);         \
+    }                                                                   \
+                                                                        \
+    static void *                                                       \
+    reserve(std::size_t size, state_compress *state)                    \
+    {                                                                   \
+      return qlz_compress_reserve_ ## suffix(size, state);              \
+    }                                                                   \
+                                                                        \
+    static std::size_t                                                  \
+    view(const char *source, const void **view,                         \
+         state_decompress *state)                                       \
+    {                                                                   \
+      return qlz_decompress_view_ ## suffix(source, view, state);       \
+    }                                                                   \
+                                                                        \
+    static std::size_t                                                  \
+    decompress_batch(qlz_batch *batch, std::size_t count,               \
+                     state_decompress *state)                           \
+    {                                                                   \
+      return qlz_decompress_batch_ ## suffix(batch, count, state);      \
+    }                                                                   \
+                                                                        \
+    static int                                                          \
+    load_dict(state_compress *state, const void *dict,                  \
+              std::size_t size)                                         \
+    {                                                                   \
+      return qlz_state_compress_load_dict_ ## suffix(state, dict,       \
+                                                     size);             \
+    }                                                                   \
+                                                                        \
+    static int                                                          \
+    load_dict(state_decompress *state, const void *dict,                \
+              std::size_t size, std::size_t streaming_buffer)           \
+    {                                                                   \
+      return qlz_state_decompress_load_dict_ ## suffix(                 \
+        state, level, streaming_buffer, dict, size);                    \
+    }                                                                   \
+                                                                        \
+    static void                                                         \
+    copy(state_compress *destination, const state_compress *source)     \
+    {                                                                   \
+      qlz_state_compress_copy_ ## suffix(destination, source);          \
+    }                                                                   \
+                                                                        \
+    static void                                                         \
+    copy(state_decompress *destination, const state_decompress *source) \
+    {                                                                   \
+      qlz_state_decompress_copy_ ## suffix(destination, source);        \
+    }                                                                   \
+  }
+
+QLZ_ENGINE(1, false, 1);
+QLZ_ENGINE(1, true, 1s);
+QLZ_ENGINE(2, false, 2);
+QLZ_ENGINE(2, true, 2s);
+QLZ_ENGINE(3, false, 3);
+QLZ_ENGINE(3, true, 3s);
+
+# undef QLZ_ENGINE
+# undef QLZ_ENGINE_IOVEC
+
+/*
+ * Owns a zeroed state and, in streaming mode, its history
+ * buffer. Move-only, like the std::unique_ptr members.
+ */
+
+template <typename State, typename Engine, std::size_t StreamBuffer>
+class state_holder
+{
+public:
+  state_holder()
+    : state_(new State()), buffer_(nullptr), window_(0)
+  {
+    attach(std::integral_constant<bool, ( StreamBuffer > 0 )>());
+  }
+
+  state_holder(state_holder &&) noexcept             = default;
+  state_holder &operator=(state_holder &&) noexcept  = default;
+  state_holder(const state_holder &)                 = delete;
+  state_holder &operator=(const state_holder &)      = delete;
+
+  State *
+  get() const
+  {
+    return state_.get();
+  }
+
+  /* Keep window bytes of history when the buffer is full */
+  void
+  window(std::size_t n)
+  {
+    window_ = n;
+    attach(std::integral_constant<bool, ( StreamBuffer > 0 )>());
+  }
+
+  /* Copy the state and the window of other, which has the same type */
+  void
+  assign(const state_holder &other)
+  {
+    window_ = other.window_;
+    Engine::copy(state_.get(), other.state_.get());
+  }
+
+  /* Forget the history, as after zeroing a new state */
+  void
+  reset()
+  {
+    *state_ = State();
+    attach(std::integral_constant<bool, ( StreamBuffer > 0 )>());
+  }
+
+private:
+  void
+  attach(std::false_type)
+  {
+  }
+
+  void
+  attach(std::true_type)
+  {
+    if (!buffer_)
+      {
+        buffer_.reset(new unsigned char[StreamBuffer]);
+      }
+
+    state_->stream_buffer  = buffer_.get();
+    state_->stream_size    = StreamBuffer;
+    state_->stream_window  = window_;
+  }
+
+  std::unique_ptr<State>            state_;
+  std::unique_ptr<unsigned char[]>  buffer_;
+  std::size_t                       window_;
+};
+
+} /* namespace detail */
+
+template <int Level, std::size_t StreamBuffer = 0> class compressor
+{
+  static_assert(Level >= 1 && Level <= 3, "Level must be one of 1, 2, 3");
+
+  typedef detail::engine<Level, ( StreamBuffer > 0 )> engine;
+
+public:
+  static constexpr int          level          = Level;
+  static constexpr std::size_t  stream_buffer  = StreamBuffer;
+
+  /*
+   * Compress size bytes of source into destination, which must
+   * hold at least bound(size) bytes. Returns the compressed size.
+   */
+
+  std::size_t
+  compress(const void *source, std::size_t size, char *destination)
+  {
+    return engine::compress(source, destination, size, state_.get());
+  }
+
+# ifdef QLZ_IOVEC
+
+  /*
+   * Compress the iovcnt buffers of iov as one message, as compress()
+   * would compress them one after the other in a single buffer.
+   */
+
+  std::size_t
+  compressv(const struct iovec *iov, int iovcnt, char *destination)
+  {
+    return engine::compressv(iov, iovcnt, destination, state_.get());
+  }
+
+# endif /* ifdef QLZ_IOVEC */
+
+  /*
+   * Where the next size bytes go in the history, to be written there
+   * and passed to compress() without a copy. Returns nullptr if size
+   * is larger than the streaming buffer.
+   */
+
+  void *
+  reserve(std::size_t size)
+  {
+    static_assert(StreamBuffer > 0, "reserve needs a streaming buffer");
+    return engine::reserve(size, state_.get());
+  }
+
+# ifdef QLZ_HAVE_SPAN
+
+  /* Returns 0 if destination is smaller than bound(source.size()) */
+  std::size_t
+  compress(std::span<const std::byte> source, std::span<char> destination)
+  {
+    if (destination.size() < bound(source.size()))
+      {
+        return 0;
+      }
+
+    return compress(source.data(), source.size(), destination.data());
+  }
+
+# endif /* ifdef QLZ_HAVE_SPAN */
+
+  /*
+   * Keep the last n bytes of history when the streaming buffer is
+   * full. The compressor and the decompressor must use the same n.
+   * Returns false, and keeps the window, if n is not smaller than the
+   * streaming buffer.
+   */
+
+  bool
+  window(std::size_t n)
+  {
+    static_assert(StreamBuffer > 0, "window needs a streaming buffer");
+    if (n >= StreamBuffer)
+      {
+        return false;
+      }
+
+    state_.window(n);
+    return true;
+  }
+
+  /*
+   * Search less as n grows from 1, the default, for more speed and
+   * less compression. Only level 3 can choose what it searches.
+   */
+
+  void
+  acceleration(int n)
+  {
+    static_assert(Level == 3, "acceleration needs level 3");
+    acceleration_ = n > 1 ? n : 1;
+    accelerate(std::integral_constant<bool, Level == 3>());
+  }
+
+  /*
+   * Start the history over with size bytes of a preset dictionary,
+   * which the decompressor must load as well. Returns false if the
+   * dictionary does not fit in the streaming buffer.
+   */
+
+  bool
+  load_dict(const void *dict, std::size_t size)
+  {
+    static_assert(StreamBuffer > 0, "load_dict needs a streaming buffer");
+    return engine::load_dict(state_.get(), dict, size) != 0;
+  }
+
+  /* Continue from a copy of other, such as one with a dictionary */
+  void
+  assign(const compressor &other)
+  {
+    state_.assign(other.state_);
+    acceleration_ = other.acceleration_;
+  }
+
+  void
+  reset()
+  {
+    state_.reset();
+    accelerate(std::integral_constant<bool, Level == 3>());
+  }
+
+private:
+  void
+  accelerate(std::false_type)
+  {
+  }
+
+  void
+  accelerate(std::true_type)
+  {
+    state_.get()->acceleration = acceleration_;
+  }
+
+  detail::state_holder<typename engine::state_compress, engine, StreamBuffer>
+    state_;
+  int acceleration_ = 1;
+};
+
+template <int Level, std::size_t StreamBuffer = 0> class decompressor
+{
+  static_assert(Level >= 1 && Level <= 3, "Level must be one of 1, 2, 3");
+
+  typedef detail::engine<Level, ( StreamBuffer > 0 )> engine;
+
+public:
+  static constexpr int          level          = Level;
+  static constexpr std::size_t  stream_buffer  = StreamBuffer;
+
+  /*
+   * Decompress source into destination, which must hold at least
+   * size_decompressed(source) bytes. Returns the decompressed size.
+   */
+
+  std::size_t
+  decompress(const char *source, void *destination)
+  {
+    return engine::decompress(source, destination, state_.get());
+  }
+
+  /*
+   * Decompress the first max_out bytes of source into destination.
+   * Returns the bytes written, the whole message if it is shorter.
+   */
+
+  std::size_t
+  decompress_partial(const char *source, void *destination,
+                     std::size_t max_out)
+  {
+    return engine::decompress_partial(source, destination, max_out,
+                                      state_.get());
+  }
+
+  /*
+   * Decompress source into the history and point data at the message
+   * there until the next packet. Returns 0 if the message is larger
+   * than the streaming buffer.
+   */
+
+  std::size_t
+  view(const char *source, const void *&data)
+  {
+    static_assert(StreamBuffer > 0, "view needs a streaming buffer");
+    return engine::view(source, &data, state_.get());
+  }
+
+  /* Decompress the packets of the batch in order, as the C function */
+  std::size_t
+  decompress_batch(qlz_batch *batch, std::size_t count)
+  {
+    return engine::decompress_batch(batch, count, state_.get());
+  }
+
+# ifdef QLZ_HAVE_SPAN
+
+  /* Returns 0 if either span is too small for the packet */
+  std::size_t
+  decompress(std::span<const char> source, std::span<std::byte> destination)
+  {
+    if (source.size() < 9 && ( source.size() < 3 || ( source[0] & 2 ) != 0 ))
+      {
+        return 0;
+      }
+
+    if (source.size() < size_compressed(source.data())
+        || destination.size() < size_decompressed(source.data()))
+      {
+        return 0;
+      }
+
+    return decompress(source.data(), destination.data());
+  }
+
+# endif /* ifdef QLZ_HAVE_SPAN */
+
+  /*
+   * Keep the last n bytes of history when the streaming buffer is
+   * full. The compressor and the decompressor must use the same n.
+   * Returns false, and keeps the window, if n is not smaller than the
+   * streaming buffer.
+   */
+
+  bool
+  window(std::size_t n)
+  {
+    static_assert(StreamBuffer > 0, "window needs a streaming buffer");
+    if (n >= StreamBuffer)
+      {
+        return false;
+      }
+
+    state_.window(n);
+    return true;
+  }
+
+  /* Load the dictionary the compressor loaded */
+  bool
+  load_dict(const void *dict, std::size_t size)
+  {
+    static_assert(StreamBuffer > 0, "load_dict needs a streaming buffer");
+    return engine::load_dict(state_.get(), dict, size, StreamBuffer) != 0;
+  }
+
+  void
+  assign(const decompressor &other)
+  {
+    state_.assign(other.state_);
+  }
+
+  void
+  reset()
+  {
+    state_.reset();
+  }
+
+private:
+  detail::state_holder<typename engine::state_decompress, engine,
+                       StreamBuffer> state_;
+};
+
+} /* namespace qlz */
+
+#endif /* ifndef QLZ_HEADER_HPP */
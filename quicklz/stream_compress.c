@@ -36,11 +36,11 @@ main(int argc, char *argv[])
   file_data  = (char *)malloc(10000);
 
   /*
-   * Allocate "uncompressed size" + 400 bytes for the destination buffer
-   * where "uncompressed size" = 10000 in worst case in this sample demo.
+   * Allocate QLZ_COMPRESS_BOUND("uncompressed size") bytes for the destination
+   * buffer where "uncompressed size" = 10000 in worst case in this sample demo.
    */
 
-  compressed = (char *)malloc(10000 + 400);
+  compressed = (char *)malloc(QLZ_COMPRESS_BOUND(10000));
 
   /*
    * Allocate and initially zero out the states. After this, make
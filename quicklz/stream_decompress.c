@@ -35,11 +35,12 @@ main(int argc, char *argv[])
   ofile  = fopen(argv[2], "wb");
 
   /*
-   * Acompressed packet can be at most "uncompressed size" + 400 bytes large
-   * where "uncompressed size" = 10000 in worst case in this sample demo.
+   * A compressed packet can be at most QLZ_COMPRESS_BOUND("uncompressed size")
+   * bytes large where "uncompressed size" = 10000 in worst case in this sample
+   * demo.
    */
 
-  file_data = (char *)malloc(10000 + 400);
+  file_data = (char *)malloc(QLZ_COMPRESS_BOUND(10000));
 
   /* Allocate decompression buffer */
   decompressed = (char *)malloc(10000);
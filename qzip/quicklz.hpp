@@ -0,0 +1 @@
+../quicklz/quicklz.hpp
\ No newline at end of file
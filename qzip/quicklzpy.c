@@ -284,7 +284,7 @@ qlz_compress_py(PyObject *self, PyObject *args)
         &qlz_state_compress_Type,
         &state))
     {
-      compressed_buffer  = (char *)malloc(buffer_length + 400);
+      compressed_buffer  = (char *)malloc(qlz_compress_bound(buffer_length));
       size_compressed    = qlz_compress(
         buffer,
         compressed_buffer,
@@ -0,0 +1,456 @@
+/* SPDX-License-Identifier: GPL-1.0-only OR GPL-2.0-only OR GPL-3.0-only */
+
+/*
+ * qzdict -- builds a quicklz dictionary from
+ *           sample records and estimates its gain.
+ */
+
+/*
+ * Copyright (c) 2006-2011 Lasse Mikkel Reinhold <lar@quicklz.com>
+ * Copyright (c) 2023 Jeffrey H. Johnson <trnsz@pobox.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "quicklz.h"
+
+#if QLZ_COMPRESSION_LEVEL != 0
+# error Define QLZ_COMPRESSION_LEVEL to 0 for this application
+#endif /* if QLZ_COMPRESSION_LEVEL != 0 */
+
+#define DEFAULT_SIZE   16384
+#define DEFAULT_LEVEL  3
+#define DEFAULT_EVERY  10
+#define MAX_SIZES      16
+
+/* Each holdout pass is repeated until it has taken this long */
+#define MIN_SECONDS    0.2
+
+#define bool           int
+#define true           1
+#define false          0
+
+static char doc[]
+  = "qzdict - build a quicklz dictionary from sample records\n\n"
+    "  Usage:\n"
+    "         qzdict [options] sample...\n\n"
+    "  Each sample file is a record, or with -n each line of it is.\n"
+    "  Every Nth record is held out from the training to estimate the\n"
+    "  ratio and speed of compressing each record alone, with and\n"
+    "  without the dictionary, at the level given by -l.\n\n"
+    "  Options:\n"
+    "         -o FILE   write the dictionary to FILE, or to FILE.SIZE\n"
+    "                   for each size when several are given\n"
+    "         -s N,...  dictionary sizes in bytes (default 16384, at\n"
+    "                   most 131072)\n"
+    "         -l N      level of the estimate, 1, 2 or 3 (default 3)\n"
+    "         -H N      hold out every Nth record (default 10)\n"
+    "         -n        one record per line\n"
+    "\n";
+
+static char *  progname;
+static int     level        = DEFAULT_LEVEL;
+static size_t  every        = DEFAULT_EVERY;
+static bool    lines        = false;
+static char *  output       = NULL;
+static size_t  sizes[MAX_SIZES];
+static int     sizes_count  = 0;
+
+/* Records, stored one after the other as qlz_train_dict() takes them */
+struct records
+{
+  char *   data;
+  size_t * size;
+  size_t   count;
+  size_t   bytes;
+  size_t   capacity;
+  size_t   data_capacity;
+};
+
+static struct records train, holdout;
+
+void
+usage()
+{
+  fprintf(stderr, "%s", doc);
+  exit(1);
+}
+
+static void
+add_record(struct records *r, const char *data, size_t size)
+{
+  if (r->count == r->capacity)
+    {
+      r->capacity  = r->capacity ? 2 * r->capacity : 1024;
+      r->size      = (size_t *)realloc(r->size,
+                                       r->capacity * sizeof ( size_t ));
+      if (!r->size)
+        abort();
+    }
+
+  if (r->bytes + size > r->data_capacity)
+    {
+      while (r->bytes + size > r->data_capacity)
+        {
+          r->data_capacity = r->data_capacity ? 2 * r->data_capacity
+                             : 1024 * 1024;
+        }
+
+      r->data = (char *)realloc(r->data, r->data_capacity);
+      if (!r->data)
+        abort();
+    }
+
+  memcpy(r->data + r->bytes, data, size);
+  r->size[r->count++]  = size;
+  r->bytes            += size;
+}
+
+/* Every Nth record goes to the holdout set, the others to training */
+static void
+add_sample(const char *data, size_t size)
+{
+  static size_t n;
+
+  if (size == 0)
+    {
+      return;
+    }
+
+  add_record(++n % every == 0 ? &holdout : &train, data, size);
+}
+
+static void
+read_file(const char *name)
+{
+  FILE * f    = fopen(name, "rb");
+  char * data = NULL;
+  size_t size = 0, capacity = 0, n, i, start;
+
+  if (!f)
+    {
+      perror(name);
+      exit(1);
+    }
+
+  do
+    {
+      if (size == capacity)
+        {
+          capacity  = capacity ? 2 * capacity : 65536;
+          data      = (char *)realloc(data, capacity);
+          if (!data)
+            abort();
+        }
+
+      n      = fread(data + size, 1, capacity - size, f);
+      size  += n;
+    }
+  while (n > 0);
+
+  fclose(f);
+  if (!lines)
+    {
+      add_sample(data, size);
+    }
+  else
+    {
+      for (i = 0, start = 0; i < size; i++)
+        {
+          if (data[i] == '\n' || i == size - 1)
+            {
+              add_sample(data + start, i + 1 - start);
+              start = i + 1;
+            }
+        }
+    }
+
+  free(data);
+}
+
+static double
+now(void)
+{
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/*
+ * Compress and decompress each holdout record alone, from a copy of
+ * states primed with dict if there is one, until MIN_SECONDS have
+ * passed. The timings include the copies, which are the price of a
+ * dictionary for records this small. Returns the compressed bytes, or
+ * 0 if a record does not come back.
+ */
+
+static size_t
+estimate(const char *dict, size_t dict_size, double *compress_mbs,
+         double *decompress_mbs)
+{
+  size_t                 max = 0, buffer, i, used, bytes = 0, passes = 0;
+  size_t                 compressed = 0;
+  char *                 packet, *back;
+  double                 t, compress_time = 0, decompress_time = 0;
+  qlz_state_compress *   template_compress, *state_compress;
+  qlz_state_decompress * template_decompress, *state_decompress;
+
+  for (i = 0; i < holdout.count; i++)
+    {
+      max = holdout.size[i] > max ? holdout.size[i] : max;
+    }
+
+  /* The buffer holds the dictionary and the largest record after it */
+  buffer               = dict ? dict_size + max + 1 : 0;
+  packet               = (char *)malloc(QLZ_COMPRESS_BOUND(max));
+  back                 = (char *)malloc(max);
+  template_compress    = qlz_state_compress_new(level, buffer);
+  state_compress       = qlz_state_compress_new(level, buffer);
+  template_decompress  = qlz_state_decompress_new(buffer);
+  state_decompress     = qlz_state_decompress_new(buffer);
+  if (!packet || !back || !template_compress || !state_compress
+      || !template_decompress || !state_decompress)
+    abort();
+
+  if (dict
+      && ( !qlz_state_compress_load_dict(template_compress, dict, dict_size)
+           || !qlz_state_decompress_load_dict(template_decompress, level,
+                                              buffer, dict, dict_size)))
+    abort();
+
+  do
+    {
+      for (i = 0, used = 0; i < holdout.count; used += holdout.size[i], i++)
+        {
+          size_t c, d;
+
+          t = now();
+          if (dict)
+            {
+              qlz_state_compress_copy(state_compress, template_compress);
+            }
+
+          c = qlz_compress(holdout.data + used, packet, holdout.size[i],
+                           state_compress);
+          compress_time += now() - t;
+
+          t = now();
+          if (dict)
+            {
+              qlz_state_decompress_copy(state_decompress,
+                                        template_decompress);
+            }
+
+          d = qlz_decompress(packet, back, state_decompress);
+          decompress_time += now() - t;
+
+          if (d != holdout.size[i]
+              || memcmp(back, holdout.data + used, d) != 0)
+            {
+              compressed = 0;
+              goto done;
+            }
+
+          if (passes == 0)
+            {
+              compressed += c;
+            }
+        }
+
+      bytes += holdout.bytes;
+      passes++;
+    }
+  while (compress_time + decompress_time < MIN_SECONDS);
+
+  *compress_mbs    = bytes / 1e6
+                     / ( compress_time > 0 ? compress_time : 1e-9 );
+  *decompress_mbs  = bytes / 1e6
+                     / ( decompress_time > 0 ? decompress_time : 1e-9 );
+
+done:
+  free(packet);
+  free(back);
+  qlz_state_compress_free(template_compress);
+  qlz_state_compress_free(state_compress);
+  qlz_state_decompress_free(template_decompress);
+  qlz_state_decompress_free(state_decompress);
+  return compressed;
+}
+
+static void
+write_dict(const char *name, const char *dict, size_t size)
+{
+  FILE *f = fopen(name, "wb");
+
+  if (!f || fwrite(dict, 1, size, f) != size || fclose(f) != 0)
+    {
+      perror(name);
+      exit(1);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *   end;
+  char *   arg;
+  char *   dict;
+  char *   name;
+  int      shift, k;
+  size_t   plain;
+  double   plain_c, plain_d;
+
+  progname = argv[0];
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0')
+    {
+      shift  = argv[1][2] != '\0' ? 1 : 2;
+      arg    = shift == 1 ? argv[1] + 2 : argc > 2 ? argv[2] : "";
+      if (strcmp(argv[1], "--") == 0)
+        {
+          argc--;
+          argv++;
+          break;
+        }
+      else if (strcmp(argv[1], "-n") == 0)
+        {
+          lines  = true;
+          shift  = 1;
+        }
+      else if (strncmp(argv[1], "-o", 2) == 0 && *arg != '\0')
+        {
+          output = arg;
+        }
+      else if (strncmp(argv[1], "-s", 2) == 0)
+        {
+          do
+            {
+              if (sizes_count == MAX_SIZES)
+                usage();
+
+              sizes[sizes_count] = (size_t)strtoul(arg, &end, 10);
+              if (end == arg || sizes[sizes_count] == 0
+                  || sizes[sizes_count] > QLZ_DICT_MAX
+                  || ( *end != '\0' && *end != ',' ))
+                {
+                  fprintf(stderr, "%s: Invalid size: '%s'\n", progname, arg);
+                  usage();
+                }
+
+              sizes_count++;
+              arg = end + 1;
+            }
+          while (*end == ',');
+        }
+      else if (strncmp(argv[1], "-l", 2) == 0)
+        {
+          level = (int)strtol(arg, &end, 10);
+          if (*arg == '\0' || *end != '\0' || level < 1 || level > 3)
+            {
+              fprintf(stderr, "%s: Invalid level: '%s'\n", progname, arg);
+              usage();
+            }
+        }
+      else if (strncmp(argv[1], "-H", 2) == 0)
+        {
+          every = (size_t)strtoul(arg, &end, 10);
+          if (*arg == '\0' || *end != '\0' || every < 2)
+            {
+              fprintf(stderr, "%s: Invalid holdout: '%s'\n", progname, arg);
+              usage();
+            }
+        }
+      else
+        {
+          usage();
+        }
+
+      argc  -= shift;
+      argv  += shift;
+    }
+
+  if (argc == 1)
+    usage();
+
+  if (sizes_count == 0)
+    {
+      sizes[sizes_count++] = DEFAULT_SIZE;
+    }
+
+  for (k = 1; k < argc; k++)
+    {
+      read_file(argv[k]);
+    }
+
+  if (train.count == 0 || holdout.count == 0)
+    {
+      fprintf(stderr, "%s: Too few records to hold out every %zu\n",
+              progname, every);
+      exit(1);
+    }
+
+  printf("%zu training records (%zu bytes), %zu holdout records "
+         "(%zu bytes), level %d\n\n", train.count, train.bytes,
+         holdout.count, holdout.bytes, level);
+  printf("  dictionary     ratio   compress MB/s   decompress MB/s\n");
+
+  plain = estimate(NULL, 0, &plain_c, &plain_d);
+  if (plain == 0)
+    {
+      fprintf(stderr, "%s: Holdout records do not decompress\n", progname);
+      exit(1);
+    }
+
+  printf("  %10s  %8.3f  %14.1f  %16.1f\n", "none",
+         (double)plain / holdout.bytes, plain_c, plain_d);
+
+  name = output ? (char *)malloc(strlen(output) + 24) : NULL;
+  for (k = 0; k < sizes_count; k++)
+    {
+      size_t  size, compressed;
+      double  c, d;
+
+      dict = (char *)malloc(sizes[k]);
+      if (!dict || ( output && !name ))
+        abort();
+
+      size = qlz_train_dict(dict, sizes[k], train.data, train.size,
+                            train.count);
+      if (size == 0)
+        {
+          fprintf(stderr, "%s: Training failed for %zu bytes\n",
+                  progname, sizes[k]);
+          exit(1);
+        }
+
+      compressed = estimate(dict, size, &c, &d);
+      if (compressed == 0)
+        {
+          fprintf(stderr, "%s: Holdout records do not decompress\n",
+                  progname);
+          exit(1);
+        }
+
+      printf("  %10zu  %8.3f  %14.1f  %16.1f\n", size,
+             (double)compressed / holdout.bytes, c, d);
+
+      if (output)
+        {
+          if (sizes_count > 1)
+            {
+              sprintf(name, "%s.%zu", output, sizes[k]);
+            }
+          else
+            {
+              strcpy(name, output);
+            }
+
+          write_dict(name, dict, size);
+        }
+
+      free(dict);
+    }
+
+  free(name);
+  return 0;
+}
@@ -12,7 +12,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #undef FREE
 #ifdef TESTING
@@ -27,6 +30,10 @@
 
 #include "quicklz.h"
 
+#ifdef QLZ_THREADS
+# include <pthread.h>
+#endif /* ifdef QLZ_THREADS */
+
 #define STRINGIFY(x) #x
 #define TOSTRING(x)  STRINGIFY(x)
 
@@ -34,28 +41,308 @@
 # error Define QLZ_STREAMING_BUFFER to a non-zero value for this application
 #endif /* if QLZ_STREAMING_BUFFER == 0 */
 
+#if QLZ_COMPRESSION_LEVEL != 0
+# error Define QLZ_COMPRESSION_LEVEL to 0 for this application
+#endif /* if QLZ_COMPRESSION_LEVEL != 0 */
+
 #define QLZ_STREAMING_BUFFER_STRING  TOSTRING(QLZ_STREAMING_BUFFER)
-#define QLZ_COMPRESSION_LEVEL_STRING TOSTRING(QLZ_COMPRESSION_LEVEL)
+
+/* Level used when the program name does not end in 1, 2 or 3 */
+#define DEFAULT_LEVEL  3
 
 /* 1 MB Buffer */
 #define MAX_BUF_SIZE   (1024 * 1024)
-#define BUF_BUFFER     400
+#define BUF_BOUND      QLZ_COMPRESS_BOUND(MAX_BUF_SIZE)
+
+/*
+ * Files of less than MAX_BUF_SIZE bytes are handed to the workers
+ * in batches of up to BATCH_FILES files or MAX_BUF_SIZE bytes, and
+ * the blocks of files of SPLIT_SIZE bytes or more are spread over
+ * the pool.
+ */
+
+#define BATCH_FILES    64
+#define SPLIT_SIZE     (4 * MAX_BUF_SIZE)
 
 #define bool           int
 #define true           1
 #define false          0
 
 static char doc[]
-  = "qzip" QLZ_COMPRESSION_LEVEL_STRING
-    " - quicklz level " QLZ_COMPRESSION_LEVEL_STRING
-    " compressor/decompressor\n\n"
+  = "qzipN - quicklz level N compressor/decompressor (N = 1, 2 or 3)\n\n"
     "  Usage:\n"
-    "         qzip < infile > outfile.qz" QLZ_COMPRESSION_LEVEL_STRING "\n"
-    "         qunzip file.qz" QLZ_COMPRESSION_LEVEL_STRING "\n"
-    "         qzip file\n"
-    "         qcat file.qz" QLZ_COMPRESSION_LEVEL_STRING "\n\n";
+    "         qzipN < infile > outfile.qzN\n"
+    "         qunzipN file.qzN\n"
+    "         qzipN file\n"
+    "         qcatN file.qzN\n\n"
+    "  Any of qunzipN and qcatN decompress all three levels.\n\n"
+    "  Options:\n"
+    "         -r     compress or decompress the files in directories\n"
+    "         -A N   search less at level 3 as N grows from 1, for more\n"
+    "                speed and less compression\n"
+#ifdef QLZ_THREADS
+    "         -T N   use N threads, for the packets that start a new\n"
+    "                history and for many files at once (0 for one\n"
+    "                per processor)\n"
+#endif /* ifdef QLZ_THREADS */
+    "\n";
 
 static char *progname;
+static int   level          = DEFAULT_LEVEL;
+static bool  do_compress    = false;
+static bool  to_stdout      = false;
+static bool  recursive      = false;
+static int   acceleration   = 1;
+static char  extension[]    = ".qz0";
+
+/* A file named on the command line or found in a directory */
+struct file
+{
+  char * name;
+  off_t  size;
+};
+
+static struct file * files;
+static size_t        files_count, files_size;
+
+#ifdef QLZ_THREADS
+
+/* Worker threads asked for with -T, or -1 to work serially */
+static int        threads = -1;
+static qlz_pool * pool;
+
+/* Files processed at once, which share the pool */
+static int        workers = 1;
+
+/*
+ * A packet read ahead of the one being written. It is either handed
+ * to the pool, or done by the main thread when it needs the history.
+ */
+
+struct block
+{
+  char *    in;
+  char *    out;
+  size_t    in_size;
+  size_t    out_size;
+  size_t    result;
+  qlz_job * job;
+};
+
+static struct block *
+blocks_new(int depth, size_t in_size, size_t out_size)
+{
+  struct block * blocks = (struct block *)calloc(depth, sizeof ( *blocks ));
+  int            i;
+
+  if (!blocks)
+    abort();
+
+  for (i = 0; i < depth; i++)
+    {
+      blocks[i].in_size   = in_size;
+      blocks[i].out_size  = out_size;
+      blocks[i].in        = (char *)malloc(in_size);
+      blocks[i].out       = (char *)malloc(out_size);
+      if (!blocks[i].in || !blocks[i].out)
+        abort();
+    }
+
+  return blocks;
+}
+
+static void
+blocks_free(struct block *blocks, int depth)
+{
+  int i;
+
+  for (i = 0; i < depth; i++)
+    {
+      FREE(blocks[i].in);
+      FREE(blocks[i].out);
+    }
+
+  FREE(blocks);
+}
+
+/* Write a block once its packet is done */
+static void
+block_write(struct block *b, FILE *ofile)
+{
+  if (b->job)
+    {
+      b->result  = qlz_job_wait(b->job);
+      b->job     = NULL;
+    }
+
+  fwrite(b->out, b->result, 1, ofile);
+}
+
+/*
+ * Blocks in flight for one file: two for each thread of the pool, or
+ * of its share of the pool when several files are processed at once.
+ */
+
+static int
+blocks_depth(void)
+{
+  int depth = 2 * threads / workers;
+
+  return depth < 2 ? 2 : depth;
+}
+
+/*
+ * Compress as stream_compress() does, writing the same packets, with
+ * up to blocks_depth() of them in flight.
+ */
+
+int
+stream_compress_threads(FILE *ifile, FILE *ofile)
+{
+  int                  depth   = blocks_depth();
+  int                  head    = 0, count = 0;
+  size_t               d;
+  struct block *       b, *blocks;
+  qlz_state_compress * state_compress
+                   = qlz_state_compress_new(level, QLZ_STREAMING_BUFFER);
+
+  if (!state_compress)
+    abort();
+
+  qlz_state_compress_set_acceleration(state_compress, acceleration);
+  blocks = blocks_new(depth, MAX_BUF_SIZE, BUF_BOUND);
+  for (;;)
+    {
+      if (count == depth)
+        {
+          block_write(&blocks[head], ofile);
+          head = ( head + 1 ) % depth;
+          count--;
+        }
+
+      b = &blocks[( head + count ) % depth];
+      if (( d = fread(b->in, 1, MAX_BUF_SIZE, ifile)) == 0)
+        break;
+
+      if (qlz_compress_skip(d, state_compress))
+        {
+          b->job = qlz_pool_submit_compress_stream(pool, state_compress,
+                                                   b->in, b->out, d);
+          if (!b->job)
+            abort();
+        }
+      else
+        {
+          b->result = qlz_compress(b->in, b->out, d, state_compress);
+        }
+
+      count++;
+    }
+
+  for (; count > 0; count--)
+    {
+      block_write(&blocks[head], ofile);
+      head = ( head + 1 ) % depth;
+    }
+
+  blocks_free(blocks, depth);
+  qlz_state_compress_free(state_compress);
+  return 0;
+}
+
+/*
+ * Decompress as stream_decompress() does. Packets that start a new
+ * history are decompressed on the pool, and the others in turn by
+ * the main thread.
+ */
+
+int
+stream_decompress_threads(FILE *ifile, FILE *ofile)
+{
+  int                    depth   = blocks_depth();
+  int                    head    = 0, count = 0;
+  size_t                 c, dc;
+  struct block *         b, *blocks;
+  qlz_state_decompress * state_decompress
+    = qlz_state_decompress_new(QLZ_STREAMING_BUFFER);
+
+  if (!state_decompress)
+    abort();
+
+  blocks = blocks_new(depth, BUF_BOUND, MAX_BUF_SIZE);
+  for (;;)
+    {
+      if (count == depth)
+        {
+          block_write(&blocks[head], ofile);
+          head = ( head + 1 ) % depth;
+          count--;
+        }
+
+      b = &blocks[( head + count ) % depth];
+      if (fread(b->in, 1, 9, ifile) == 0)
+        break;
+
+      if (( *b->in & 0xc0 ) == 0x80)
+        {
+          c = qlz_size_compressed(b->in);
+          if (c > 9 && c <= QLZ_STREAM_HEADER_SIZE)
+            {
+              fread(b->in + 9, 1, c - 9, ifile);
+            }
+
+          if (qlz_stream_header_read(b->in, state_decompress) != 0)
+            {
+              continue;
+            }
+        }
+
+      /* Grow the buffers of this block for larger packets */
+      c   = qlz_size_compressed(b->in);
+      dc  = qlz_size_decompressed(b->in);
+      if (c > b->in_size)
+        {
+          b->in       = (char *)realloc(b->in, c);
+          b->in_size  = c;
+        }
+
+      if (dc > b->out_size)
+        {
+          FREE(b->out);
+          b->out       = (char *)malloc(dc);
+          b->out_size  = dc;
+        }
+
+      if (!b->in || !b->out)
+        abort();
+
+      fread(b->in + 9, 1, c - 9, ifile);
+      if (qlz_decompress_skip(b->in, state_decompress))
+        {
+          b->job = qlz_pool_submit_decompress(pool, b->in, b->out);
+          if (!b->job)
+            abort();
+        }
+      else
+        {
+          b->result = qlz_decompress(b->in, b->out, state_decompress);
+        }
+
+      count++;
+    }
+
+  for (; count > 0; count--)
+    {
+      block_write(&blocks[head], ofile);
+      head = ( head + 1 ) % depth;
+    }
+
+  blocks_free(blocks, depth);
+  qlz_state_decompress_free(state_decompress);
+  return 0;
+}
+
+#endif /* ifdef QLZ_THREADS */
 
 int
 stream_compress(FILE *ifile, FILE *ofile)
@@ -63,30 +350,32 @@ stream_compress(FILE *ifile, FILE *ofile)
   char *               file_data, *compressed;
   size_t               d, c, fd_size, compressed_size;
   qlz_state_compress * state_compress
-             = (qlz_state_compress *)malloc(sizeof ( qlz_state_compress ));
+             = qlz_state_compress_new(level, QLZ_STREAMING_BUFFER);
 
+  if (!state_compress)
+    abort();
+
+  qlz_state_compress_set_acceleration(state_compress, acceleration);
   fd_size    = MAX_BUF_SIZE;
   file_data  = (char *)malloc(fd_size);
 
   /*
-   * Allocate MAX_BUF_SIZE + BUF_BUFFER
+   * Allocate QLZ_COMPRESS_BOUND(MAX_BUF_SIZE)
    * bytes for the destination buffer.
    */
 
-  compressed_size  = MAX_BUF_SIZE + BUF_BUFFER;
+  compressed_size  = BUF_BOUND;
   compressed       = (char *)malloc(compressed_size);
 
   /*
-   * Allocate and initially zero out the states.
-   * After this, make sure it is preserved across
-   * calls and never modified manually.
+   * The state starts out zeroed. After this, make
+   * sure it is preserved across calls and never
+   * modified manually.
    */
 
   if (!state_compress)
     abort();
 
-  memset(state_compress, 0, sizeof ( qlz_state_compress ));
-
   /*
    * Compress the file using
    * MAX_BUF_SIZE packets.
@@ -111,7 +400,7 @@ stream_compress(FILE *ifile, FILE *ofile)
       fwrite(compressed, c, 1, ofile);
     }
 
-  FREE(state_compress);
+  qlz_state_compress_free(state_compress);
   FREE(compressed);
   FREE(file_data);
   return 0;
@@ -123,31 +412,29 @@ stream_decompress(FILE *ifile, FILE *ofile)
   char *                 file_data, *decompressed;
   size_t                 d, c, dc, fd_size, d_size;
   qlz_state_decompress * state_decompress
-    = (qlz_state_decompress *)malloc(sizeof ( qlz_state_decompress ));
+    = qlz_state_decompress_new(QLZ_STREAMING_BUFFER);
 
   /*
-   * A compressed packet can be at most MAX_BUF_SIZE + BUF_BUFFER
+   * A compressed packet can be at most BUF_BOUND
    * bytes if it was compressed with this program.
    */
 
-  fd_size    = MAX_BUF_SIZE + BUF_BUFFER;
+  fd_size    = BUF_BOUND;
   file_data  = (char *)malloc(fd_size);
 
   /* Allocate decompression buffer. */
-  d_size        = fd_size - BUF_BUFFER;
+  d_size        = MAX_BUF_SIZE;
   decompressed  = (char *)malloc(d_size);
 
   /*
-   * Allocate and initially zero out the scratch buffer.
-   * After this, make sure it is preserved across calls
-   * and never modified manually.
+   * The scratch buffer starts out zeroed. After this,
+   * make sure it is preserved across calls and never
+   * modified manually.
    */
 
   if (!state_decompress)
     abort();
 
-  memset(state_decompress, 0, sizeof ( qlz_state_decompress ));
-
   /*
    * Read 9-byte header to find the size of the entire
    * compressed packet, and then read remaining packet.
@@ -160,6 +447,26 @@ stream_decompress(FILE *ifile, FILE *ofile)
     {
       (void)c;
 
+      /*
+       * A stream header only tells the size
+       * and the window of the history used
+       * by the packets that follow it.
+       */
+
+      if (( *file_data & 0xc0 ) == 0x80)
+        {
+          c = qlz_size_compressed(file_data);
+          if (c > 9 && c <= QLZ_STREAM_HEADER_SIZE)
+            {
+              fread(file_data + 9, 1, c - 9, ifile);
+            }
+
+          if (qlz_stream_header_read(file_data, state_decompress) != 0)
+            {
+              continue;
+            }
+        }
+
       /*
        * Do we need a bigger decompressed buffer?
        * If the file was compressed with segments
@@ -167,10 +474,10 @@ stream_decompress(FILE *ifile, FILE *ofile)
        */
 
       dc = qlz_size_decompressed(file_data);
-      if (dc > ( fd_size - BUF_BUFFER ))
+      if (QLZ_COMPRESS_BOUND(dc) > fd_size)
         {
           FREE(file_data);
-          fd_size    = dc + BUF_BUFFER;
+          fd_size    = QLZ_COMPRESS_BOUND(dc);
           file_data  = (char *)malloc(fd_size);
         }
 
@@ -194,7 +501,7 @@ stream_decompress(FILE *ifile, FILE *ofile)
     }
 
   FREE(decompressed);
-  FREE(state_decompress);
+  qlz_state_decompress_free(state_decompress);
   FREE(file_data);
   return 0;
 }
@@ -239,17 +546,357 @@ move_to_final(char *tmp, char *dst)
     }
 }
 
-int
-main(int argc, char *argv[])
+
+/* Whether name ends in .qz1, .qz2 or .qz3 */
+bool
+has_extension(const char *name)
+{
+  size_t len = strlen(name);
+
+  return len >= 4
+         && strncmp(name + len - 4, ".qz", 3) == 0
+         && name[len - 1] >= '1'
+         && name[len - 1] <= '3';
+}
+
+void
+add_file(char *name, off_t size)
+{
+  if (files_count == files_size)
+    {
+      files_size  = files_size ? 2 * files_size : 64;
+      files       = (struct file *)realloc(files,
+                                           files_size * sizeof ( *files ));
+      if (!files)
+        abort();
+    }
+
+  files[files_count].name  = name;
+  files[files_count].size  = size;
+  files_count++;
+}
+
+/*
+ * Add the regular files below the directory dir. Files that already
+ * have an extension are left alone when compressing, and only those
+ * are taken when decompressing.
+ */
+
+void
+add_directory(const char *dir)
+{
+  DIR *           d;
+  struct dirent * entry;
+  struct stat     st;
+  char *          name;
+
+  if (( d = opendir(dir)) == NULL)
+    {
+      fprintf(stderr, "%s: Unable to read directory '%s'\n", progname, dir);
+      perror(progname);
+      exit(2);
+    }
+
+  while (( entry = readdir(d)) != NULL)
+    {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        continue;
+
+      name = (char *)malloc(strlen(dir) + strlen(entry->d_name) + 2);
+      if (!name)
+        abort();
+
+      sprintf(name, "%s/%s", dir, entry->d_name);
+      if (lstat(name, &st) < 0)
+        {
+          FREE(name);
+        }
+      else if (S_ISDIR(st.st_mode))
+        {
+          add_directory(name);
+          FREE(name);
+        }
+      else if (S_ISREG(st.st_mode) && has_extension(name) != do_compress)
+        {
+          add_file(name, st.st_size);
+        }
+      else
+        {
+          FREE(name);
+        }
+    }
+
+  closedir(d);
+}
+
+/* Compress or decompress ifile onto ofile */
+void
+run(FILE *ifile, FILE *ofile, bool split)
+{
+#ifdef QLZ_THREADS
+  if (split && pool)
+    {
+      if (do_compress)
+        {
+          stream_compress_threads(ifile, ofile);
+        }
+      else
+        {
+          stream_decompress_threads(ifile, ofile);
+        }
+
+      return;
+    }
+
+#endif /* ifdef QLZ_THREADS */
+  (void)split;
+  if (do_compress)
+    {
+      stream_compress(ifile, ofile);
+    }
+  else
+    {
+      stream_decompress(ifile, ofile);
+    }
+}
+
+/*
+ * Compress or decompress the file name. Unless writing to stdout, the
+ * output goes to a temporary file that is renamed when it is complete,
+ * and then the input file is removed.
+ */
+
+void
+process_file(const char *name, bool split)
 {
-  bool   do_compress          = false;
-  bool   to_stdout            = false;
   char   fn_buffer[1024]      = { '\0' };
   char   tmp_fn_buffer[1024]  = { '\0' };
   FILE * ifile;
   FILE * ofile;
-  char * progname_iter;
-  int    file_index;
+  size_t name_len             = strlen(name);
+
+  if (name_len + 32 > sizeof ( fn_buffer ))
+    {
+      fprintf(stderr, "%s: File name too long: '%s'\n", progname, name);
+      exit(1);
+    }
+
+  if (do_compress)
+    {
+      snprintf(fn_buffer, sizeof(fn_buffer) - 1,
+              "%s%s",
+              name, extension);
+      snprintf(tmp_fn_buffer, sizeof(tmp_fn_buffer) - 1,
+              "%s%s.%d",
+              name, extension, getpid());
+
+      abort_if_exists(fn_buffer);
+      abort_if_exists(tmp_fn_buffer);
+    }
+  else
+    {
+      if (!has_extension(name))
+        {
+          fprintf(stderr,
+            "%s: File does not end in '.qz1', '.qz2' or '.qz3':"
+            " '%s'\n",
+            progname,
+            name);
+          exit(1);
+        }
+
+      if (!to_stdout)
+        {
+          memcpy(fn_buffer, name, name_len - 4);
+          snprintf(tmp_fn_buffer, sizeof(tmp_fn_buffer) - 1,
+            "%s.%d", fn_buffer, getpid());
+          abort_if_exists(fn_buffer);
+        }
+    }
+
+  ifile = fopen(name, "rb");
+  if (!ifile)
+    {
+      perror("Unable to open input file");
+      exit(2);
+    }
+
+  ofile = to_stdout ? stdout : fopen(tmp_fn_buffer, "wb");
+  if (!ofile)
+    {
+      perror("Unable to open output file");
+      exit(2);
+    }
+
+  run(ifile, ofile, split);
+  fclose(ifile);
+
+  if (!to_stdout)
+    {
+      fclose(ofile);
+      move_to_final(tmp_fn_buffer, fn_buffer);
+      if (unlink(name) < 0)
+        {
+          fprintf(stderr,
+            "%s: Unable to unlink original file '%s'\n",
+            progname,
+            name);
+          perror(progname);
+          exit(3);
+        }
+    }
+}
+
+#ifdef QLZ_THREADS
+
+/*
+ * Files are processed by threads workers, each of which has a deque
+ * of tasks holding a batch of small files or one larger file. A
+ * worker takes its own tasks from the back and, when it has none
+ * left, steals from the front of the others.
+ */
+
+struct task
+{
+  size_t first;
+  size_t count;
+  bool   split;
+};
+
+struct deque
+{
+  pthread_mutex_t lock;
+  size_t          head;
+  size_t          tail;
+};
+
+static struct task *  tasks;
+static struct deque * deques;
+
+bool
+deque_pop(struct deque *q, struct task *t, bool own)
+{
+  bool found;
+
+  pthread_mutex_lock(&q->lock);
+  found = q->head < q->tail;
+  if (found)
+    {
+      *t = own ? tasks[--q->tail] : tasks[q->head++];
+    }
+
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+void *
+file_worker(void *arg)
+{
+  int          self = (int)( (struct deque *)arg - deques );
+  int          i;
+  size_t       k;
+  struct task  t = { 0, 0, false };
+
+  for (;;)
+    {
+      if (!deque_pop(&deques[self], &t, true))
+        {
+          for (i = 1; i < threads; i++)
+            {
+              if (deque_pop(&deques[( self + i ) % threads], &t, false))
+                break;
+            }
+
+          /* Tasks are only added before the workers start */
+          if (i == threads)
+            return NULL;
+        }
+
+      for (k = 0; k < t.count; k++)
+        {
+          process_file(files[t.first + k].name, t.split);
+        }
+    }
+}
+
+/* Batch the files into tasks and run them on threads workers */
+void
+process_files_threads(void)
+{
+  size_t      count = 0, i, n, bytes;
+  pthread_t * thread;
+  int         w;
+
+  tasks   = (struct task *)malloc(files_count * sizeof ( *tasks ));
+  deques  = (struct deque *)malloc(threads * sizeof ( *deques ));
+  thread  = (pthread_t *)malloc(threads * sizeof ( *thread ));
+  if (!tasks || !deques || !thread)
+    abort();
+
+  for (i = 0; i < files_count; i += n)
+    {
+      n      = 1;
+      bytes  = (size_t)files[i].size;
+      if (bytes < MAX_BUF_SIZE)
+        {
+          while (i + n < files_count && n < BATCH_FILES
+                 && files[i + n].size < MAX_BUF_SIZE
+                 && bytes + (size_t)files[i + n].size <= MAX_BUF_SIZE)
+            {
+              bytes += (size_t)files[i + n].size;
+              n++;
+            }
+        }
+
+      tasks[count].first  = i;
+      tasks[count].count  = n;
+      tasks[count].split  = files[i].size >= SPLIT_SIZE;
+      count++;
+    }
+
+  /* Each worker starts with a run of neighbouring tasks */
+  workers = count < (size_t)threads ? (int)count : threads;
+  for (w = 0; w < threads; w++)
+    {
+      pthread_mutex_init(&deques[w].lock, NULL);
+      deques[w].head  = count * w / threads;
+      deques[w].tail  = count * ( w + 1 ) / threads;
+    }
+
+  for (w = 0; w < threads; w++)
+    {
+      if (pthread_create(&thread[w], NULL, file_worker, &deques[w]) != 0)
+        abort();
+    }
+
+  for (w = 0; w < threads; w++)
+    {
+      pthread_join(thread[w], NULL);
+    }
+
+  /* Any worker may steal until the last one is done */
+  for (w = 0; w < threads; w++)
+    {
+      pthread_mutex_destroy(&deques[w].lock);
+    }
+
+  FREE(thread);
+  FREE(deques);
+  FREE(tasks);
+}
+
+#endif /* ifdef QLZ_THREADS */
+
+int
+main(int argc, char *argv[])
+{
+  char *      progname_iter;
+  int         file_index;
+  size_t      name_len, i;
+  struct stat st;
+  char *      end;
+  char *      arg;
+  int         shift;
 
   progname = strtok(argv[0], "/");
   while (( progname_iter = strtok(NULL, "/")) != NULL)
@@ -257,15 +904,31 @@ main(int argc, char *argv[])
       progname = progname_iter;
     }
 
-  if (strcmp(progname, "qzip" QLZ_COMPRESSION_LEVEL_STRING) == 0)
+  /*
+   * The compression level is the trailing digit
+   * of the program name, as in qzip1 or qcat3.
+   */
+
+  name_len = strlen(progname);
+  if (name_len > 0
+      && progname[name_len - 1] >= '1'
+      && progname[name_len - 1] <= '3')
+    {
+      level = progname[name_len - 1] - '0';
+      name_len--;
+    }
+
+  extension[3] = (char)( '0' + level );
+
+  if (name_len == 4 && strncmp(progname, "qzip", name_len) == 0)
     {
       do_compress = true;
     }
-  else if (strcmp(progname, "qunzip" QLZ_COMPRESSION_LEVEL_STRING) == 0)
+  else if (name_len == 6 && strncmp(progname, "qunzip", name_len) == 0)
     {
       do_compress = false;
     }
-  else if (strcmp(progname, "qcat" QLZ_COMPRESSION_LEVEL_STRING) == 0)
+  else if (name_len == 4 && strncmp(progname, "qcat", name_len) == 0)
     {
       do_compress  = false;
       to_stdout    = true;
@@ -276,160 +939,119 @@ main(int argc, char *argv[])
       usage();
     }
 
-  if (argc == 2)
-    {
-      if (( strcmp(argv[1], "-h")     == 0 )
-       || ( strcmp(argv[1], "-?")     == 0 )
-       || ( strcmp(argv[1], "--help") == 0 )
-       || ( strcmp(argv[1], "-help")  == 0 ))
-        {
-          usage();
-        }
-    }
+  /*
+   * Options come before the files; the remaining
+   * arguments are shifted down. Anything else that
+   * starts with '-', such as -h, shows the usage.
+   */
 
-  for (file_index = 1; file_index <= argc; file_index++)
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0')
     {
-      if (argc > 1 && file_index == argc)
+      shift = 1;
+      if (strcmp(argv[1], "--") == 0)
         {
-
-          /*
-           * We ensure that we go through the loop at least once.
-           * If there are files listed as argv, then ignore the
-           * last iteration.
-           */
-
+          argc--;
+          argv++;
           break;
         }
-
-      if (do_compress)
+      else if (strcmp(argv[1], "-r") == 0)
         {
-          /* Compress */
-          if (argc > 1)
-            {
-              snprintf(fn_buffer, sizeof(fn_buffer) - 1,
-                      "%s.qz" QLZ_COMPRESSION_LEVEL_STRING,
-                      argv[file_index]);
-              snprintf(tmp_fn_buffer, sizeof(tmp_fn_buffer) - 1,
-                      "%s.qz" QLZ_COMPRESSION_LEVEL_STRING ".%d",
-                      argv[file_index], getpid());
-
-              abort_if_exists(fn_buffer);
-              abort_if_exists(tmp_fn_buffer);
-
-              ifile = fopen(argv[file_index], "rb");
-              if (!ifile)
-                {
-                  perror("Unable to open input file");
-                  exit(2);
-                }
-
-              ofile = fopen(tmp_fn_buffer, "wb");
-            }
-          else
+          recursive = true;
+        }
+      else if (strncmp(argv[1], "-A", 2) == 0)
+        {
+          shift         = argv[1][2] != '\0' ? 1 : 2;
+          arg           = shift == 1 ? argv[1] + 2 : argc > 2 ? argv[2] : "";
+          acceleration  = (int)strtol(arg, &end, 10);
+          if (*arg == '\0' || *end != '\0' || acceleration < 1
+              || ( acceleration > 1 && level != 3 ))
             {
-              strcpy(fn_buffer, "stdout");
-              ifile  = stdin;
-              ofile  = stdout;
+              fprintf(stderr, "%s: Invalid acceleration: '%s'\n",
+                      progname, arg);
+              usage();
             }
         }
-      else
+#ifdef QLZ_THREADS
+      else if (strncmp(argv[1], "-T", 2) == 0)
         {
-          /* Decompress */
-          if (argc > 1)
+          shift  = argv[1][2] != '\0' ? 1 : 2;
+          arg    = shift == 1 ? argv[1] + 2 : argc > 2 ? argv[2] : "";
+          threads = (int)strtol(arg, &end, 10);
+          if (*arg == '\0' || *end != '\0' || threads < 0 || threads > 1024)
             {
-              bool err = false;
-              if (strlen(argv[file_index]) < 4)
-                {
-                  err = true;
-                }
-
-              if (!err)
-                {
-                  strncpy(tmp_fn_buffer,
-                    argv[file_index] + strlen(argv[file_index]) - 4,
-                    sizeof(tmp_fn_buffer));
-                  if (strcmp(tmp_fn_buffer,
-                        ".qz" QLZ_COMPRESSION_LEVEL_STRING) != 0)
-                    {
-                      err = true;
-                    }
-                }
-
-              if (err)
-                {
-                  fprintf(stderr,
-                    "%s: File does not end in '.qz%s': '%s'\n",
-                    progname, QLZ_COMPRESSION_LEVEL_STRING,
-                    argv[file_index]);
-                  exit(1);
-                }
-
-              if (!to_stdout)
-                {
-                  strncpy(fn_buffer,
-                    argv[file_index],
-                    strlen(argv[file_index]) - 4);
-                  snprintf(tmp_fn_buffer, sizeof(tmp_fn_buffer) - 1,
-                    "%s.%d", fn_buffer, getpid());
-                  abort_if_exists(fn_buffer);
-                }
-
-              ifile = fopen(argv[file_index], "rb");
-              if (!ifile)
-                {
-                  perror("Unable to open input file");
-                  exit(2);
-                }
-
-              if (to_stdout)
-                {
-                  strcpy(fn_buffer, "stdin");
-                  ofile = stdout;
-                }
-              else
-                {
-                  ofile = fopen(tmp_fn_buffer, "wb");
-                }
+              fprintf(stderr, "%s: Invalid thread count: '%s'\n",
+                      progname, arg);
+              usage();
             }
-          else
+
+          if (threads == 0)
             {
-              strcpy(fn_buffer, "stdin");
-              ifile  = stdin;
-              ofile  = stdout;
+              threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+              threads = threads > 0 ? threads : 1;
             }
         }
-
-      if (!ofile)
-        {
-          perror("Unable to open output file");
-          exit(2);
-        }
-
-      if (do_compress)
-        {
-          stream_compress(ifile, ofile);
-        }
+#endif /* ifdef QLZ_THREADS */
       else
         {
-          stream_decompress(ifile, ofile);
+          usage();
         }
 
-      fclose(ifile);
+      argc  -= shift;
+      argv  += shift;
+    }
 
-      if (argc > 1 && !to_stdout)
+#ifdef QLZ_THREADS
+  if (threads > 0 && ( pool = qlz_pool_new(threads)) == NULL)
+    abort();
+#endif /* ifdef QLZ_THREADS */
+
+  if (argc == 1)
+    {
+      run(stdin, stdout, true);
+      exit(0);
+    }
+
+  /*
+   * Directories are walked with -r and skipped
+   * otherwise. Other names are kept as they are,
+   * and checked when they are processed.
+   */
+
+  for (file_index = 1; file_index < argc; file_index++)
+    {
+      if (stat(argv[file_index], &st) == 0 && S_ISDIR(st.st_mode))
         {
-          fclose(ofile);
-          move_to_final(tmp_fn_buffer, fn_buffer);
-          if (unlink(argv[file_index]) < 0)
+          if (recursive)
             {
-              fprintf(stderr,
-                "%s: Unable to unlink original file '%s'\n",
+              add_directory(argv[file_index]);
+            }
+          else
+            {
+              fprintf(stderr, "%s: '%s' is a directory -- ignored\n",
                 progname,
-                argv[1]);
-              perror(progname);
-              exit(3);
+                argv[file_index]);
             }
         }
+      else
+        {
+          add_file(argv[file_index],
+                   stat(argv[file_index], &st) == 0 ? st.st_size : 0);
+        }
+    }
+
+#ifdef QLZ_THREADS
+  if (pool && !to_stdout && files_count > 1)
+    {
+      process_files_threads();
+      exit(0);
+    }
+#endif /* ifdef QLZ_THREADS */
+
+  /* A single file spreads its blocks over the pool */
+  for (i = 0; i < files_count; i++)
+    {
+      process_file(files[i].name,
+                   files_count == 1 || files[i].size >= SPLIT_SIZE);
     }
 
   exit(0);
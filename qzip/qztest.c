@@ -0,0 +1,1050 @@
+/* SPDX-License-Identifier: GPL-1.0-only OR GPL-2.0-only OR GPL-3.0-only */
+
+/*
+ * qztest -- checks library functions of quicklz
+ *           that qzip does not reach.
+ */
+
+/*
+ * Copyright (c) 2006-2011 Lasse Mikkel Reinhold <lar@quicklz.com>
+ * Copyright (c) 2023 Jeffrey H. Johnson <trnsz@pobox.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "quicklz.h"
+
+#if QLZ_COMPRESSION_LEVEL != 0
+# error Define QLZ_COMPRESSION_LEVEL to 0 for this application
+#endif /* if QLZ_COMPRESSION_LEVEL != 0 */
+
+#define STREAM_BUFFER  1000000
+#define MESSAGES       8
+#define MESSAGE_SIZE   4000
+
+static int failures = 0;
+
+static void
+check(int ok, const char *what)
+{
+  if (!ok)
+    {
+      fprintf(stderr, "qztest: FAILED: %s\n", what);
+      failures++;
+    }
+}
+
+/*
+ * Fill a message with words from a small vocabulary, so that it has
+ * matches within itself and with the messages before it.
+ */
+
+static void
+fill_message(unsigned char *message, size_t size, unsigned int seed)
+{
+  static const char *words[] = {
+    "alpha ", "bravo ", "charlie ", "delta ", "echo ", "foxtrot ",
+    "golf ", "hotel ", "india ", "juliet ", "kilo ", "lima "
+  };
+  size_t i = 0;
+
+  while (i < size)
+    {
+      const char *w = words[( seed >> 8 ) % 12];
+      size_t n      = strlen(w);
+
+      seed = seed * 1103515245u + 12345u;
+      if (n > size - i)
+        {
+          n = size - i;
+        }
+
+      memcpy(message + i, w, n);
+      i += n;
+    }
+}
+
+/*
+ * A peek of 0 bytes in the middle of a stream must still add the packet
+ * to the history, or the packets after it decode to garbage.
+ */
+
+static void
+test_partial_zero(int level)
+{
+  qlz_state_compress *   cs  = qlz_state_compress_new(level, STREAM_BUFFER);
+  qlz_state_decompress * ds  = qlz_state_decompress_new(STREAM_BUFFER);
+  unsigned char          message[MESSAGE_SIZE];
+  unsigned char          out[MESSAGE_SIZE];
+  char                   packet[QLZ_COMPRESS_BOUND(MESSAGE_SIZE)];
+  int                    i;
+
+  check(cs != NULL && ds != NULL, "partial: allocate states");
+  if (cs == NULL || ds == NULL)
+    {
+      qlz_state_compress_free(cs);
+      qlz_state_decompress_free(ds);
+      return;
+    }
+
+  for (i = 0; i < MESSAGES; i++)
+    {
+      size_t csize;
+
+      fill_message(message, sizeof ( message ), (unsigned int)i * 7 + 1);
+      csize = qlz_compress(message, packet, sizeof ( message ), cs);
+      check(csize != 0, "partial: compress");
+
+      if (i == MESSAGES / 2)
+        {
+          check(qlz_decompress_partial(packet, out, 0, ds) == 0,
+                "partial: peek 0 bytes");
+        }
+      else
+        {
+          check(qlz_decompress(packet, out, ds) == sizeof ( message )
+                && memcmp(out, message, sizeof ( message )) == 0,
+                "partial: decode after a 0 byte peek");
+        }
+    }
+
+  qlz_state_compress_free(cs);
+  qlz_state_decompress_free(ds);
+}
+
+/*
+ * Segments apart in memory give the packet of their concatenation,
+ * gathered on the stack or, past QLZ_GATHER_STACK, allocated.
+ */
+
+static void
+test_compressv(int level, size_t size)
+{
+  qlz_state_compress *   cs  = qlz_state_compress_new(level, 0);
+  qlz_state_decompress * ds  = qlz_state_decompress_new(0);
+  unsigned char *        message = (unsigned char *)malloc(size + 64);
+  unsigned char *        out     = (unsigned char *)malloc(size);
+  char *                 packet  = (char *)malloc(QLZ_COMPRESS_BOUND(size));
+  struct iovec           iov[3];
+  size_t                 third   = size / 3;
+
+  check(cs != NULL && ds != NULL && message != NULL && out != NULL
+        && packet != NULL, "compressv: allocate");
+  if (cs != NULL && ds != NULL && message != NULL && out != NULL
+      && packet != NULL)
+    {
+      fill_message(message, size + 64, 5);
+      memmove(message + third + 16, message + third, size - third);
+      memmove(message + 2 * third + 32, message + 2 * third + 16,
+              size - 2 * third);
+      iov[0].iov_base  = message;
+      iov[0].iov_len   = third;
+      iov[1].iov_base  = message + third + 16;
+      iov[1].iov_len   = third;
+      iov[2].iov_base  = message + 2 * third + 32;
+      iov[2].iov_len   = size - 2 * third;
+
+      check(qlz_compressv(iov, 3, packet, cs) != 0
+            && qlz_decompress(packet, out, ds) == size
+            && memcmp(out, iov[0].iov_base, third) == 0
+            && memcmp(out + third, iov[1].iov_base, third) == 0
+            && memcmp(out + 2 * third, iov[2].iov_base,
+                      size - 2 * third) == 0,
+            "compressv: segments apart");
+    }
+
+  free(message);
+  free(out);
+  free(packet);
+  qlz_state_compress_free(cs);
+  qlz_state_decompress_free(ds);
+}
+
+/*
+ * Messages of every size class up to QLZ_SMALL_MAX, compressible or
+ * not, come back from any decompressor, and sizes out of range give 0.
+ */
+
+static void
+test_small(void)
+{
+  static const size_t    sizes[] = { 1, 4, 5, 154, 155, 215, 216, 399, 400,
+                                     MESSAGE_SIZE, QLZ_SMALL_MAX };
+  qlz_state_decompress * ds      = qlz_state_decompress_new(0);
+  unsigned char *        message = (unsigned char *)malloc(QLZ_SMALL_MAX);
+  unsigned char *        out     = (unsigned char *)malloc(QLZ_SMALL_MAX);
+  char *                 packet
+    = (char *)malloc(QLZ_COMPRESS_BOUND(QLZ_SMALL_MAX + 1));
+  int                    ok      = 1;
+  size_t                 i, j, c;
+  unsigned int           x       = 1;
+
+  check(ds != NULL && message != NULL && out != NULL && packet != NULL,
+        "small: allocate");
+  if (ds != NULL && message != NULL && out != NULL && packet != NULL)
+    {
+      for (j = 0; j < 2; j++)
+        {
+          if (j == 0)
+            {
+              fill_message(message, QLZ_SMALL_MAX, 13);
+            }
+          else
+            {
+              for (i = 0; i < QLZ_SMALL_MAX; i++)
+                {
+                  x           = x * 1103515245u + 12345u;
+                  message[i]  = (unsigned char)( x >> 16 );
+                }
+            }
+
+          for (i = 0; i < sizeof ( sizes ) / sizeof ( sizes[0] ); i++)
+            {
+              c = qlz_compress_small(message, packet, sizes[i]);
+              if (c == 0 || c > QLZ_COMPRESS_BOUND(sizes[i])
+                  || qlz_decompress(packet, out, ds) != sizes[i]
+                  || memcmp(out, message, sizes[i]) != 0)
+                {
+                  ok = 0;
+                }
+            }
+        }
+
+      check(ok, "small: round trip");
+      check(qlz_compress_small(message, packet, 0) == 0
+            && qlz_compress_small(message, packet, QLZ_SMALL_MAX + 1) == 0,
+            "small: sizes out of range");
+    }
+
+  free(message);
+  free(out);
+  free(packet);
+  qlz_state_decompress_free(ds);
+}
+
+/*
+ * Fill a message with words, with random bytes, or with bytes from four
+ * symbols, which gives many short matches.
+ */
+
+static void
+fill_kind(unsigned char *message, size_t size, int kind, unsigned int seed)
+{
+  size_t i;
+
+  if (kind == 0)
+    {
+      fill_message(message, size, seed);
+      return;
+    }
+
+  for (i = 0; i < size; i++)
+    {
+      seed        = seed * 1103515245u + 12345u;
+      message[i]  = (unsigned char)( kind == 1 ? seed >> 16
+                                               : 'a' + (( seed >> 16 ) & 3 ));
+    }
+}
+
+/*
+ * Packets of sizes around each step of QLZ_COMPRESS_BOUND(), from
+ * states with and without streaming, fit the bound and write nothing
+ * past it. The bound never decreases with size.
+ */
+
+#define BOUND_GUARD  64
+
+static void
+test_bound(int level)
+{
+  static const size_t    sizes[] = { 1, 2, 3, 4, 5, 6, 30, 31, 154, 155,
+                                     156, 215, 216, 217, 375, 376, 377,
+                                     399, 400, 401, MESSAGE_SIZE, 100000 };
+  qlz_state_compress *   cs[2];
+  unsigned char *        message = (unsigned char *)malloc(100000);
+  char *                 packet
+    = (char *)malloc(QLZ_COMPRESS_BOUND(100000) + BOUND_GUARD);
+  int                    ok      = 1;
+  int                    kind, j;
+  size_t                 i, k, c;
+
+  cs[0]  = qlz_state_compress_new(level, 0);
+  cs[1]  = qlz_state_compress_new(level, STREAM_BUFFER);
+  check(cs[0] != NULL && cs[1] != NULL && message != NULL && packet != NULL,
+        "bound: allocate");
+  if (cs[0] == NULL || cs[1] == NULL || message == NULL || packet == NULL)
+    {
+      goto done;
+    }
+
+  for (i = 0; i < 1000; i++)
+    {
+      ok &= QLZ_COMPRESS_BOUND(i) <= QLZ_COMPRESS_BOUND(i + 1)
+            && qlz_compress_bound(i) == QLZ_COMPRESS_BOUND(i);
+    }
+
+  check(ok, "bound: never decreases");
+
+  for (kind = 0; kind < 3; kind++)
+    {
+      for (i = 0; i < sizeof ( sizes ) / sizeof ( sizes[0] ); i++)
+        {
+          fill_kind(message, sizes[i], kind, (unsigned int)( i + 1 ));
+          for (j = 0; j < 2; j++)
+            {
+              memset(packet, 0xA5, QLZ_COMPRESS_BOUND(sizes[i])
+                     + BOUND_GUARD);
+              c   = qlz_compress(message, packet, sizes[i], cs[j]);
+              ok &= c != 0 && c <= QLZ_COMPRESS_BOUND(sizes[i]);
+              for (k = 0; k < BOUND_GUARD; k++)
+                {
+                  ok &= (unsigned char)packet[QLZ_COMPRESS_BOUND(sizes[i])
+                                              + k] == 0xA5;
+                }
+            }
+        }
+    }
+
+  check(ok, "bound: packets fit");
+
+done:
+  qlz_state_compress_free(cs[0]);
+  qlz_state_compress_free(cs[1]);
+  free(message);
+  free(packet);
+}
+
+/*
+ * Each packet, placed at the end of a buffer of its decompressed size
+ * plus qlz_inplace_margin() bytes, is decompressed to the start of the
+ * same buffer, with and without streaming.
+ */
+
+static void
+test_inplace(int level)
+{
+  static const size_t    sizes[] = { 1, 5, 100, 400, MESSAGE_SIZE, 100000 };
+  qlz_state_compress *   cs[2];
+  qlz_state_decompress * ds[2];
+  unsigned char *        message = (unsigned char *)malloc(100000);
+  char *                 packet
+    = (char *)malloc(QLZ_COMPRESS_BOUND(100000));
+  char *                 buffer;
+  int                    ok      = 1;
+  int                    kind, j;
+  size_t                 i, c, m;
+
+  cs[0]  = qlz_state_compress_new(level, 0);
+  cs[1]  = qlz_state_compress_new(level, STREAM_BUFFER);
+  ds[0]  = qlz_state_decompress_new(0);
+  ds[1]  = qlz_state_decompress_new(STREAM_BUFFER);
+  check(cs[0] != NULL && cs[1] != NULL && ds[0] != NULL && ds[1] != NULL
+        && message != NULL && packet != NULL, "inplace: allocate");
+  if (cs[0] == NULL || cs[1] == NULL || ds[0] == NULL || ds[1] == NULL
+      || message == NULL || packet == NULL)
+    {
+      goto done;
+    }
+
+  for (kind = 0; kind < 3; kind++)
+    {
+      for (i = 0; i < sizeof ( sizes ) / sizeof ( sizes[0] ); i++)
+        {
+          fill_kind(message, sizes[i], kind, (unsigned int)( i + 7 ));
+          for (j = 0; j < 2; j++)
+            {
+              c       = qlz_compress(message, packet, sizes[i], cs[j]);
+              m       = qlz_inplace_margin(packet);
+              buffer  = (char *)malloc(sizes[i] + m);
+              if (c == 0 || m == 0 || buffer == NULL || c > sizes[i] + m)
+                {
+                  ok = 0;
+                  free(buffer);
+                  continue;
+                }
+
+              memcpy(buffer + sizes[i] + m - c, packet, c);
+              ok &= qlz_decompress(buffer + sizes[i] + m - c, buffer, ds[j])
+                    == sizes[i]
+                    && memcmp(buffer, message, sizes[i]) == 0;
+              free(buffer);
+            }
+        }
+    }
+
+  check(ok, "inplace: round trip");
+
+done:
+  qlz_state_compress_free(cs[0]);
+  qlz_state_compress_free(cs[1]);
+  qlz_state_decompress_free(ds[0]);
+  qlz_state_decompress_free(ds[1]);
+  free(message);
+  free(packet);
+}
+
+/*
+ * Messages built in the space qlz_compress_reserve() returns give the
+ * same packets as copies compressed by qlz_compress(), and come back
+ * from qlz_decompress_view() while the buffer fills, slides and starts
+ * over. A message larger than the buffer gets no space and no view, and
+ * leaves both states to go on with the stream.
+ */
+
+#define RESERVE_BUFFER  100000
+#define RESERVE_COUNT   40
+
+static void
+test_reserve_view(int level, size_t window)
+{
+  qlz_state_compress *   cs      = qlz_state_compress_new(level,
+                                                          RESERVE_BUFFER);
+  qlz_state_compress *   cc      = qlz_state_compress_new(level,
+                                                          RESERVE_BUFFER);
+  qlz_state_compress *   cn      = qlz_state_compress_new(level, 0);
+  qlz_state_decompress * ds      = qlz_state_decompress_new(RESERVE_BUFFER);
+  qlz_state_decompress * dn      = qlz_state_decompress_new(0);
+  unsigned char *        message = (unsigned char *)malloc(RESERVE_BUFFER
+                                                           + 1);
+  char *                 packet
+    = (char *)malloc(QLZ_COMPRESS_BOUND(RESERVE_BUFFER + 1));
+  char *                 copy
+    = (char *)malloc(QLZ_COMPRESS_BOUND(RESERVE_BUFFER + 1));
+  const void *           view;
+  unsigned char *        space;
+  int                    ok      = 1;
+  int                    i;
+  size_t                 size, c;
+
+  check(cs != NULL && cc != NULL && cn != NULL && ds != NULL && dn != NULL
+        && message != NULL && packet != NULL && copy != NULL,
+        "reserve: allocate");
+  if (cs == NULL || cc == NULL || cn == NULL || ds == NULL || dn == NULL
+      || message == NULL || packet == NULL || copy == NULL)
+    {
+      goto done;
+    }
+
+  check(qlz_state_compress_set_window(cs, window)
+        && qlz_state_compress_set_window(cc, window)
+        && qlz_state_decompress_set_window(ds, window), "reserve: window");
+
+  for (i = 0; i <= RESERVE_COUNT; i++)
+    {
+      size = i == RESERVE_COUNT / 2 ? RESERVE_BUFFER + 1
+                                    : 1 + ( (size_t)i * 7919 ) % 30000;
+      fill_message(message, size, (unsigned int)( i + 31 ));
+      space = (unsigned char *)qlz_compress_reserve(size, cs);
+      if (size > RESERVE_BUFFER)
+        {
+          ok &= space == NULL;
+          c   = qlz_compress(message, packet, size, cs);
+        }
+      else
+        {
+          ok &= space != NULL;
+          if (space == NULL)
+            {
+              break;
+            }
+
+          memcpy(space, message, size);
+          c = qlz_compress(space, packet, size, cs);
+        }
+
+      ok  &= c != 0 && qlz_compress(message, copy, size, cc) == c
+             && memcmp(packet, copy, c) == 0;
+      view = message;
+      if (size > RESERVE_BUFFER)
+        {
+          ok &= qlz_decompress_view(packet, &view, ds) == 0 && view == NULL
+                && qlz_decompress(packet, copy, ds) == size
+                && memcmp(copy, message, size) == 0;
+        }
+      else
+        {
+          ok &= qlz_decompress_view(packet, &view, ds) == size
+                && view != NULL && memcmp(view, message, size) == 0;
+        }
+    }
+
+  check(ok, "reserve: round trip");
+
+  view = message;
+  check(qlz_compress_reserve(100, cn) == NULL
+        && qlz_compress(message, packet, 100, cn) != 0
+        && qlz_decompress_view(packet, &view, dn) == 0 && view == NULL,
+        "reserve: no streaming");
+
+done:
+  qlz_state_compress_free(cs);
+  qlz_state_compress_free(cc);
+  qlz_state_compress_free(cn);
+  qlz_state_decompress_free(ds);
+  qlz_state_decompress_free(dn);
+  free(message);
+  free(packet);
+  free(copy);
+}
+
+/*
+ * Each short message is compressed and decompressed from copies of
+ * states that loaded the same dictionary, and comes out smaller than
+ * from empty states. A dictionary must leave a byte of the buffer.
+ */
+
+static void
+test_dict(int level)
+{
+  qlz_state_compress *   cdict  = qlz_state_compress_new(level, 100000);
+  qlz_state_compress *   c      = qlz_state_compress_new(level, 100000);
+  qlz_state_compress *   cnone  = qlz_state_compress_new(level, 100000);
+  qlz_state_decompress * ddict  = qlz_state_decompress_new(100000);
+  qlz_state_decompress * d      = qlz_state_decompress_new(100000);
+  unsigned char *        dict   = (unsigned char *)malloc(100000);
+  unsigned char          message[300];
+  unsigned char          out[sizeof ( message )];
+  char                   packet[QLZ_COMPRESS_BOUND(sizeof ( message ))];
+  char                   plain[QLZ_COMPRESS_BOUND(sizeof ( message ))];
+  size_t                 with   = 0, without = 0, n;
+  int                    ok     = 1;
+  int                    i;
+
+  check(cdict != NULL && c != NULL && cnone != NULL && ddict != NULL
+        && d != NULL && dict != NULL, "dict: allocate");
+  if (cdict != NULL && c != NULL && cnone != NULL && ddict != NULL
+      && d != NULL && dict != NULL)
+    {
+      fill_message(dict, 100000, 17);
+      check(qlz_state_compress_load_dict(cdict, dict, 100000) == 0,
+            "dict: as large as the buffer");
+      check(qlz_state_compress_load_dict(cdict, dict, 8000)
+            && qlz_state_decompress_load_dict(ddict, level, 100000, dict,
+                                              8000),
+            "dict: load");
+
+      for (i = 0; i < 8; i++)
+        {
+          fill_message(message, sizeof ( message ), (unsigned int)i * 3 + 19);
+          n = qlz_state_compress_copy(c, cdict)
+              && qlz_state_decompress_copy(d, ddict)
+              ? qlz_compress(message, packet, sizeof ( message ), c) : 0;
+          if (n == 0 || qlz_decompress(packet, out, d) != sizeof ( message )
+              || memcmp(out, message, sizeof ( message )) != 0)
+            {
+              ok = 0;
+            }
+
+          /* An empty dictionary starts the history over */
+          with     += n;
+          without  += qlz_state_compress_load_dict(cnone, dict, 0)
+                      ? qlz_compress(message, plain, sizeof ( message ),
+                                     cnone) : 0;
+        }
+
+      check(ok, "dict: round trip from copies");
+      check(with < without, "dict: smaller with the dictionary");
+    }
+
+  free(dict);
+  qlz_state_compress_free(cdict);
+  qlz_state_compress_free(c);
+  qlz_state_compress_free(cnone);
+  qlz_state_decompress_free(ddict);
+  qlz_state_decompress_free(d);
+}
+
+/*
+ * A batch of packets of every level and of many sizes, some from
+ * qlz_compress_batch(), comes back whole; so does a stream split
+ * between two batches on one streaming state.
+ */
+
+#define BATCH  24
+
+static void
+test_batch(void)
+{
+  qlz_state_compress *   cs[4];
+  qlz_state_decompress * ds      = qlz_state_decompress_new(0);
+  qlz_state_decompress * dss     = qlz_state_decompress_new(STREAM_BUFFER);
+  unsigned char *        message = (unsigned char *)malloc(BATCH
+                                                           * MESSAGE_SIZE);
+  unsigned char *        out     = (unsigned char *)malloc(BATCH
+                                                           * MESSAGE_SIZE);
+  char *                 packets
+    = (char *)malloc(BATCH * QLZ_COMPRESS_BOUND(MESSAGE_SIZE));
+  qlz_batch              batch[BATCH];
+  size_t                 sizes[BATCH];
+  size_t                 total, expect;
+  int                    ok      = 1;
+  int                    i;
+
+  cs[0]  = qlz_state_compress_new(1, 0);
+  cs[1]  = qlz_state_compress_new(2, 0);
+  cs[2]  = qlz_state_compress_new(3, 0);
+  cs[3]  = qlz_state_compress_new(2, STREAM_BUFFER);
+  check(cs[0] != NULL && cs[1] != NULL && cs[2] != NULL && cs[3] != NULL
+        && ds != NULL && dss != NULL && message != NULL && out != NULL
+        && packets != NULL, "batch: allocate");
+  if (cs[0] == NULL || cs[1] == NULL || cs[2] == NULL || cs[3] == NULL
+      || ds == NULL || dss == NULL || message == NULL || out == NULL
+      || packets == NULL)
+    {
+      goto done;
+    }
+
+  fill_message(message, BATCH * MESSAGE_SIZE, 23);
+
+  /* Every third message goes through qlz_compress_batch() */
+  for (i = 0, expect = 0; i < BATCH; i++)
+    {
+      sizes[i]              = 1 + ( (size_t)i * 997 ) % MESSAGE_SIZE;
+      batch[i].source       = message + i * MESSAGE_SIZE;
+      batch[i].size         = sizes[i];
+      batch[i].destination  = packets + i * QLZ_COMPRESS_BOUND(MESSAGE_SIZE);
+      if (i % 3 != 0)
+        {
+          batch[i].compressed = qlz_compress(batch[i].source,
+                                             batch[i].destination,
+                                             sizes[i], cs[i % 3]);
+        }
+
+      expect += sizes[i];
+    }
+
+  for (i = 0; i < BATCH; i += 3)
+    {
+      qlz_compress_batch(batch + i, 1);
+    }
+
+  for (i = 0; i < BATCH; i++)
+    {
+      ok              &= batch[i].compressed != 0;
+      batch[i].source  = batch[i].destination;
+      batch[i].destination = (char *)out + i * MESSAGE_SIZE;
+    }
+
+  total = qlz_decompress_batch(batch, BATCH, ds);
+  for (i = 0; i < BATCH; i++)
+    {
+      ok &= batch[i].size == sizes[i]
+            && batch[i].compressed
+               == qlz_size_compressed((const char *)batch[i].source)
+            && memcmp(out + i * MESSAGE_SIZE, message + i * MESSAGE_SIZE,
+                      sizes[i]) == 0;
+    }
+
+  check(ok && total == expect, "batch: mixed levels");
+
+  /* A stream, decompressed in two batches that the state follows */
+  for (i = 0; i < BATCH; i++)
+    {
+      batch[i].source       = packets + i * QLZ_COMPRESS_BOUND(MESSAGE_SIZE);
+      batch[i].destination  = (char *)out + i * MESSAGE_SIZE;
+      ok &= qlz_compress(message + i * MESSAGE_SIZE,
+                         packets + i * QLZ_COMPRESS_BOUND(MESSAGE_SIZE),
+                         MESSAGE_SIZE, cs[3]) != 0;
+    }
+
+  total  = qlz_decompress_batch(batch, BATCH / 2, dss);
+  total += qlz_decompress_batch(batch + BATCH / 2, BATCH - BATCH / 2, dss);
+  check(ok && total == BATCH * MESSAGE_SIZE
+        && memcmp(out, message, BATCH * MESSAGE_SIZE) == 0,
+        "batch: streaming");
+
+done:
+  for (i = 0; i < 4; i++)
+    {
+      qlz_state_compress_free(cs[i]);
+    }
+
+  qlz_state_decompress_free(ds);
+  qlz_state_decompress_free(dss);
+  free(message);
+  free(out);
+  free(packets);
+}
+
+/*
+ * Both sides take a window smaller than the streaming buffer, and only
+ * such a window, before any packet.
+ */
+
+static void
+test_window(void)
+{
+  qlz_state_compress *   cs  = qlz_state_compress_new(3, STREAM_BUFFER);
+  qlz_state_decompress * ds  = qlz_state_decompress_new(STREAM_BUFFER);
+
+  check(cs != NULL && ds != NULL, "window: allocate states");
+  if (cs != NULL && ds != NULL)
+    {
+      check(qlz_state_compress_set_window(cs, STREAM_BUFFER) == 0
+            && qlz_state_decompress_set_window(ds, STREAM_BUFFER) == 0,
+            "window: as large as the buffer");
+      check(qlz_state_compress_set_window(cs, STREAM_BUFFER / 2) == 1
+            && qlz_state_decompress_set_window(ds, STREAM_BUFFER / 2) == 1,
+            "window: half the buffer");
+      check(qlz_state_compress_set_window(cs, 0) == 1
+            && qlz_state_decompress_set_window(ds, 0) == 1,
+            "window: default");
+    }
+
+  qlz_state_compress_free(cs);
+  qlz_state_decompress_free(ds);
+}
+
+/*
+ * Stream more than the buffer in small packets with a window, so that
+ * the history slides with data in it. One decompressor is given the
+ * window by hand and one learns it from the stream header; one without
+ * the window must fail, which shows that packets refer to the part kept.
+ */
+
+static void
+test_window_stream(int level)
+{
+  qlz_state_compress *   cs      = qlz_state_compress_new(level,
+                                                          STREAM_BUFFER);
+  qlz_state_decompress * ds      = qlz_state_decompress_new(STREAM_BUFFER);
+  qlz_state_decompress * dh      = qlz_state_decompress_new(STREAM_BUFFER);
+  qlz_state_decompress * dn      = qlz_state_decompress_new(STREAM_BUFFER);
+  size_t                 window  = STREAM_BUFFER / 4;
+  unsigned char          message[MESSAGE_SIZE];
+  unsigned char          out[MESSAGE_SIZE];
+  char                   packet[QLZ_COMPRESS_BOUND(MESSAGE_SIZE)];
+  int                    ok      = 1, wrong = 0;
+  int                    i;
+
+  check(cs != NULL && ds != NULL && dh != NULL && dn != NULL,
+        "window stream: allocate states");
+  if (cs != NULL && ds != NULL && dh != NULL && dn != NULL)
+    {
+      check(qlz_state_compress_set_window(cs, window)
+            && qlz_state_decompress_set_window(ds, window),
+            "window stream: set the window");
+      check(qlz_stream_header_write(cs, packet) != 0
+            && qlz_stream_header_read(packet, dh) != 0,
+            "window stream: stream header");
+
+      for (i = 0; i < 3 * STREAM_BUFFER / MESSAGE_SIZE / 2; i++)
+        {
+          fill_message(message, sizeof ( message ), (unsigned int)i);
+          if (qlz_compress(message, packet, sizeof ( message ), cs) == 0
+              || qlz_decompress(packet, out, ds) != sizeof ( message )
+              || memcmp(out, message, sizeof ( message )) != 0
+              || qlz_decompress(packet, out, dh) != sizeof ( message )
+              || memcmp(out, message, sizeof ( message )) != 0)
+            {
+              ok = 0;
+            }
+
+          if (qlz_decompress(packet, out, dn) != sizeof ( message )
+              || memcmp(out, message, sizeof ( message )) != 0)
+            {
+              wrong = 1;
+            }
+        }
+
+      check(ok, "window stream: decode with the window");
+      check(wrong, "window stream: decode without the window fails");
+    }
+
+  qlz_state_compress_free(cs);
+  qlz_state_decompress_free(ds);
+  qlz_state_decompress_free(dh);
+  qlz_state_decompress_free(dn);
+}
+
+#ifdef QLZ_THREADS
+
+/*
+ * Blocks compressed on the pool come back whole, and decompressing
+ * them fails, writing nothing, into a destination one byte short or
+ * from packets cut short.
+ */
+
+static void
+test_parallel(qlz_pool *pool, int level)
+{
+  size_t          size    = 10 * MESSAGE_SIZE + 123;
+  size_t          block   = 3 * MESSAGE_SIZE;
+  size_t          blocks  = ( size - 1 ) / block + 1;
+  unsigned char * message = (unsigned char *)malloc(size);
+  unsigned char * out     = (unsigned char *)malloc(size);
+  char *          packets = (char *)malloc(blocks * QLZ_COMPRESS_BOUND(block));
+  size_t          c;
+
+  check(message != NULL && out != NULL && packets != NULL,
+        "parallel: allocate");
+  if (message != NULL && out != NULL && packets != NULL)
+    {
+      fill_message(message, size, 9);
+      c = qlz_compress_parallel(pool, level, message, packets, size, block);
+      check(c != 0
+            && qlz_decompress_parallel(pool, packets, c, out, size) == size
+            && memcmp(out, message, size) == 0,
+            "parallel: round trip");
+
+      memset(out, 0x5a, size);
+      check(qlz_decompress_parallel(pool, packets, c, out, size - 1) == 0
+            && out[0] == 0x5a && out[size - 1] == 0x5a,
+            "parallel: destination too small");
+      check(qlz_decompress_parallel(pool, packets, c - 1, out, size) == 0
+            && out[0] == 0x5a,
+            "parallel: packets cut short");
+    }
+
+  free(message);
+  free(out);
+  free(packets);
+}
+
+/*
+ * Compress size bytes of source on the pool, as a serial stream of
+ * block bytes at a time would, or in turn with qlz_compress() if pool
+ * is NULL. Returns the size of the packets, or 0 on failure.
+ */
+
+static size_t
+stream_blocks(qlz_pool *pool, qlz_state_compress *state,
+              const unsigned char *source, char *destination, size_t size,
+              size_t block)
+{
+  size_t i, n, c, r = 0;
+
+  if (pool != NULL)
+    {
+      return qlz_compress_stream_parallel(pool, state, source, destination,
+                                          size, block);
+    }
+
+  for (i = 0; i < size; i += n)
+    {
+      n  = size - i < block ? size - i : block;
+      c  = qlz_compress(source + i, destination + r, n, state);
+      if (c == 0)
+        {
+          return 0;
+        }
+
+      r += c;
+    }
+
+  return r;
+}
+
+/*
+ * Compress a stream longer than the buffer on the pool in two calls,
+ * with a serial packet between them, and decompress the packets one
+ * after the other. Returns the size of the packets, or 0 on failure.
+ * With pool NULL, the same stream is compressed serially.
+ */
+
+static size_t
+test_stream_parallel(qlz_pool *pool, int level, size_t buffer, size_t block,
+                     size_t window, const unsigned char *message,
+                     size_t size)
+{
+  qlz_state_compress *   cs      = qlz_state_compress_new(level, buffer);
+  qlz_state_decompress * ds      = qlz_state_decompress_new(buffer);
+  size_t                 first   = size / 3;
+  size_t                 middle  = MESSAGE_SIZE;
+  size_t                 room    = ( size / block + 3 )
+                                   * QLZ_COMPRESS_BOUND(block)
+                                   + QLZ_COMPRESS_BOUND(middle);
+  char *                 packets = (char *)malloc(room);
+  unsigned char *        out     = (unsigned char *)malloc(size);
+  size_t                 c = 0, n, d, r = 0;
+
+  if (cs == NULL || ds == NULL || packets == NULL || out == NULL
+      || !qlz_state_compress_set_window(cs, window)
+      || !qlz_state_decompress_set_window(ds, window))
+    {
+      goto done;
+    }
+
+  n = stream_blocks(pool, cs, message, packets, first, block);
+  if (n == 0)
+    {
+      goto done;
+    }
+
+  c += n;
+  n  = qlz_compress(message + first, packets + c, middle, cs);
+  if (n == 0)
+    {
+      goto done;
+    }
+
+  c += n;
+  n  = stream_blocks(pool, cs, message + first + middle, packets + c,
+                     size - first - middle, block);
+  if (n == 0)
+    {
+      goto done;
+    }
+
+  c += n;
+  for (n = 0, d = 0; n < c && d < size; n += qlz_size_compressed(packets + n))
+    {
+      if (qlz_size_decompressed(packets + n) > size - d
+          || qlz_decompress(packets + n, out + d, ds)
+             != qlz_size_decompressed(packets + n))
+        {
+          goto done;
+        }
+
+      d += qlz_size_decompressed(packets + n);
+    }
+
+  if (n == c && d == size && memcmp(out, message, size) == 0)
+    {
+      r = c;
+    }
+
+done:
+  free(packets);
+  free(out);
+  qlz_state_compress_free(cs);
+  qlz_state_decompress_free(ds);
+  return r;
+}
+
+/*
+ * Streams continued on the pool at each level, for blocks smaller and
+ * larger than the buffer and windows of several sizes. The size of a
+ * level 3 stream is reported against the serial one, which it must
+ * stay within 2% of.
+ */
+
+static void
+test_stream_parallel_all(qlz_pool *pool)
+{
+  static const size_t buffers[] = { 100000, 1000000 };
+  static const size_t blocks[]  = { 7000, 33333, 250000 };
+  static const size_t windows[] = { 0, 20000, 500000 };
+  size_t              size      = 1200000;
+  unsigned char *     message   = (unsigned char *)malloc(size);
+  int                 level;
+  size_t              b, k, w, r, s;
+
+  check(message != NULL, "stream parallel: allocate");
+  if (message == NULL)
+    {
+      return;
+    }
+
+  fill_message(message, size, 11);
+  for (level = 1; level <= 3; level++)
+    {
+      for (b = 0; b < 2; b++)
+        {
+          for (k = 0; k < 3; k++)
+            {
+              for (w = 0; w < 3 && windows[w] < buffers[b]; w++)
+                {
+                  r = test_stream_parallel(pool, level, buffers[b],
+                                           blocks[k], windows[w],
+                                           message, size);
+                  check(r != 0, "stream parallel: round trip");
+                  if (r == 0 || level != 3 || w != 1)
+                    {
+                      continue;
+                    }
+
+                  s = test_stream_parallel(NULL, level, buffers[b],
+                                           blocks[k], windows[w],
+                                           message, size);
+                  printf("  stream parallel: level 3, buffer %7lu, "
+                         "block %6lu: %lu bytes, serial %lu (%.2f%%)\n",
+                         (unsigned long)buffers[b],
+                         (unsigned long)blocks[k], (unsigned long)r,
+                         (unsigned long)s, s ? 100.0 * r / s : 0.0);
+                  check(s != 0 && r <= s + s / 50,
+                        "stream parallel: within 2% of serial");
+                }
+            }
+        }
+    }
+
+  free(message);
+}
+
+#endif /* ifdef QLZ_THREADS */
+
+/*
+ * A dictionary of capacity 0 is empty, whatever the samples.
+ */
+
+static void
+test_train_empty(void)
+{
+  unsigned char  samples[2 * MESSAGE_SIZE];
+  unsigned char  dict[16];
+  size_t         sizes[2] = { MESSAGE_SIZE, MESSAGE_SIZE };
+
+  fill_message(samples, sizeof ( samples ), 3);
+  check(qlz_train_dict(dict, 0, samples, sizes, 2) == 0,
+        "train: capacity 0");
+}
+
+int
+main(void)
+{
+  int level;
+#ifdef QLZ_THREADS
+  qlz_pool *pool = qlz_pool_new(3);
+#endif /* ifdef QLZ_THREADS */
+
+  for (level = 1; level <= 3; level++)
+    {
+      test_partial_zero(level);
+      test_compressv(level, QLZ_GATHER_STACK / 2);
+      test_compressv(level, QLZ_GATHER_STACK * 4);
+    }
+
+  test_small();
+  test_batch();
+  for (level = 1; level <= 3; level++)
+    {
+      test_bound(level);
+      test_inplace(level);
+      test_reserve_view(level, 0);
+      test_reserve_view(level, RESERVE_BUFFER / 4);
+    }
+
+  for (level = 1; level <= 3; level++)
+    {
+      test_dict(level);
+    }
+
+  test_window();
+  for (level = 1; level <= 3; level++)
+    {
+      test_window_stream(level);
+    }
+
+  test_train_empty();
+
+#ifdef QLZ_THREADS
+    check(pool != NULL, "parallel: create the pool");
+    for (level = 1; pool != NULL && level <= 3; level++)
+      {
+        test_parallel(pool, level);
+      }
+
+    if (pool != NULL)
+      {
+        test_stream_parallel_all(pool);
+      }
+
+    qlz_pool_free(pool);
+#endif /* ifdef QLZ_THREADS */
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,229 @@
+/* SPDX-License-Identifier: GPL-1.0-only OR GPL-2.0-only OR GPL-3.0-only */
+
+/*
+ * qztest.cpp -- checks the C++ front end of
+ *               quicklz in quicklz.hpp.
+ */
+
+/*
+ * Copyright (c) 2006-2011 Lasse Mikkel Reinhold <lar@quicklz.com>
+ * Copyright (c) 2023 Jeffrey H. Johnson <trnsz@pobox.com>
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "quicklz.hpp"
+
+#define STREAM_BUFFER  100000
+#define MESSAGES       40
+#define MESSAGE_SIZE   4000
+
+static int failures = 0;
+
+static void
+check(bool ok, const char *what)
+{
+  if (!ok)
+    {
+      std::fprintf(stderr, "qztest_cpp: FAILED: %s\n", what);
+      failures++;
+    }
+}
+
+/* Words from a small vocabulary, as in qztest.c */
+static void
+fill_message(unsigned char *message, std::size_t size, unsigned int seed)
+{
+  static const char *words[] = {
+    "alpha ", "bravo ", "charlie ", "delta ", "echo ", "foxtrot ",
+    "golf ", "hotel ", "india ", "juliet ", "kilo ", "lima "
+  };
+  std::size_t i = 0;
+
+  while (i < size)
+    {
+      const char *w = words[( seed >> 8 ) % 12];
+      std::size_t n = std::strlen(w);
+
+      seed = seed * 1103515245u + 12345u;
+      if (n > size - i)
+        {
+          n = size - i;
+        }
+
+      std::memcpy(message + i, w, n);
+      i += n;
+    }
+}
+
+/*
+ * Stream messages through c and d, which must already agree, and check
+ * that every message comes back.
+ */
+
+template <typename C, typename D>
+static void
+round_trip(C &c, D &d, unsigned int seed, const char *what)
+{
+  std::vector<unsigned char>  message(MESSAGE_SIZE), out(MESSAGE_SIZE);
+  std::vector<char>           packet(qlz::bound(MESSAGE_SIZE));
+  bool                        ok = true;
+
+  for (int i = 0; i < MESSAGES; i++)
+    {
+      fill_message(message.data(), message.size(), seed + i);
+      if (c.compress(message.data(), message.size(), packet.data()) == 0
+          || d.decompress(packet.data(), out.data()) != message.size()
+          || out != message)
+        {
+          ok = false;
+        }
+    }
+
+  check(ok, what);
+}
+
+template <int Level>
+static void
+test_level()
+{
+  qlz::compressor<Level>                      c;
+  qlz::decompressor<Level>                    d;
+  qlz::compressor<Level, STREAM_BUFFER>       cs;
+  qlz::decompressor<Level, STREAM_BUFFER>     ds;
+
+  round_trip(c, d, 1, "round trip");
+  round_trip(cs, ds, 2, "streaming round trip");
+
+  /* The buffer overflows several times with a window kept */
+  check(!cs.window(STREAM_BUFFER) && !ds.window(STREAM_BUFFER),
+        "window as large as the buffer");
+  cs.reset();
+  ds.reset();
+  check(cs.window(STREAM_BUFFER / 3) && ds.window(STREAM_BUFFER / 3),
+        "window");
+  round_trip(cs, ds, 3, "round trip with a window");
+
+  /* Moved objects carry on with the stream */
+  qlz::compressor<Level, STREAM_BUFFER>   cm(std::move(cs));
+  qlz::decompressor<Level, STREAM_BUFFER> dm(std::move(ds));
+
+  round_trip(cm, dm, 4, "round trip after a move");
+}
+
+/* Each message from a copy of a state that loaded the dictionary */
+static void
+test_dict()
+{
+  qlz::compressor<3, STREAM_BUFFER>     cdict, c;
+  qlz::decompressor<3, STREAM_BUFFER>   ddict, d;
+  std::vector<unsigned char>            dict(8000), message(MESSAGE_SIZE);
+  std::vector<unsigned char>            out(MESSAGE_SIZE);
+  std::vector<char>                     packet(qlz::bound(MESSAGE_SIZE));
+  bool                                  ok = true;
+
+  fill_message(dict.data(), dict.size(), 5);
+  check(cdict.load_dict(dict.data(), dict.size())
+        && ddict.load_dict(dict.data(), dict.size()), "load_dict");
+  for (int i = 0; i < 4; i++)
+    {
+      c.assign(cdict);
+      d.assign(ddict);
+      fill_message(message.data(), message.size(), 6 + i);
+      if (c.compress(message.data(), message.size(), packet.data()) == 0
+          || d.decompress(packet.data(), out.data()) != message.size()
+          || out != message)
+        {
+          ok = false;
+        }
+    }
+
+  check(ok, "round trip from a dictionary");
+}
+
+static void
+test_misc()
+{
+  qlz::compressor<3>          c;
+  qlz::decompressor<3>        d;
+  std::vector<unsigned char>  message(MESSAGE_SIZE), out(MESSAGE_SIZE);
+  std::vector<char>           packet(qlz::bound(MESSAGE_SIZE));
+
+  fill_message(message.data(), message.size(), 7);
+
+  c.acceleration(8);
+  check(c.compress(message.data(), message.size(), packet.data()) != 0
+        && d.decompress(packet.data(), out.data()) == message.size()
+        && out == message, "acceleration");
+
+  check(qlz::compress_small(message.data(), message.size(), packet.data())
+        != 0
+        && d.decompress_partial(packet.data(), out.data(), 100) == 100
+        && std::memcmp(out.data(), message.data(), 100) == 0,
+        "compress_small and decompress_partial");
+
+  /* A batch on a streaming decompressor, after a single packet */
+  {
+    qlz::compressor<2, STREAM_BUFFER>     cs;
+    qlz::decompressor<2, STREAM_BUFFER>   ds;
+    std::vector<unsigned char>            all(4 * MESSAGE_SIZE);
+    std::vector<unsigned char>            back(4 * MESSAGE_SIZE);
+    std::vector<char>                     stream(4
+                                                 * qlz::bound(MESSAGE_SIZE));
+    qlz_batch                             batch[3];
+    std::size_t                           used = 0;
+
+    fill_message(all.data(), all.size(), 8);
+    for (int i = 0; i < 4; i++)
+      {
+        if (i > 0)
+          {
+            batch[i - 1].source       = stream.data() + used;
+            batch[i - 1].destination  = reinterpret_cast<char *>(
+              back.data() + i * MESSAGE_SIZE);
+          }
+
+        used += cs.compress(all.data() + i * MESSAGE_SIZE, MESSAGE_SIZE,
+                            stream.data() + used);
+      }
+
+    check(ds.decompress(stream.data(), back.data()) == MESSAGE_SIZE
+          && ds.decompress_batch(batch, 3) == 3 * MESSAGE_SIZE
+          && back == all, "decompress_batch");
+  }
+
+# ifdef QLZ_HAVE_SPAN
+    std::span<const std::byte> source(
+      reinterpret_cast<const std::byte *>(message.data()), message.size());
+    std::size_t n = c.compress(source, std::span<char>(packet));
+
+    check(n != 0
+          && d.decompress(std::span<const char>(packet.data(), n),
+                          std::as_writable_bytes(std::span<unsigned char>(
+                                                   out)))
+          == message.size()
+          && out == message, "span round trip");
+    check(c.compress(source, std::span<char>(packet.data(), 10)) == 0,
+          "span destination too small");
+    check(d.decompress(std::span<const char>(packet.data(), n - 1),
+                       std::as_writable_bytes(std::span<unsigned char>(
+                                                out))) == 0,
+          "span source too small");
+# endif /* ifdef QLZ_HAVE_SPAN */
+}
+
+int
+main()
+{
+  test_level<1>();
+  test_level<2>();
+  test_level<3>();
+  test_dict();
+  test_misc();
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}